@@ -6,40 +6,38 @@
 #include <pthread.h>
 #include <stdexcept>
 #include <cassert>
-#include "circular_buffer.h"
+#include "spsc_buffer.h"
 #include "cast.h"
+#include "util.h"
 #include "codecs/codec_flac.h"
-#include <signal.h>
+
+#define FMICE_ICECAST_STAGING_SIZE 65536 // Initial size of the encoder output buffer; grows as needed
 
 static int is_icecast_initialized = 0;
 
 fmice_icecast::fmice_icecast(int channels, int sampRate, fmice_codec* codec) :
-    input_buffer(FMICE_BLOCK_SIZE * FMICE_BLOCK_COUNT)
+    mount_count(0),
+    header(nullptr),
+    input_buffer(FMICE_BLOCK_SIZE * FMICE_BLOCK_COUNT),
+    staging_len(FMICE_ICECAST_STAGING_SIZE),
+    staging_use(0),
+    codec_error(false),
+    generation(0),
+    encode_time(0)
 {
     //Set
     this->channels = channels;
     this->sample_rate = sampRate;
     this->codec = codec;
-    this->shout = nullptr;
-    this->working_buffer = 0;
 
     //Init mutex
     if (pthread_mutex_init(&mutex, NULL) != 0)
         throw new std::runtime_error("Failed to initialize mutex.");
 
-    //Allocate working buffer
-    working_buffer = (float*)malloc(FMICE_BLOCK_SIZE * sizeof(float));
-    if (working_buffer == 0)
-        throw new std::runtime_error("Failed to allocate working buffer.");
-
-    //Clear setup/stat vars
-    memset(icecast_host, 0, sizeof(icecast_host));
-    icecast_port = 0;
-    memset(icecast_mount, 0, sizeof(icecast_mount));
-    memset(icecast_username, 0, sizeof(icecast_username));
-    memset(icecast_password, 0, sizeof(icecast_password));
-    stat_status = FMICE_ICECAST_STATUS_INIT;
-    stat_retries = 0;
+    //Allocate staging buffer
+    staging = (uint8_t*)malloc(staging_len);
+    if (staging == NULL)
+        throw new std::runtime_error("Failed to allocate staging buffer.");
 
     //Init global icecast if it's not
     if (!is_icecast_initialized)
@@ -48,66 +46,48 @@ fmice_icecast::fmice_icecast(int channels, int sampRate, fmice_codec* codec) :
 }
 
 fmice_icecast::~fmice_icecast() {
+    //Free staging buffer
+    free(staging);
+
     //Destroy mutex
     pthread_mutex_destroy(&mutex);
 }
 
-void fmice_icecast::set_host(const char* hostname) {
-    strncpy(icecast_host, hostname, sizeof(icecast_host) - 1);
-    icecast_host[sizeof(icecast_host) - 1] = 0;
-}
-
-void fmice_icecast::set_port(unsigned int port) {
-    icecast_port = port;
-}
-
-void fmice_icecast::set_mount(const char* mount) {
-    strncpy(icecast_mount, mount, sizeof(icecast_mount) - 1);
-    icecast_mount[sizeof(icecast_mount) - 1] = 0;
-}
+fmice_icecast_conn* fmice_icecast::add_mount() {
+    //Sanity check
+    if (mount_count == FMICE_ICECAST_MAX_MOUNTS)
+        return nullptr;
 
-void fmice_icecast::set_username(const char* username) {
-    strncpy(icecast_username, username, sizeof(icecast_username) - 1);
-    icecast_username[sizeof(icecast_username) - 1] = 0;
+    //Create
+    fmice_icecast_conn* mount = new fmice_icecast_conn(this, codec);
+    mounts[mount_count++] = mount;
+    return mount;
 }
 
-void fmice_icecast::set_password(const char* password) {
-    strncpy(icecast_password, password, sizeof(icecast_password) - 1);
-    icecast_password[sizeof(icecast_password) - 1] = 0;
+int fmice_icecast::get_mount_count() {
+    return mount_count;
 }
 
-int fmice_icecast::get_status() {
-    pthread_mutex_lock(&mutex);
-    int result = stat_status;
-    pthread_mutex_unlock(&mutex);
-    return result;
-}
-
-int fmice_icecast::get_retries() {
-    pthread_mutex_lock(&mutex);
-    int result = stat_retries;
-    pthread_mutex_unlock(&mutex);
-    return result;
+fmice_icecast_conn* fmice_icecast::get_mount(int index) {
+    assert(index >= 0 && index < mount_count);
+    return mounts[index];
 }
 
-void fmice_icecast::set_status(int req) {
-    pthread_mutex_lock(&mutex);
-    stat_status = req;
-    pthread_mutex_unlock(&mutex);
+int64_t fmice_icecast::get_clipped_samples() {
+    return codec->get_clipped_samples();
 }
 
-void fmice_icecast::inc_retries() {
-    pthread_mutex_lock(&mutex);
-    stat_retries++;
-    pthread_mutex_unlock(&mutex);
+int fmice_icecast::get_encode_time() {
+    return encode_time.load(std::memory_order_relaxed);
 }
 
 bool fmice_icecast::is_configured() {
-    return strlen(icecast_host) > 0 &&
-        icecast_port > 0 &&
-        strlen(icecast_mount) > 0 &&
-        strlen(icecast_username) > 0 &&
-        strlen(icecast_password);
+    //Check each mount
+    for (int i = 0; i < mount_count; i++) {
+        if (!mounts[i]->is_configured())
+            return false;
+    }
+    return mount_count > 0;
 }
 
 void fmice_icecast::init() {
@@ -115,13 +95,14 @@ void fmice_icecast::init() {
     if (!is_configured())
         throw new std::runtime_error("Icecast is not configured.");
 
-    //Start worker thread
-    pthread_create(&worker_thread, NULL, work_static, this);
-}
+    //Start the codec now so the headers are ready before any mount connects
+    codec->set_callback(encoder_callback_static, this);
+    reset_codec();
 
-void fmice_icecast::push(dsp::stereo_t* samples, int count) {
-    // Double up and use the regular float status.
-    push((float*)samples, count * 2);
+    //Start worker thread, then the connections
+    pthread_create(&worker_thread, NULL, work_static, this);
+    for (int i = 0; i < mount_count; i++)
+        mounts[i]->init();
 }
 
 void fmice_icecast::push(float* samples, int count) {
@@ -133,91 +114,121 @@ void fmice_icecast::push(float* samples, int count) {
         printf("Codec buffer overrun! Dropped %i samples.\n", count - written);
 }
 
+void fmice_icecast::stop() {
+    //Mark the end of the input and wait for the worker to encode it
+    input_buffer.close();
+    pthread_join(worker_thread, NULL);
+
+    //Then let every mount finish sending together, and wait for them all
+    for (int i = 0; i < mount_count; i++)
+        mounts[i]->stop();
+    for (int i = 0; i < mount_count; i++)
+        mounts[i]->join();
+}
+
+static const char* ICECAST_STATUS_NAMES[4] = {
+    "init",
+    "connecting",
+    "ok",
+    "lost"
+};
+
+int fmice_icecast::format_status(char* output, const char* name) {
+    //Format the encoder, then each mount, numbering all but the first
+    char* start = output;
+    output += sprintf(output, "%s_icecast_clipped=%lli; %s_icecast_encode_us=%i; ", name, (long long)get_clipped_samples(), name, get_encode_time());
+    for (int i = 0; i < mount_count; i++) {
+        fmice_icecast_conn* mount = mounts[i];
+        char index[16] = "";
+        if (i > 0)
+            sprintf(index, "%i", i + 1);
+        output += sprintf(output, "%s_icecast%s=[status=%s; retries=%i; dropped=%i; bytes_per_send=%i]; ", name, index, ICECAST_STATUS_NAMES[mount->get_status()], mount->get_retries(), mount->get_dropped_packets(), mount->get_bytes_per_send());
+    }
+    return (int)(output - start);
+}
+
+fmice_icecast_packet* fmice_icecast::get_header() {
+    pthread_mutex_lock(&mutex);
+    fmice_icecast_packet* result = header;
+    if (result != nullptr)
+        fmice_icecast_packet_retain(result);
+    pthread_mutex_unlock(&mutex);
+    return result;
+}
+
 void* fmice_icecast::work_static(void* ctx) {
     ((fmice_icecast*)ctx)->work();
     return 0;
 }
 
 void fmice_icecast::work() {
-    //Disable signal from icecast so we handle it ourselves (this caused me much anguish)
-    sigset_t set;
-    sigemptyset(&set);
-    sigaddset(&set, SIGPIPE);
-    pthread_sigmask(SIG_BLOCK, &set, NULL);
-
     //Enter main loop
     while (1) {
-        //Read from input buffer
-        size_t read = input_buffer.read(working_buffer, FMICE_BLOCK_SIZE);
-        assert((read % channels) == 0);
-        read /= channels;
-
-        //Check if there is an existing connection - If not, create one
-        if (shout == nullptr) {
-            if (!icecast_create())
-                continue; // Failed to connect...try again later
+        //Wait for a block in the input buffer - The codec works on it in place. None comes once stopped and drained.
+        float* block = input_buffer.acquire_read(FMICE_BLOCK_SIZE);
+        if (block == NULL)
+            break;
+        size_t read = FMICE_BLOCK_SIZE / channels;
+
+        //Encode once for every mount
+        int64_t start = fmice_now_ns();
+        codec->process(block, read);
+        encode_time.store((int)((fmice_now_ns() - start) / 1000), std::memory_order_relaxed);
+
+        //Give the block back
+        input_buffer.release_read(FMICE_BLOCK_SIZE);
+
+        //On error, start a fresh stream - Every mount has to reconnect to pick up the new headers
+        if (codec_error) {
+            printf("[CAST] Codec encountered an error. Restarting stream...\n");
+            reset_codec();
+            for (int i = 0; i < mount_count; i++)
+                mounts[i]->request_reconnect(generation);
+            continue;
         }
 
-        //Submit to encoder where it will be handled
-        codec->process(working_buffer, read);
+        //Send
+        flush_staging();
     }
-}
-
-bool fmice_icecast::icecast_create() {
-    //Sanity check
-    assert(shout == nullptr);
 
-    //Set status
-    set_status(FMICE_ICECAST_STATUS_CONNECTING);
+    //Stopped - Encode the partial block left behind, end the stream and send it all
+    size_t left = input_buffer.get_use();
+    if (left > 0) {
+        codec->process(input_buffer.acquire_read(left), left / channels);
+        input_buffer.release_read(left);
+    }
+    codec->finish();
+    flush_staging();
+}
 
-    //Allocate shoutcast
-    printf("[CAST] Connecting to Icecast...\n");
-    shout = shout_new();
-    assert(shout != NULL);
+void fmice_icecast::reset_codec() {
+    //Reset, collecting the headers it writes - Everything from here on belongs to a new stream
+    staging_use = 0;
+    codec_error = false;
+    generation++;
+    codec->reset();
 
-    //Set up paramters
+    //Swap in the new headers
+    fmice_icecast_packet* next = staging_use > 0 ? fmice_icecast_packet_alloc(staging, staging_use, 1, generation) : nullptr;
     pthread_mutex_lock(&mutex);
-    shout_set_host(shout, icecast_host);
-    shout_set_protocol(shout, SHOUT_PROTOCOL_HTTP);
-    shout_set_port(shout, icecast_port);
-    shout_set_password(shout, icecast_password);
-    shout_set_mount(shout, icecast_mount);
-    shout_set_user(shout, icecast_username);
-    codec->configure_shout(shout); // Sets content type
+    fmice_icecast_packet* last = header;
+    header = next;
     pthread_mutex_unlock(&mutex);
-
-    //Connect
-    if (shout_open(shout) == SHOUTERR_SUCCESS) {
-        //Set status
-        set_status(FMICE_ICECAST_STATUS_OK);
-
-        //Reset codec
-        codec->set_callback(encoder_callback_static, this);
-        codec->reset();
-
-        return true;
-    }
-    else {
-        //Error establishing connection. Wait and try again
-        printf("[CAST] Failed to establish connection. Retrying shortly...\n");
-        //sleep(3);
-
-        //Destroy connection
-        icecast_destroy();
-
-        return false;
-    }
+    if (last != nullptr)
+        fmice_icecast_packet_release(last);
+    staging_use = 0;
 }
 
-void fmice_icecast::icecast_destroy() {
-    //Destroy shoutcast
-    printf("[CAST] Disconnecting from Icecast...\n");
-    set_status(FMICE_ICECAST_STATUS_CONNECTION_LOST);
-    assert(shout != nullptr);
-    inc_retries();
-    shout_close(shout);
-    shout_free(shout);
-    shout = nullptr;
+void fmice_icecast::flush_staging() {
+    //Nothing to do if the encoder is holding on to it
+    if (staging_use == 0)
+        return;
+
+    //Wrap it up and hand a reference to each mount
+    fmice_icecast_packet* packet = fmice_icecast_packet_alloc(staging, staging_use, mount_count, generation);
+    for (int i = 0; i < mount_count; i++)
+        mounts[i]->push(packet);
+    staging_use = 0;
 }
 
 void fmice_icecast::encoder_callback_static(const uint8_t* data, int count, void* context) {
@@ -225,18 +236,22 @@ void fmice_icecast::encoder_callback_static(const uint8_t* data, int count, void
 }
 
 void fmice_icecast::encoder_callback(const uint8_t* data, int count) {
-    //If a connection is established and there is data, write
-    if (shout != nullptr && count > 0) {
-        //Send
-        if (shout_send(shout, data, count) != SHOUTERR_SUCCESS) {
-            printf("[CAST] Failed to send packet to Icecast.\n");
-            icecast_destroy();
-        }
-    }
-
     //Check if there is an encoder error
     if (count < 0) {
-        printf("[CAST] Codec encountered an error. Disconnecting...\n");
-        icecast_destroy();
+        codec_error = true;
+        return;
     }
-}
\ No newline at end of file
+
+    //Grow the staging buffer if needed
+    if (staging_use + count > staging_len) {
+        while (staging_use + count > staging_len)
+            staging_len *= 2;
+        staging = (uint8_t*)realloc(staging, staging_len);
+        if (staging == NULL)
+            throw new std::runtime_error("Failed to grow staging buffer.");
+    }
+
+    //Collect
+    memcpy(&staging[staging_use], data, count);
+    staging_use += count;
+}
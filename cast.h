@@ -1,77 +1,104 @@
 #pragma once
 
 #include "codec.h"
+#include "cast_conn.h"
+#include "output.h"
 #include <stdint.h>
-#include <shout/shout.h>
+#include <atomic>
+#include <pthread.h>
 #include <dsp/types.h>
-#include "circular_buffer.h"
+#include "spsc_buffer.h"
 
-#define FMICE_ICECAST_STATUS_INIT 0
-#define FMICE_ICECAST_STATUS_CONNECTING 1
-#define FMICE_ICECAST_STATUS_OK 2
-#define FMICE_ICECAST_STATUS_CONNECTION_LOST 3
+#define FMICE_ICECAST_MAX_MOUNTS 8
 
-class fmice_icecast {
+/// <summary>
+/// Encodes a stream once and fans it out to one or more Icecast mounts. Each block is encoded into a single packet, which every
+/// mount's connection sends on its own thread.
+/// </summary>
+class fmice_icecast : public fmice_output {
 
 public:
 	fmice_icecast(int channels, int sampRate, fmice_codec* codec);
 	~fmice_icecast();
 
-	void set_host(const char* hostname);
-	void set_port(unsigned int port);
-	void set_mount(const char* mount);
-	void set_username(const char* username);
-	void set_password(const char* password);
+	/// <summary>
+	/// Adds a mount to send the stream to and returns it so it can be configured. Call before init.
+	/// </summary>
+	fmice_icecast_conn* add_mount();
 
-	int get_status();
-	int get_retries();
+	int get_mount_count();
+	fmice_icecast_conn* get_mount(int index);
 
-	bool is_configured();
-	void init();
+	/// <summary>
+	/// Gets the total number of samples the codec had to clip. Thread safe.
+	/// </summary>
+	int64_t get_clipped_samples();
+
+	/// <summary>
+	/// Gets how long the codec took to encode the last block, in microseconds. Thread safe.
+	/// </summary>
+	int get_encode_time();
 
-	void push(dsp::stereo_t* samples, int count);
+	/// <summary>
+	/// True if there is at least one mount and all of them are configured.
+	/// </summary>
+	bool is_configured();
+	void init() override;
 
 	/// <summary>
 	/// Pushes data into the queue. Thread safe to be called from the radio thread.
 	/// </summary>
 	/// <param name="samples"></param>
 	/// <param name="count"></param>
-	void push(float* samples, int count);
+	void push(float* samples, int count) override;
+
+	int format_status(char* output, const char* name) override;
+
+	/// <summary>
+	/// Encodes the rest of the input, then waits for each mount to finish sending the end of the stream and hang up.
+	/// </summary>
+	void stop() override;
+
+	/// <summary>
+	/// Gets the stream headers the codec emitted when it was last reset, with a reference added, or NULL if there are none. Thread safe.
+	/// </summary>
+	fmice_icecast_packet* get_header();
 
 private:
 	int channels;
 	int sample_rate;
 
-	// Stats and settable settings - Protected by the mutex
+	fmice_icecast_conn* mounts[FMICE_ICECAST_MAX_MOUNTS];
+	int mount_count;
+
+	// Header - Protected by the mutex
 	pthread_mutex_t mutex;
-	char icecast_host[256];
-	unsigned short icecast_port;
-	char icecast_mount[256];
-	char icecast_username[256];
-	char icecast_password[256];
-	int stat_status;
-	int stat_retries;
+	fmice_icecast_packet* header;
 
 	// Worker thread access ONLY
-	shout_t* shout;
-	float* working_buffer;
-
 	fmice_codec* codec;
-	fmice_circular_buffer<float> input_buffer;
+	fmice_spsc_buffer<float> input_buffer; // Written only by the radio thread, read only by the worker
 	pthread_t worker_thread;
+	uint8_t* staging; // Encoder output collected until the end of the block
+	int staging_len;
+	int staging_use;
+	bool codec_error;
+	int generation; // Bumped each time the codec is reset and a new stream starts
+
+	std::atomic<int> encode_time; // Microseconds
 
 	static void* work_static(void* ctx);
 	void work();
 
 	/// <summary>
-	/// Connects to Icecast. CALLED ONLY BY WORKER. Returns true on success, otherwise false.
+	/// Resets the codec and keeps what it emits as the new stream headers. CALLED ONLY BY WORKER.
 	/// </summary>
-	bool icecast_create();
-	
+	void reset_codec();
+
 	/// <summary>
-	/// Disconnects from icecast. CALLED ONLY BY WORKER.
+	/// Sends everything the encoder emitted to each mount as one packet. CALLED ONLY BY WORKER.
 	/// </summary>
-	void icecast_destroy();
+	void flush_staging();
 
 	/// <summary>
 	/// Callback on worker thread from the encoder, dummy static stub.
@@ -89,7 +116,4 @@ private:
 	/// <param name="count"></param>
 	void encoder_callback(const uint8_t* data, int count);
 
-	void set_status(int status);
-	void inc_retries();
-
 };
\ No newline at end of file
@@ -0,0 +1,622 @@
+#include "cast_conn.h"
+#include "cast.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <new>
+#include <stdexcept>
+#include <cassert>
+#include <algorithm>
+#include <climits>
+
+#define FMICE_ICECAST_CONN_BACKOFF_MIN 500 // Milliseconds before the first retry
+#define FMICE_ICECAST_CONN_BACKOFF_MAX 60000 // Milliseconds the retry delay tops out at
+#define FMICE_ICECAST_CONN_TIMEOUT 15 // Seconds a connect or send may go without progress before giving up
+#define FMICE_ICECAST_CONN_MAX_PENDING (256 * 1024) // Bytes libshout may hold before we stop handing it more
+#define FMICE_ICECAST_CONN_POLL_MS 20 // Milliseconds between checks while libshout is busy
+#define FMICE_ICECAST_CONN_WAIT_MS 250 // Milliseconds to wait for a packet before checking in again
+#define FMICE_ICECAST_CONN_SEGMENT 1448 // Bytes per batch alignment unit, one TCP segment on a 1500 byte MTU
+#define FMICE_ICECAST_CONN_BATCH_MAX (64 * 1024) // Bytes collected before sending without waiting for more
+#define FMICE_ICECAST_CONN_BATCH_MS 50 // Milliseconds a partial segment may wait for more data
+#define FMICE_ICECAST_CONN_REPLAY_SPEED 4 // Times real time a backlog is replayed at after reconnecting
+#define FMICE_ICECAST_CONN_INFLIGHT_SIZE 256 // Initial in-flight packet slots, grown as needed
+#define FMICE_ICECAST_CONN_STOP_TIMEOUT 5 // Seconds to keep trying to send the end of the stream while no server is connected
+
+fmice_icecast_packet* fmice_icecast_packet_alloc(const uint8_t* data, int size, int refs, int generation) {
+    //Allocate the packet and its data together
+    void* mem = malloc(sizeof(fmice_icecast_packet) + size);
+    if (mem == NULL)
+        throw new std::runtime_error("Failed to allocate packet.");
+
+    //Set up
+    fmice_icecast_packet* packet = new (mem) fmice_icecast_packet;
+    packet->refs.store(refs, std::memory_order_relaxed);
+    packet->time = fmice_now_ns();
+    packet->generation = generation;
+    packet->size = size;
+    packet->data = (uint8_t*)(packet + 1);
+    memcpy(packet->data, data, size);
+
+    return packet;
+}
+
+void fmice_icecast_packet_retain(fmice_icecast_packet* packet) {
+    packet->refs.fetch_add(1, std::memory_order_relaxed);
+}
+
+void fmice_icecast_packet_release(fmice_icecast_packet* packet) {
+    if (packet->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        packet->~fmice_icecast_packet();
+        free(packet);
+    }
+}
+
+fmice_icecast_conn::fmice_icecast_conn(fmice_icecast* parent, fmice_codec* codec) :
+    parent(parent),
+    codec(codec),
+    backlog_seconds(FMICE_ICECAST_DEFAULT_BACKLOG),
+    dropped_packets(0),
+    reconnect_requested(false),
+    reconnect_generation(0),
+    stop_requested(false),
+    stop_deadline(0),
+    stat_sends(0),
+    stat_bytes_sent(0),
+    shout(nullptr),
+    connecting(false),
+    connect_started(0),
+    next_attempt(0),
+    backoff_ms(FMICE_ICECAST_CONN_BACKOFF_MIN),
+    last_progress(0),
+    last_queuelen(0),
+    jitter_seed((unsigned int)(uintptr_t)this ^ (unsigned int)fmice_now_ns()),
+    batch(nullptr),
+    batch_len(FMICE_ICECAST_CONN_BATCH_MAX),
+    batch_use(0),
+    batch_started(0),
+    inflight(nullptr),
+    inflight_len(FMICE_ICECAST_CONN_INFLIGHT_SIZE),
+    inflight_count(0),
+    inflight_batched(0),
+    stream_appended(0),
+    stream_handed(0),
+    replay_wall_start(0),
+    replay_stream_start(0),
+    queue(FMICE_ICECAST_CONN_QUEUE_SIZE)
+{
+    //Init mutex
+    if (pthread_mutex_init(&mutex, NULL) != 0)
+        throw new std::runtime_error("Failed to initialize mutex.");
+
+    //Allocate batch
+    batch = (uint8_t*)malloc(batch_len);
+    if (batch == NULL)
+        throw new std::runtime_error("Failed to allocate batch buffer.");
+
+    //Allocate in-flight list
+    inflight = (fmice_icecast_inflight*)malloc(sizeof(fmice_icecast_inflight) * inflight_len);
+    if (inflight == NULL)
+        throw new std::runtime_error("Failed to allocate in-flight list.");
+
+    //Clear setup/stat vars
+    memset(icecast_host, 0, sizeof(icecast_host));
+    icecast_port = 0;
+    memset(icecast_mount, 0, sizeof(icecast_mount));
+    memset(icecast_username, 0, sizeof(icecast_username));
+    memset(icecast_password, 0, sizeof(icecast_password));
+    stat_status = FMICE_ICECAST_STATUS_INIT;
+    stat_retries = 0;
+}
+
+fmice_icecast_conn::~fmice_icecast_conn() {
+    //Destroy mutex
+    pthread_mutex_destroy(&mutex);
+
+    //Free batch
+    free(batch);
+    free(inflight);
+}
+
+void fmice_icecast_conn::set_host(const char* hostname) {
+    strncpy(icecast_host, hostname, sizeof(icecast_host) - 1);
+    icecast_host[sizeof(icecast_host) - 1] = 0;
+}
+
+void fmice_icecast_conn::set_port(unsigned int port) {
+    icecast_port = port;
+}
+
+void fmice_icecast_conn::set_mount(const char* mount) {
+    strncpy(icecast_mount, mount, sizeof(icecast_mount) - 1);
+    icecast_mount[sizeof(icecast_mount) - 1] = 0;
+}
+
+void fmice_icecast_conn::set_username(const char* username) {
+    strncpy(icecast_username, username, sizeof(icecast_username) - 1);
+    icecast_username[sizeof(icecast_username) - 1] = 0;
+}
+
+void fmice_icecast_conn::set_password(const char* password) {
+    strncpy(icecast_password, password, sizeof(icecast_password) - 1);
+    icecast_password[sizeof(icecast_password) - 1] = 0;
+}
+
+void fmice_icecast_conn::set_backlog(int seconds) {
+    backlog_seconds = seconds;
+}
+
+int fmice_icecast_conn::get_status() {
+    pthread_mutex_lock(&mutex);
+    int result = stat_status;
+    pthread_mutex_unlock(&mutex);
+    return result;
+}
+
+int fmice_icecast_conn::get_retries() {
+    pthread_mutex_lock(&mutex);
+    int result = stat_retries;
+    pthread_mutex_unlock(&mutex);
+    return result;
+}
+
+int fmice_icecast_conn::get_dropped_packets() {
+    return dropped_packets.load(std::memory_order_relaxed);
+}
+
+int fmice_icecast_conn::get_bytes_per_send() {
+    int64_t sends = stat_sends.load(std::memory_order_relaxed);
+    return sends > 0 ? (int)(stat_bytes_sent.load(std::memory_order_relaxed) / sends) : 0;
+}
+
+void fmice_icecast_conn::set_status(int req) {
+    pthread_mutex_lock(&mutex);
+    stat_status = req;
+    pthread_mutex_unlock(&mutex);
+}
+
+void fmice_icecast_conn::inc_retries() {
+    pthread_mutex_lock(&mutex);
+    stat_retries++;
+    pthread_mutex_unlock(&mutex);
+}
+
+bool fmice_icecast_conn::is_configured() {
+    return strlen(icecast_host) > 0 &&
+        icecast_port > 0 &&
+        strlen(icecast_mount) > 0 &&
+        strlen(icecast_username) > 0 &&
+        strlen(icecast_password);
+}
+
+void fmice_icecast_conn::init() {
+    //Start worker thread
+    pthread_create(&worker_thread, NULL, work_static, this);
+}
+
+void fmice_icecast_conn::push(fmice_icecast_packet* packet) {
+    //Queue, or drop it if this connection has fallen too far behind
+    if (queue.write(&packet, 1) != 1) {
+        fmice_icecast_packet_release(packet);
+        dropped_packets.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+void fmice_icecast_conn::request_reconnect(int generation) {
+    reconnect_generation.store(generation, std::memory_order_relaxed);
+    reconnect_requested.store(true, std::memory_order_release);
+}
+
+void fmice_icecast_conn::stop() {
+    //Nothing more is coming - The worker sends what's left and exits
+    stop_deadline = fmice_now_ns() + (int64_t)FMICE_ICECAST_CONN_STOP_TIMEOUT * 1000000000LL;
+    queue.close();
+    stop_requested.store(true, std::memory_order_release);
+}
+
+void fmice_icecast_conn::join() {
+    pthread_join(worker_thread, NULL);
+}
+
+void* fmice_icecast_conn::work_static(void* ctx) {
+    ((fmice_icecast_conn*)ctx)->work();
+    return 0;
+}
+
+void fmice_icecast_conn::work() {
+    //Disable signal from icecast so we handle it ourselves (this caused me much anguish)
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    //Enter main loop
+    while (1) {
+        //Once stopped, finish sending what's left, but don't wait forever on a server that isn't there
+        if (stop_requested.load(std::memory_order_acquire)) {
+            if (shout != nullptr && !connecting) {
+                if (queue.get_use() == 0 && inflight_count == 0 && batch_use == 0 && shout_queuelen(shout) == 0)
+                    break;
+                if (queue.get_use() == 0)
+                    usleep(FMICE_ICECAST_CONN_POLL_MS * 1000); // Only libshout is left to drain, and the closed queue won't wait for us
+            }
+            else if (fmice_now_ns() >= stop_deadline) {
+                printf("[CAST] Gave up sending the end of the stream.\n");
+                break;
+            }
+        }
+
+        //Start over if asked to - Packets from the old stream can't be replayed after the new headers, but the new stream's first ones are kept
+        if (reconnect_requested.exchange(false, std::memory_order_acq_rel)) {
+            if (shout != nullptr)
+                icecast_destroy();
+            drain_queue(reconnect_generation.load(std::memory_order_relaxed));
+            next_attempt = 0;
+        }
+
+        //While down, hold on to the backlog and wait out the backoff
+        if (shout == nullptr) {
+            trim_queue();
+            int64_t wait = next_attempt - fmice_now_ns();
+            if (wait > 0) {
+                usleep((useconds_t)std::min(wait / 1000, (int64_t)FMICE_ICECAST_CONN_WAIT_MS * 1000));
+                continue;
+            }
+            if (!icecast_create())
+                schedule_retry();
+            continue;
+        }
+
+        //Wait for the connection to come up
+        if (connecting) {
+            trim_queue();
+            icecast_poll_connect();
+            continue;
+        }
+
+        //Keep libshout's own queue moving, and don't hand it more while it's backed up
+        size_t pending = icecast_flush();
+        if (shout == nullptr)
+            continue;
+        if (pending >= FMICE_ICECAST_CONN_MAX_PENDING) {
+            usleep(FMICE_ICECAST_CONN_POLL_MS * 1000);
+            continue;
+        }
+
+        //Gather packets and send - Wake up regularly to flush, send partial segments, and check for reconnect requests
+        batch_collect((pending > 0 || batch_use > 0) ? FMICE_ICECAST_CONN_POLL_MS : FMICE_ICECAST_CONN_WAIT_MS);
+        batch_send();
+    }
+
+    //Stopped - Hang up and let go of anything that didn't make it
+    if (shout != nullptr) {
+        shout_close(shout);
+        shout_free(shout);
+        shout = nullptr;
+    }
+    inflight_batched = 0;
+    drain_queue(INT_MAX);
+}
+
+void fmice_icecast_conn::batch_append(const uint8_t* data, size_t size) {
+    //Grow if needed
+    if (batch_use + size > batch_len) {
+        while (batch_use + size > batch_len)
+            batch_len *= 2;
+        batch = (uint8_t*)realloc(batch, batch_len);
+        if (batch == NULL)
+            throw new std::runtime_error("Failed to grow batch buffer.");
+    }
+
+    //Start the clock on a fresh batch
+    if (batch_use == 0)
+        batch_started = fmice_now_ns();
+
+    //Collect
+    memcpy(&batch[batch_use], data, size);
+    batch_use += size;
+    stream_appended += size;
+}
+
+void fmice_icecast_conn::batch_packet(fmice_icecast_inflight* entry) {
+    batch_append(entry->packet->data, entry->packet->size);
+    entry->end = stream_appended;
+}
+
+bool fmice_icecast_conn::replay_due(fmice_icecast_packet* packet) {
+    //Live packets are always due; a backlog is let out a little faster than it was made
+    return packet->time - replay_stream_start <= (fmice_now_ns() - replay_wall_start) * FMICE_ICECAST_CONN_REPLAY_SPEED;
+}
+
+void fmice_icecast_conn::batch_collect(int timeoutMs) {
+    //Resend what the last connection didn't get to first
+    while (inflight_batched < inflight_count) {
+        if (batch_use >= FMICE_ICECAST_CONN_BATCH_MAX)
+            return;
+        if (!replay_due(inflight[inflight_batched].packet)) {
+            usleep(FMICE_ICECAST_CONN_POLL_MS * 1000);
+            return;
+        }
+        batch_packet(&inflight[inflight_batched++]);
+    }
+
+    //Take everything that's queued, up to a full batch
+    fmice_icecast_packet** slot = queue.acquire_read(1, timeoutMs);
+    while (slot != NULL) {
+        //Leave it queued if it's still ahead of the replay
+        fmice_icecast_packet* packet = *slot;
+        if (!replay_due(packet)) {
+            usleep(FMICE_ICECAST_CONN_POLL_MS * 1000);
+            break;
+        }
+
+        //Grow the in-flight list if needed
+        if (inflight_count == inflight_len) {
+            inflight_len *= 2;
+            inflight = (fmice_icecast_inflight*)realloc(inflight, sizeof(fmice_icecast_inflight) * inflight_len);
+            if (inflight == NULL)
+                throw new std::runtime_error("Failed to grow in-flight list.");
+        }
+
+        //Move it over - The reference moves with it, and is only dropped once it's sent
+        inflight[inflight_count].packet = packet;
+        batch_packet(&inflight[inflight_count]);
+        inflight_count++;
+        inflight_batched++;
+        queue.release_read(1);
+        if (batch_use >= FMICE_ICECAST_CONN_BATCH_MAX || queue.get_use() == 0)
+            break;
+        slot = queue.acquire_read(1);
+    }
+}
+
+void fmice_icecast_conn::release_sent() {
+    //Everything handed over that libshout isn't still holding has hit the socket
+    int64_t sent = stream_handed - (int64_t)shout_queuelen(shout);
+    size_t done = 0;
+    while (done < inflight_batched && inflight[done].end <= sent)
+        fmice_icecast_packet_release(inflight[done++].packet);
+    if (done == 0)
+        return;
+    memmove(inflight, &inflight[done], sizeof(fmice_icecast_inflight) * (inflight_count - done));
+    inflight_count -= done;
+    inflight_batched -= done;
+}
+
+void fmice_icecast_conn::batch_send() {
+    //Send whole segments, or everything if it has waited long enough
+    if (batch_use == 0)
+        return;
+    size_t count = batch_use - (batch_use % FMICE_ICECAST_CONN_SEGMENT);
+    if (fmice_now_ns() - batch_started >= (int64_t)FMICE_ICECAST_CONN_BATCH_MS * 1000000LL)
+        count = batch_use;
+    if (count == 0)
+        return;
+    if (!icecast_send(batch, count))
+        return;
+    stream_handed += count;
+    release_sent();
+
+    //Keep the rest for next time
+    memmove(batch, &batch[count], batch_use - count);
+    batch_use -= count;
+    batch_started = fmice_now_ns();
+}
+
+void fmice_icecast_conn::drain_queue(int generation) {
+    //Packets already taken off the queue may be from either stream - Keep the new ones in order
+    assert(inflight_batched == 0);
+    size_t kept = 0;
+    for (size_t i = 0; i < inflight_count; i++) {
+        if (inflight[i].packet->generation < generation)
+            fmice_icecast_packet_release(inflight[i].packet);
+        else
+            inflight[kept++] = inflight[i];
+    }
+    inflight_count = kept;
+
+    //The queue is in stream order, so the old stream is all at the front
+    while (queue.get_use() > 0) {
+        fmice_icecast_packet* packet = *queue.acquire_read(1);
+        if (packet->generation >= generation)
+            break;
+        fmice_icecast_packet_release(packet);
+        queue.release_read(1);
+    }
+}
+
+void fmice_icecast_conn::trim_queue() {
+    //Packets waiting to be resent are the oldest, so go through them first
+    assert(inflight_batched == 0);
+    int64_t cutoff = fmice_now_ns() - ((int64_t)backlog_seconds * 1000000000LL);
+    size_t expired = 0;
+    while (expired < inflight_count && inflight[expired].packet->time < cutoff)
+        fmice_icecast_packet_release(inflight[expired++].packet);
+    if (expired > 0) {
+        memmove(inflight, &inflight[expired], sizeof(fmice_icecast_inflight) * (inflight_count - expired));
+        inflight_count -= expired;
+        dropped_packets.fetch_add((int)expired, std::memory_order_relaxed);
+    }
+    if (inflight_count > 0)
+        return;
+
+    //Then the queue
+    while (queue.get_use() > 0) {
+        fmice_icecast_packet* packet = *queue.acquire_read(1);
+        if (packet->time >= cutoff)
+            break;
+        fmice_icecast_packet_release(packet);
+        queue.release_read(1);
+        dropped_packets.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+void fmice_icecast_conn::schedule_retry() {
+    //Wait somewhere between half and all of the current delay so several mounts don't hammer the server in lockstep
+    int half = backoff_ms / 2;
+    int delay = half + (int)(rand_r(&jitter_seed) % (unsigned int)(half + 1));
+    next_attempt = fmice_now_ns() + ((int64_t)delay * 1000000LL);
+    printf("[CAST] Retrying in %i ms...\n", delay);
+
+    //Back off further next time
+    backoff_ms = std::min(backoff_ms * 2, FMICE_ICECAST_CONN_BACKOFF_MAX);
+}
+
+bool fmice_icecast_conn::icecast_create() {
+    //Sanity check
+    assert(shout == nullptr);
+
+    //Set status
+    set_status(FMICE_ICECAST_STATUS_CONNECTING);
+
+    //Allocate shoutcast
+    printf("[CAST] Connecting to Icecast...\n");
+    shout = shout_new();
+    assert(shout != NULL);
+
+    //Set up paramters
+    pthread_mutex_lock(&mutex);
+    shout_set_host(shout, icecast_host);
+    shout_set_protocol(shout, SHOUT_PROTOCOL_HTTP);
+    shout_set_port(shout, icecast_port);
+    shout_set_password(shout, icecast_password);
+    shout_set_mount(shout, icecast_mount);
+    shout_set_user(shout, icecast_username);
+    shout_set_nonblocking(shout, 1);
+    codec->configure_shout(shout); // Sets content type
+    pthread_mutex_unlock(&mutex);
+
+    //Start connecting - In non-blocking mode this comes back busy while it's underway
+    int err = shout_open(shout);
+    if (err != SHOUTERR_SUCCESS && err != SHOUTERR_BUSY) {
+        printf("[CAST] Failed to establish connection: %s\n", shout_get_error(shout));
+        icecast_destroy();
+        return false;
+    }
+    connecting = true;
+    connect_started = fmice_now_ns();
+
+    return true;
+}
+
+void fmice_icecast_conn::icecast_poll_connect() {
+    //Check on it
+    int err = shout_get_connected(shout);
+    if (err == SHOUTERR_BUSY) {
+        //Still going, unless it's taken too long
+        if (fmice_now_ns() - connect_started > (int64_t)FMICE_ICECAST_CONN_TIMEOUT * 1000000000LL) {
+            printf("[CAST] Timed out establishing connection.\n");
+            icecast_destroy();
+            schedule_retry();
+        }
+        else {
+            usleep(FMICE_ICECAST_CONN_POLL_MS * 1000);
+        }
+        return;
+    }
+    if (err != SHOUTERR_CONNECTED) {
+        printf("[CAST] Failed to establish connection: %s\n", shout_get_error(shout));
+        icecast_destroy();
+        schedule_retry();
+        return;
+    }
+
+    //Up - Reset the backoff
+    connecting = false;
+    backoff_ms = FMICE_ICECAST_CONN_BACKOFF_MIN;
+    last_progress = fmice_now_ns();
+    last_queuelen = 0;
+    set_status(FMICE_ICECAST_STATUS_OK);
+    printf("[CAST] Connected to Icecast.\n");
+
+    //Start the replay clock from the oldest packet waiting
+    replay_wall_start = fmice_now_ns();
+    replay_stream_start = replay_wall_start;
+    if (inflight_count > 0)
+        replay_stream_start = inflight[0].packet->time;
+    else if (queue.get_use() > 0)
+        replay_stream_start = (*queue.acquire_read(1))->time;
+
+    //Send the stream headers so we can join mid-stream, ahead of the backlog
+    fmice_icecast_packet* header = parent->get_header();
+    if (header != nullptr) {
+        batch_append(header->data, header->size);
+        fmice_icecast_packet_release(header);
+    }
+}
+
+size_t fmice_icecast_conn::icecast_flush() {
+    //Try to push out anything libshout is holding on to
+    size_t pending = (size_t)shout_queuelen(shout);
+    if (pending > 0) {
+        int err = shout_send(shout, NULL, 0);
+        if (err != SHOUTERR_SUCCESS && err != SHOUTERR_BUSY) {
+            printf("[CAST] Failed to send to Icecast: %s\n", shout_get_error(shout));
+            icecast_destroy();
+            schedule_retry();
+            return 0;
+        }
+        size_t left = (size_t)shout_queuelen(shout);
+        if (left < pending) {
+            stat_sends.fetch_add(1, std::memory_order_relaxed);
+            stat_bytes_sent.fetch_add(pending - left, std::memory_order_relaxed);
+        }
+        pending = left;
+        release_sent();
+    }
+
+    //Track progress, and give up on a connection that has stopped taking data
+    int64_t now = fmice_now_ns();
+    if (pending < last_queuelen || pending == 0)
+        last_progress = now;
+    last_queuelen = pending;
+    if (now - last_progress > (int64_t)FMICE_ICECAST_CONN_TIMEOUT * 1000000000LL) {
+        printf("[CAST] Icecast has stopped accepting data.\n");
+        icecast_destroy();
+        schedule_retry();
+        return 0;
+    }
+
+    return pending;
+}
+
+void fmice_icecast_conn::icecast_destroy() {
+    //Destroy shoutcast
+    printf("[CAST] Disconnecting from Icecast...\n");
+    set_status(FMICE_ICECAST_STATUS_CONNECTION_LOST);
+    assert(shout != nullptr);
+    inc_retries();
+    shout_close(shout);
+    shout_free(shout);
+    shout = nullptr;
+    connecting = false;
+
+    //A partly sent packet can't be finished on a new connection - Drop the bytes and resend the packets whole, ahead of the queue
+    batch_use = 0;
+    inflight_batched = 0;
+    stream_appended = 0;
+    stream_handed = 0;
+}
+
+bool fmice_icecast_conn::icecast_send(const uint8_t* data, size_t size) {
+    //Write straight out, skipping libshout's per-format parsing and pacing - Whatever the socket won't take yet is queued by libshout
+    size_t queued = (size_t)shout_queuelen(shout);
+    ssize_t result = shout_send_raw(shout, data, size);
+    if (result < 0 && result != SHOUTERR_BUSY) {
+        printf("[CAST] Failed to send packet to Icecast.\n");
+        icecast_destroy();
+        schedule_retry();
+        return false;
+    }
+
+    //Update stats - Only count what reached the socket; what libshout queued is counted by icecast_flush once it goes out
+    size_t now_queued = (size_t)shout_queuelen(shout);
+    size_t grown = now_queued - std::min(queued, now_queued);
+    stat_sends.fetch_add(1, std::memory_order_relaxed);
+    stat_bytes_sent.fetch_add(size - std::min(size, grown), std::memory_order_relaxed);
+
+    return true;
+}
@@ -0,0 +1,243 @@
+#pragma once
+
+#include "codec.h"
+#include "spsc_buffer.h"
+#include <stdint.h>
+#include <atomic>
+#include <pthread.h>
+#include <shout/shout.h>
+
+#define FMICE_ICECAST_STATUS_INIT 0
+#define FMICE_ICECAST_STATUS_CONNECTING 1
+#define FMICE_ICECAST_STATUS_OK 2
+#define FMICE_ICECAST_STATUS_CONNECTION_LOST 3
+
+#define FMICE_ICECAST_CONN_QUEUE_SIZE 1024 // Packets a connection can fall behind by before new ones are dropped
+#define FMICE_ICECAST_DEFAULT_BACKLOG 30 // Seconds of stream held for replay while disconnected
+
+class fmice_icecast;
+
+/// <summary>
+/// A chunk of encoded stream shared between every connection it's sent to. Freed when the last one releases it.
+/// </summary>
+struct fmice_icecast_packet {
+
+	std::atomic<int> refs;
+	int64_t time; // CLOCK_MONOTONIC nanoseconds when it was encoded
+	int generation; // Which codec reset the stream it belongs to started from
+	int size;
+	uint8_t* data; // Stored right after the packet
+
+};
+
+/// <summary>
+/// Allocates a packet of the given stream generation holding a copy of data, with refs references.
+/// </summary>
+fmice_icecast_packet* fmice_icecast_packet_alloc(const uint8_t* data, int size, int refs, int generation);
+
+/// <summary>
+/// Adds a reference to a packet.
+/// </summary>
+void fmice_icecast_packet_retain(fmice_icecast_packet* packet);
+
+/// <summary>
+/// Drops a reference to a packet, freeing it if it was the last.
+/// </summary>
+void fmice_icecast_packet_release(fmice_icecast_packet* packet);
+
+/// <summary>
+/// A packet a connection has taken off its queue but hasn't seen all the way onto the socket.
+/// </summary>
+struct fmice_icecast_inflight {
+
+	fmice_icecast_packet* packet;
+	int64_t end; // Offset just past the packet in this connection's stream, once it has been batched
+
+};
+
+/// <summary>
+/// One Icecast mount fed from a shared encoder. Each has its own thread, queue and connection state, so a slow or down server only
+/// affects itself.
+/// </summary>
+class fmice_icecast_conn {
+
+public:
+	fmice_icecast_conn(fmice_icecast* parent, fmice_codec* codec);
+	~fmice_icecast_conn();
+
+	void set_host(const char* hostname);
+	void set_port(unsigned int port);
+	void set_mount(const char* mount);
+	void set_username(const char* username);
+	void set_password(const char* password);
+
+	/// <summary>
+	/// Sets how many seconds of stream are held while disconnected and replayed once back. Anything older is dropped.
+	/// </summary>
+	void set_backlog(int seconds);
+
+	int get_status();
+	int get_retries();
+	int get_dropped_packets();
+
+	/// <summary>
+	/// Gets the average number of bytes handed to the socket per send call since starting.
+	/// </summary>
+	int get_bytes_per_send();
+
+	bool is_configured();
+	void init();
+
+	/// <summary>
+	/// Queues a packet to be sent, taking over one reference to it. Never blocks; if the queue is full the packet is dropped. Encoder thread only.
+	/// </summary>
+	void push(fmice_icecast_packet* packet);
+
+	/// <summary>
+	/// Asks the connection to start over, such as after the encoder was reset and its stream headers changed. Packets from generations
+	/// before the given one are dropped; newer ones are sent after the new headers. Thread safe.
+	/// </summary>
+	void request_reconnect(int generation);
+
+	/// <summary>
+	/// Marks the end of the stream. The connection sends everything still queued and then hangs up, giving up early if no server
+	/// takes it in time. Doesn't wait; call join after. Only once the encoder has pushed its last packet.
+	/// </summary>
+	void stop();
+
+	/// <summary>
+	/// Waits for the connection's thread to exit after stop.
+	/// </summary>
+	void join();
+
+private:
+	fmice_icecast* parent;
+	fmice_codec* codec;
+
+	// Stats and settable settings - Protected by the mutex
+	pthread_mutex_t mutex;
+	char icecast_host[256];
+	unsigned short icecast_port;
+	char icecast_mount[256];
+	char icecast_username[256];
+	char icecast_password[256];
+	int stat_status;
+	int stat_retries;
+
+	int backlog_seconds; // Set before init
+
+	std::atomic<int> dropped_packets;
+	std::atomic<bool> reconnect_requested;
+	std::atomic<int> reconnect_generation; // Oldest stream generation still wanted, set before reconnect_requested
+	std::atomic<bool> stop_requested;
+	int64_t stop_deadline; // When to give up on the rest of the stream while no server is connected, set before stop_requested
+	std::atomic<int64_t> stat_sends;
+	std::atomic<int64_t> stat_bytes_sent;
+
+	// Worker thread access ONLY
+	shout_t* shout;
+	bool connecting; // Waiting on a non-blocking shout_open
+	int64_t connect_started; // When the current connection attempt started
+	int64_t next_attempt; // When to try connecting again
+	int backoff_ms; // Current retry delay, doubled after each failure
+	int64_t last_progress; // When libshout's send queue last moved
+	size_t last_queuelen;
+	unsigned int jitter_seed;
+
+	// Outgoing bytes gathered from packets so they go out in a few large, segment-aligned writes - Worker thread access ONLY
+	uint8_t* batch;
+	size_t batch_len;
+	size_t batch_use;
+	int64_t batch_started; // When the oldest byte in the batch was added
+
+	// Packets whose bytes haven't all been sent, oldest first. Kept until libshout has written them out, and resent whole after a disconnect - Worker thread access ONLY
+	fmice_icecast_inflight* inflight;
+	size_t inflight_len;
+	size_t inflight_count;
+	size_t inflight_batched; // How many at the front are in the batch or libshout on this connection - The rest are waiting to be resent
+	int64_t stream_appended; // Bytes added to the batch since connecting
+	int64_t stream_handed; // Bytes handed to libshout since connecting
+	int64_t replay_wall_start; // When this connection came up
+	int64_t replay_stream_start; // Encode time of the oldest packet waiting when it came up
+
+	fmice_spsc_buffer<fmice_icecast_packet*> queue; // Written only by the encoder thread, read only by the worker
+	pthread_t worker_thread;
+
+	static void* work_static(void* ctx);
+	void work();
+
+	/// <summary>
+	/// Starts a non-blocking connection to Icecast. CALLED ONLY BY WORKER. Returns true if the attempt is underway, otherwise false.
+	/// </summary>
+	bool icecast_create();
+
+	/// <summary>
+	/// Polls a connection attempt, sending the stream headers once it's up. CALLED ONLY BY WORKER.
+	/// </summary>
+	void icecast_poll_connect();
+
+	/// <summary>
+	/// Pushes out whatever libshout has queued, disconnecting if it stops moving. CALLED ONLY BY WORKER. Returns bytes still queued.
+	/// </summary>
+	size_t icecast_flush();
+
+	/// <summary>
+	/// Schedules the next connection attempt after a failure, using jittered exponential backoff. CALLED ONLY BY WORKER.
+	/// </summary>
+	void schedule_retry();
+
+	/// <summary>
+	/// Disconnects from icecast. Packets that weren't completely sent are kept to be resent whole after reconnecting. CALLED ONLY BY WORKER.
+	/// </summary>
+	void icecast_destroy();
+
+	/// <summary>
+	/// Sends raw bytes, disconnecting on error. CALLED ONLY BY WORKER. Returns true on success, otherwise false.
+	/// </summary>
+	bool icecast_send(const uint8_t* data, size_t size);
+
+	/// <summary>
+	/// Appends bytes to the batch. CALLED ONLY BY WORKER.
+	/// </summary>
+	void batch_append(const uint8_t* data, size_t size);
+
+	/// <summary>
+	/// Adds a packet to the batch, noting where it ends in the stream. CALLED ONLY BY WORKER.
+	/// </summary>
+	void batch_packet(fmice_icecast_inflight* entry);
+
+	/// <summary>
+	/// Moves packets waiting to be resent, then queued packets, into the batch, waiting up to timeoutMs for the first. Holds back a replayed backlog
+	/// so it goes out no faster than FMICE_ICECAST_CONN_REPLAY_SPEED times real time. CALLED ONLY BY WORKER.
+	/// </summary>
+	void batch_collect(int timeoutMs);
+
+	/// <summary>
+	/// Returns true if a packet is due to be sent under the replay pacing. CALLED ONLY BY WORKER.
+	/// </summary>
+	bool replay_due(fmice_icecast_packet* packet);
+
+	/// <summary>
+	/// Releases in-flight packets that libshout has finished writing to the socket. CALLED ONLY BY WORKER.
+	/// </summary>
+	void release_sent();
+
+	/// <summary>
+	/// Sends the whole segments in the batch, or all of it once it has waited long enough. CALLED ONLY BY WORKER.
+	/// </summary>
+	void batch_send();
+
+	/// <summary>
+	/// Releases everything in flight or waiting in the queue from a stream generation older than the given one. CALLED ONLY BY WORKER.
+	/// </summary>
+	void drain_queue(int generation);
+
+	/// <summary>
+	/// Releases packets waiting to be resent or queued that are older than the backlog limit. Only while nothing is batched. CALLED ONLY BY WORKER.
+	/// </summary>
+	void trim_queue();
+
+	void set_status(int status);
+	void inc_retries();
+
+};
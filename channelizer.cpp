@@ -0,0 +1,160 @@
+#include "channelizer.h"
+#include "defines.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <cassert>
+#include <stdexcept>
+
+fmice_channelizer_channel::fmice_channelizer_channel(fmice_channelizer* parent, int offset, int inRate, int outRate, double cutoff, double trans) :
+	parent(parent),
+	offset(offset),
+	input(inRate),
+	output(outRate),
+	decimator(FMICE_CHANNELIZER_CHUNK_SIZE),
+	dropped_samples(0)
+{
+	//Init xlator to bring the station down to DC
+	xlator.init(NULL, -offset, inRate);
+	xlator.out.setBufferSize(FMICE_CHANNELIZER_CHUNK_SIZE);
+
+	//Init decimator as the channel filter - A wide stage down to the single-station rate first leaves the sharp one a short filter
+	decimator.init(inRate, outRate, cutoff, trans, SAMP_RATE);
+}
+
+fmice_channelizer_channel::~fmice_channelizer_channel() {
+
+}
+
+int fmice_channelizer_channel::get_offset() {
+	return offset;
+}
+
+void fmice_channelizer_channel::start() {
+	//Nothing to do - The channelizer owns the device
+}
+
+int fmice_channelizer_channel::get_dropped_samples() {
+	return parent->get_dropped_samples() + dropped_samples.load(std::memory_order_relaxed);
+}
+
+bool fmice_channelizer_channel::is_realtime() {
+	return parent->device->is_realtime();
+}
+
+bool fmice_channelizer_channel::fill(int count) {
+	while ((int)output.get_use() < count) {
+		//Wait for a chunk of wideband samples - None comes once the device has run out and the input is drained
+		dsp::complex_t* chunk = input.acquire_read(FMICE_CHANNELIZER_CHUNK_SIZE);
+		if (chunk == 0)
+			return false;
+
+		//Shift the station to DC in place
+		xlator.process(FMICE_CHANNELIZER_CHUNK_SIZE, chunk, chunk);
+
+		//Decimate straight into the output
+		dsp::complex_t* span;
+		size_t writable = output.acquire_write(&span, FMICE_CHANNELIZER_CHUNK_SIZE);
+		assert(writable == FMICE_CHANNELIZER_CHUNK_SIZE);
+		output.commit_write(decimator.process(FMICE_CHANNELIZER_CHUNK_SIZE, chunk, span));
+
+		//Release
+		input.release_read(FMICE_CHANNELIZER_CHUNK_SIZE);
+	}
+	return true;
+}
+
+int fmice_channelizer_channel::read(dsp::complex_t* samples, int count) {
+	if (!fill(count))
+		return 0;
+	return output.read(samples, count);
+}
+
+dsp::complex_t* fmice_channelizer_channel::acquire_read(int count) {
+	if (!fill(count))
+		return 0;
+	return output.acquire_read(count);
+}
+
+void fmice_channelizer_channel::release_read(int count) {
+	output.release_read(count);
+}
+
+fmice_channelizer::fmice_channelizer(fmice_device* device, int sampleRate) :
+	device(device),
+	sample_rate(sampleRate),
+	channel_count(0)
+{
+
+}
+
+fmice_channelizer::~fmice_channelizer() {
+	//Destroy channels
+	for (int i = 0; i < channel_count; i++)
+		delete channels[i];
+}
+
+fmice_channelizer_channel* fmice_channelizer::add_channel(int offset, int outRate, double cutoff, double trans) {
+	//Sanity check
+	if (channel_count == FMICE_CHANNELIZER_MAX_CHANNELS)
+		throw std::runtime_error("Too many channels.");
+	if (abs(offset) + cutoff + (trans / 2) > sample_rate / 2)
+		throw std::runtime_error("Channel does not fit within the device bandwidth.");
+
+	//Create
+	fmice_channelizer_channel* channel = new fmice_channelizer_channel(this, offset, sample_rate, outRate, cutoff, trans);
+	channels[channel_count++] = channel;
+
+	//Show plan
+	char name[64];
+	snprintf(name, sizeof(name), "Channel %i (%+i Hz)", channel_count, offset);
+	channel->decimator.print_plan(name);
+
+	return channel;
+}
+
+int fmice_channelizer::get_dropped_samples() {
+	return device->get_dropped_samples();
+}
+
+void fmice_channelizer::start() {
+	//Start device
+	device->start();
+
+	//Start distributing
+	if (pthread_create(&thread, NULL, work_static, this) != 0)
+		throw std::runtime_error("Failed to create channelizer thread.");
+}
+
+void* fmice_channelizer::work_static(void* ctx) {
+	((fmice_channelizer*)ctx)->work();
+	return 0;
+}
+
+void fmice_channelizer::work() {
+	bool realtime = device->is_realtime();
+	while (1) {
+		//Wait for a chunk from the device
+		dsp::complex_t* chunk = device->acquire_read(FMICE_CHANNELIZER_CHUNK_SIZE);
+		if (chunk == 0)
+			break;
+
+		//Copy to each channel. With a live device, a channel that falls behind only drops its own samples. Otherwise, wait for it.
+		for (int i = 0; i < channel_count; i++) {
+			if (!realtime) {
+				channels[i]->input.write_all(chunk, FMICE_CHANNELIZER_CHUNK_SIZE);
+				continue;
+			}
+			size_t written = channels[i]->input.write(chunk, FMICE_CHANNELIZER_CHUNK_SIZE);
+			if (written != FMICE_CHANNELIZER_CHUNK_SIZE)
+				channels[i]->dropped_samples.fetch_add(FMICE_CHANNELIZER_CHUNK_SIZE - written, std::memory_order_relaxed);
+		}
+
+		//Release
+		device->release_read(FMICE_CHANNELIZER_CHUNK_SIZE);
+	}
+
+	//The device has run out - Close every input so the channels finish what's left and then stop
+	for (int i = 0; i < channel_count; i++)
+		channels[i]->input.close();
+}
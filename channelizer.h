@@ -0,0 +1,97 @@
+#pragma once
+
+#include "device.h"
+#include "decimator.h"
+#include "spsc_buffer.h"
+
+#include <pthread.h>
+#include <dsp/channel/frequency_xlator.h>
+
+#define FMICE_CHANNELIZER_MAX_CHANNELS 8
+#define FMICE_CHANNELIZER_CHUNK_SIZE 16384 // Wideband samples handed to each channel at a time
+
+class fmice_channelizer;
+
+/// <summary>
+/// One station cut out of the wideband stream. Looks like any other device to the radio. The shift and decimation
+/// are done lazily on the thread that reads from it, so each radio pays for its own channel.
+/// </summary>
+class fmice_channelizer_channel : public fmice_device {
+
+public:
+	fmice_channelizer_channel(fmice_channelizer* parent, int offset, int inRate, int outRate, double cutoff, double trans);
+	~fmice_channelizer_channel();
+
+	virtual void start() override;
+
+	virtual int get_dropped_samples() override;
+
+	virtual bool is_realtime() override;
+
+	virtual int read(dsp::complex_t* samples, int count) override;
+
+	virtual dsp::complex_t* acquire_read(int count) override;
+
+	virtual void release_read(int count) override;
+
+	int get_offset();
+
+private:
+	fmice_channelizer* parent;
+	int offset;
+
+	fmice_spsc_buffer<dsp::complex_t> input; // Wideband samples, written only by the channelizer thread and closed by it once the device runs out
+	fmice_spsc_buffer<dsp::complex_t> output; // Channel samples, written and read only by the radio
+
+	dsp::channel::FrequencyXlator xlator;
+	fmice_decimator decimator;
+
+	std::atomic<int> dropped_samples;
+
+	/// <summary>
+	/// Shifts and decimates wideband samples until at least count channel samples are waiting. Returns false if the device has run out.
+	/// </summary>
+	bool fill(int count);
+
+	friend class fmice_channelizer;
+
+};
+
+/// <summary>
+/// Splits one wideband device into several narrowband channels, one per station. With a real-time device, a channel that falls behind
+/// drops its own samples; otherwise the device is held back until every channel has room.
+/// </summary>
+class fmice_channelizer {
+
+public:
+	fmice_channelizer(fmice_device* device, int sampleRate);
+	~fmice_channelizer();
+
+	/// <summary>
+	/// Adds a channel offset Hz from the device center, filtered with the channel filter (cutoff/trans) and resampled to outRate. The channel
+	/// does all the baseband filtering, so outRate can be the demodulator rate.
+	/// </summary>
+	fmice_channelizer_channel* add_channel(int offset, int outRate, double cutoff, double trans);
+
+	/// <summary>
+	/// Starts the device and the thread distributing its samples to the channels.
+	/// </summary>
+	void start();
+
+	int get_dropped_samples();
+
+private:
+	fmice_device* device;
+	int sample_rate;
+
+	fmice_channelizer_channel* channels[FMICE_CHANNELIZER_MAX_CHANNELS];
+	int channel_count;
+
+	pthread_t thread;
+
+	static void* work_static(void* ctx);
+	void work();
+
+	friend class fmice_channelizer_channel;
+
+};
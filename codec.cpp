@@ -1,13 +1,23 @@
 #include "codec.h"
 
+#include <math.h>
 #include <cassert>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define FMICE_CODEC_AVX2
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define FMICE_CODEC_NEON
+#endif
+
 fmice_codec::fmice_codec(int sampleRate, int channels)
 {
 	//Set
 	this->sample_rate = sampleRate;
 	this->channels = channels;
 	this->callback = nullptr;
+	this->clipped_samples = 0;
 }
 
 fmice_codec::~fmice_codec() {
@@ -27,4 +37,162 @@ void fmice_codec::push_out(const uint8_t* data, int count) {
 void fmice_codec::signal_error() {
 	//Errors are indicated just by a negative count
 	push_out(NULL, -1);
-}
\ No newline at end of file
+}
+
+int64_t fmice_codec::get_clipped_samples() {
+	return clipped_samples.load(std::memory_order_relaxed);
+}
+
+void fmice_codec::count_clipped(int count) {
+	if (count > 0)
+		clipped_samples.fetch_add(count, std::memory_order_relaxed);
+}
+
+/* KERNELS */
+
+static int clip_convert_generic(int32_t* output, const float* input, int count, float scale) {
+	int clipped = 0;
+	for (int i = 0; i < count; i++) {
+		float x = input[i] * scale;
+		if (x > scale) {
+			x = scale;
+			clipped++;
+		}
+		if (x < -scale) {
+			x = -scale;
+			clipped++;
+		}
+		output[i] = (int32_t)lrintf(x);
+	}
+	return clipped;
+}
+
+static int clip_generic(float* samples, int count) {
+	int clipped = 0;
+	for (int i = 0; i < count; i++) {
+		if (samples[i] > 1.0f) {
+			samples[i] = 1.0f;
+			clipped++;
+		}
+		if (samples[i] < -1.0f) {
+			samples[i] = -1.0f;
+			clipped++;
+		}
+	}
+	return clipped;
+}
+
+#ifdef FMICE_CODEC_AVX2
+
+__attribute__((target("avx2")))
+static int sum_lanes_avx2(__m256i v) {
+	__m128i sum = _mm_add_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+	sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(1, 0, 3, 2)));
+	sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(2, 3, 0, 1)));
+	return _mm_cvtsi128_si32(sum);
+}
+
+__attribute__((target("avx2")))
+static int clip_convert_avx2(int32_t* output, const float* input, int count, float scale) {
+	__m256 vScale = _mm256_set1_ps(scale);
+	__m256 vMin = _mm256_set1_ps(-scale);
+	__m256i clipped = _mm256_setzero_si256();
+	int i = 0;
+	for (; i + 8 <= count; i += 8) {
+		//Scale and flag out of range lanes - Each flag is -1, so subtracting counts them
+		__m256 x = _mm256_mul_ps(_mm256_loadu_ps(&input[i]), vScale);
+		__m256 over = _mm256_or_ps(_mm256_cmp_ps(x, vScale, _CMP_GT_OQ), _mm256_cmp_ps(x, vMin, _CMP_LT_OQ));
+		clipped = _mm256_sub_epi32(clipped, _mm256_castps_si256(over));
+
+		//Clamp and convert, rounding to nearest
+		x = _mm256_min_ps(_mm256_max_ps(x, vMin), vScale);
+		_mm256_storeu_si256((__m256i*)&output[i], _mm256_cvtps_epi32(x));
+	}
+	return sum_lanes_avx2(clipped) + clip_convert_generic(&output[i], &input[i], count - i, scale);
+}
+
+__attribute__((target("avx2")))
+static int clip_avx2(float* samples, int count) {
+	__m256 vMax = _mm256_set1_ps(1.0f);
+	__m256 vMin = _mm256_set1_ps(-1.0f);
+	__m256i clipped = _mm256_setzero_si256();
+	int i = 0;
+	for (; i + 8 <= count; i += 8) {
+		__m256 x = _mm256_loadu_ps(&samples[i]);
+		__m256 over = _mm256_or_ps(_mm256_cmp_ps(x, vMax, _CMP_GT_OQ), _mm256_cmp_ps(x, vMin, _CMP_LT_OQ));
+		clipped = _mm256_sub_epi32(clipped, _mm256_castps_si256(over));
+		_mm256_storeu_ps(&samples[i], _mm256_min_ps(_mm256_max_ps(x, vMin), vMax));
+	}
+	return sum_lanes_avx2(clipped) + clip_generic(&samples[i], count - i);
+}
+
+static bool has_avx2() {
+	static bool result = __builtin_cpu_supports("avx2");
+	return result;
+}
+
+#endif
+
+#ifdef FMICE_CODEC_NEON
+
+static int clip_convert_neon(int32_t* output, const float* input, int count, float scale) {
+	float32x4_t vScale = vdupq_n_f32(scale);
+	float32x4_t vMin = vdupq_n_f32(-scale);
+	uint32x4_t clipped = vdupq_n_u32(0);
+	int i = 0;
+	for (; i + 4 <= count; i += 4) {
+		//Scale and flag out of range lanes - Each flag is all ones, so subtracting counts them
+		float32x4_t x = vmulq_f32(vld1q_f32(&input[i]), vScale);
+		clipped = vsubq_u32(clipped, vorrq_u32(vcgtq_f32(x, vScale), vcltq_f32(x, vMin)));
+
+		//Clamp and convert, rounding to nearest
+		x = vminq_f32(vmaxq_f32(x, vMin), vScale);
+		vst1q_s32(&output[i], vcvtnq_s32_f32(x));
+	}
+	return (int)vaddvq_u32(clipped) + clip_convert_generic(&output[i], &input[i], count - i, scale);
+}
+
+static int clip_neon(float* samples, int count) {
+	float32x4_t vMax = vdupq_n_f32(1.0f);
+	float32x4_t vMin = vdupq_n_f32(-1.0f);
+	uint32x4_t clipped = vdupq_n_u32(0);
+	int i = 0;
+	for (; i + 4 <= count; i += 4) {
+		float32x4_t x = vld1q_f32(&samples[i]);
+		clipped = vsubq_u32(clipped, vorrq_u32(vcgtq_f32(x, vMax), vcltq_f32(x, vMin)));
+		vst1q_f32(&samples[i], vminq_f32(vmaxq_f32(x, vMin), vMax));
+	}
+	return (int)vaddvq_u32(clipped) + clip_generic(&samples[i], count - i);
+}
+
+#endif
+
+const char* fmice_codec::get_clip_impl() {
+#if defined(FMICE_CODEC_AVX2)
+	if (has_avx2())
+		return "avx2";
+#elif defined(FMICE_CODEC_NEON)
+	return "neon";
+#endif
+	return "generic";
+}
+
+int fmice_codec::clip_convert(int32_t* output, const float* input, int count, float scale) {
+#if defined(FMICE_CODEC_AVX2)
+	if (has_avx2())
+		return clip_convert_avx2(output, input, count, scale);
+#elif defined(FMICE_CODEC_NEON)
+	return clip_convert_neon(output, input, count, scale);
+#endif
+	return clip_convert_generic(output, input, count, scale);
+}
+
+int fmice_codec::clip(float* samples, int count) {
+#if defined(FMICE_CODEC_AVX2)
+	if (has_avx2())
+		return clip_avx2(samples, count);
+#elif defined(FMICE_CODEC_NEON)
+	return clip_neon(samples, count);
+#endif
+	return clip_generic(samples, count);
+}
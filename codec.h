@@ -1,6 +1,7 @@
 #pragma once
 
 #include <stdint.h>
+#include <atomic>
 #include <dsp/types.h>
 #include <shout/shout.h>
 
@@ -16,7 +17,7 @@ class fmice_codec {
 
 public:
 	fmice_codec(int sampleRate, int channels);
-	~fmice_codec();
+	virtual ~fmice_codec();
 
 	/// <summary>
 	/// Re-initializes the codec and clears out the output buffer. Called from icecast thread.
@@ -32,6 +33,11 @@ public:
 	/// <param name="callbackClientData">User-supplied data returned on the callback.</param>
 	virtual void process(float* samples, int count) = 0;
 
+	/// <summary>
+	/// Encodes whatever is still buffered and ends the stream, pushing the rest out the callback. Reset before processing again. Called from icecast thread.
+	/// </summary>
+	virtual void finish() = 0;
+
 	/// <summary>
 	/// Sets up metadata for shoutcast, typically the content type.
 	/// </summary>
@@ -44,6 +50,16 @@ public:
 	/// <param name="callbackClientData"></param>
 	void set_callback(fmice_codec_callback callback, void* callbackClientData);
 
+	/// <summary>
+	/// Gets the total number of samples that had to be clipped since starting. Thread safe.
+	/// </summary>
+	int64_t get_clipped_samples();
+
+	/// <summary>
+	/// Gets the name of the implementation clip and clip_convert use on this CPU.
+	/// </summary>
+	static const char* get_clip_impl();
+
 protected:
 	int sample_rate;
 	int channels;
@@ -60,8 +76,28 @@ protected:
 	/// </summary>
 	void signal_error();
 
+	/// <summary>
+	/// Scales samples to integers, clamping them to +/-scale, in one pass. Uses AVX2 or NEON when available. Returns the number of samples clamped.
+	/// </summary>
+	/// <param name="output">Converted samples, rounded to nearest.</param>
+	/// <param name="input">PCM samples in -1 to 1 format.</param>
+	/// <param name="count">Number of samples total.</param>
+	/// <param name="scale">Full scale, such as 32767 for 16 bit.</param>
+	static int clip_convert(int32_t* output, const float* input, int count, float scale);
+
+	/// <summary>
+	/// Clamps samples to -1 to 1 in place. Uses AVX2 or NEON when available. Returns the number of samples clamped.
+	/// </summary>
+	static int clip(float* samples, int count);
+
+	/// <summary>
+	/// Adds to the clipped sample count reported by get_clipped_samples.
+	/// </summary>
+	void count_clipped(int count);
+
 private:
 	fmice_codec_callback callback;
 	void* callback_ctx;
+	std::atomic<int64_t> clipped_samples;
 
 };
\ No newline at end of file
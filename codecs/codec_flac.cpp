@@ -7,7 +7,13 @@
 
 #define input_buffer_samples FMICE_BLOCK_SIZE
 
-fmice_codec_flac::fmice_codec_flac(int sampleRate, int channels) : fmice_codec(sampleRate, channels) {
+#define FLAC_SUBSET_MAX_BLOCKSIZE 16384 // Largest blocksize the streamable subset allows above 48 kHz
+
+fmice_codec_flac::fmice_codec_flac(int sampleRate, int channels, const fmice_codec_flac_settings_t* settings) : fmice_codec(sampleRate, channels),
+    settings(settings),
+    flac(NULL),
+    input_buffer_use(0)
+{
     //Allocate the input buffer
     input_buffer = (int32_t*)malloc(sizeof(int32_t) * FMICE_BLOCK_SIZE * channels);
     if (input_buffer == NULL)
@@ -36,13 +42,27 @@ void fmice_codec_flac::create_flac() {
     if (!flac)
         throw new std::runtime_error("Failed to allocate FLAC.");
 
-    //Set up FLAC
+    //Set up FLAC - The level sets a blocksize, so override it after
     FLAC__stream_encoder_set_verify(flac, false);
-    FLAC__stream_encoder_set_compression_level(flac, 1);
+    FLAC__stream_encoder_set_compression_level(flac, settings->level);
     FLAC__stream_encoder_set_channels(flac, channels);
-    FLAC__stream_encoder_set_bits_per_sample(flac, 16);
+    FLAC__stream_encoder_set_bits_per_sample(flac, settings->bits);
     FLAC__stream_encoder_set_sample_rate(flac, sample_rate);
     FLAC__stream_encoder_set_total_samples_estimate(flac, 0);
+    if (settings->blocksize != 0) {
+        FLAC__stream_encoder_set_blocksize(flac, settings->blocksize);
+        FLAC__stream_encoder_set_streamable_subset(flac, settings->blocksize <= FLAC_SUBSET_MAX_BLOCKSIZE);
+    }
+
+    //Spread frames across threads if asked to and libFLAC can
+    if (settings->threads > 1) {
+#if defined(FLAC_API_VERSION_CURRENT) && FLAC_API_VERSION_CURRENT >= 14
+        if (FLAC__stream_encoder_set_num_threads(flac, settings->threads) != FLAC__STREAM_ENCODER_SET_NUM_THREADS_OK)
+            printf("[CODEC-FLAC] WARN: libFLAC refused %i threads. Encoding on one thread.\n", settings->threads);
+#else
+        printf("[CODEC-FLAC] WARN: Multithreaded encoding needs libFLAC 1.5 or newer. Encoding on one thread.\n");
+#endif
+    }
 
     //Init encoder
     if (FLAC__stream_encoder_init_ogg_stream(flac, 0, flac_push_cb_static, 0, 0, 0, this) != FLAC__STREAM_ENCODER_INIT_STATUS_OK)
@@ -59,8 +79,8 @@ void fmice_codec_flac::process(float* samples, int count) {
         //Determine how many samples PER CHANNEL we can write to the buffer (avail in buffer - avail in input)
         int readable = std::min(count, input_buffer_samples - input_buffer_use);
 
-        //Read and convert simultaenously
-        volk_32f_s32f_convert_32i(&input_buffer[input_buffer_use * channels], &samples[readOffset * channels], 32767, readable * channels);
+        //Read, clip, and convert simultaenously - Clipping samples break FLAC
+        count_clipped(clip_convert(&input_buffer[input_buffer_use * channels], &samples[readOffset * channels], readable * channels, full_scale()));
 
         //Update states
         input_buffer_use += readable;
@@ -75,6 +95,24 @@ void fmice_codec_flac::process(float* samples, int count) {
     }
 }
 
+void fmice_codec_flac::finish() {
+    //Sanity check
+    assert(flac != NULL);
+
+    //Encode the partial block, then have FLAC write out the last frame and end the Ogg stream
+    if (input_buffer_use > 0 && !FLAC__stream_encoder_process_interleaved(flac, input_buffer, input_buffer_use))
+        signal_error();
+    input_buffer_use = 0;
+    if (!FLAC__stream_encoder_finish(flac)) {
+        printf("[CODEC-FLAC] WARN: FLAC encoder failed to finish the stream.\n");
+        signal_error();
+    }
+}
+
+float fmice_codec_flac::full_scale() {
+    return (float)((1 << (settings->bits - 1)) - 1);
+}
+
 void fmice_codec_flac::reset() {
     //Destroy stream encoder
     if (flac != NULL) {
@@ -90,23 +128,6 @@ bool fmice_codec_flac::submit_buffer() {
     //Sanity check
     assert(flac != NULL);
 
-    //Check all samples for clipping - They break FLAC
-    int clipping = 0;
-    for (int i = 0; i < input_buffer_samples * channels; i++) {
-        if (input_buffer[i] > 32767) {
-            input_buffer[i] = 32767;
-            clipping++;
-        }
-        if (input_buffer[i] < -32767) {
-            input_buffer[i] = -32767;
-            clipping++;
-        }
-    }
-
-    //Warn on clipping
-    if (clipping > 0)
-        printf("[CODEC-FLAC] WARN: %i samples in block were clipping.\n", clipping);
-
     //Process with FLAC
     bool success = FLAC__stream_encoder_process_interleaved(flac, input_buffer, input_buffer_samples);
     if (!success)
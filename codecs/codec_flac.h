@@ -3,17 +3,37 @@
 #include "../codec.h"
 #include <FLAC/stream_encoder.h>
 
+#define FMICE_FLAC_DEFAULT_BITS 16
+#define FMICE_FLAC_DEFAULT_LEVEL 1
+#define FMICE_FLAC_DEFAULT_BLOCKSIZE 0 // Use the level's blocksize
+#define FMICE_FLAC_DEFAULT_THREADS 1
+#define FMICE_FLAC_MAX_THREADS 64
+
+struct fmice_codec_flac_settings_t {
+
+	int bits; // 16 or 24
+	int level; // Compression level, 0-8
+	int blocksize; // Samples per FLAC frame, or 0 for the level's default
+	int threads; // Encoder threads - More than one needs libFLAC 1.5 or newer
+
+};
+
 class fmice_codec_flac : public fmice_codec {
 	
 public:
-	fmice_codec_flac(int sampleRate, int channels);
+	/// <summary>
+	/// Creates the codec. Settings are read every time the codec is reset and so must outlive it.
+	/// </summary>
+	fmice_codec_flac(int sampleRate, int channels, const fmice_codec_flac_settings_t* settings);
 	~fmice_codec_flac();
 
 	void reset() override;
 	void process(float* samples, int count) override;
+	void finish() override;
 	void configure_shout(shout_t* ice) override;
 
 private:
+	const fmice_codec_flac_settings_t* settings;
 	FLAC__StreamEncoder* flac;
 
 	int32_t* input_buffer; // Length is input_buffer_samples * channels
@@ -30,6 +50,11 @@ private:
 	/// <returns></returns>
 	bool submit_buffer();
 
+	/// <summary>
+	/// Gets the largest sample value at the configured bit depth.
+	/// </summary>
+	float full_scale();
+
 	static FLAC__StreamEncoderWriteStatus flac_push_cb_static(const FLAC__StreamEncoder* encoder, const FLAC__byte buffer[], size_t bytes, uint32_t samples, uint32_t current_frame, void* client_data);
 	FLAC__StreamEncoderWriteStatus flac_push_cb(const FLAC__StreamEncoder* encoder, const FLAC__byte buffer[], size_t bytes, uint32_t samples, uint32_t current_frame);
 
@@ -62,22 +62,8 @@ void fmice_codec_mp3::reset() {
 }
 
 void fmice_codec_mp3::process(float* samples, int count) {
-    //Check all samples for clipping
-    int clipping = 0;
-    for (int i = 0; i < count; i++) {
-        if (samples[i] > 1.0f) {
-            samples[i] = 1.0f;
-            clipping++;
-        }
-        if (samples[i] < -1.0f) {
-            samples[i] = -1.0f;
-            clipping++;
-        }
-    }
-    
-    //Warn on clipping
-    if (clipping > 0)
-        printf("[CODEC-MP3] WARN: %i samples in block were clipping.\n", clipping);
+    //Clip - Count is per channel
+    count_clipped(clip(samples, count * channels));
 
     //Encode
     int result = lame_encode_buffer_interleaved_ieee_float(gfp, samples, count, output_buffer, output_buffer_size);
@@ -92,4 +78,16 @@ void fmice_codec_mp3::process(float* samples, int count) {
         //Push output data
         push_out(output_buffer, result);
     }
+}
+
+void fmice_codec_mp3::finish() {
+    //Flush out the frames LAME is still holding
+    int result = lame_encode_flush(gfp, output_buffer, output_buffer_size);
+    if (result < 0) {
+        printf("[CODEC-MP3] Encoder returned bad error code: %i!\n", result);
+        signal_error();
+    }
+    else {
+        push_out(output_buffer, result);
+    }
 }
\ No newline at end of file
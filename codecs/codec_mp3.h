@@ -11,6 +11,7 @@ public:
 
 	void reset() override;
 	void process(float* samples, int count) override;
+	void finish() override;
 	void configure_shout(shout_t* ice) override;
 
 private:
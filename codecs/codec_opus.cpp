@@ -0,0 +1,250 @@
+#include "codec_opus.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <atomic>
+#include <stdexcept>
+#include <cassert>
+#include <algorithm>
+#include "../defines.h"
+
+static std::atomic<uint32_t> stream_counter(0);
+
+static int next_serial() {
+    //Mix the time and PID with a counter so streams chained in the same second still differ
+    uint32_t serial = (uint32_t)time(NULL) ^ ((uint32_t)getpid() << 16) ^ (stream_counter.fetch_add(1) * 0x9E3779B1u);
+    return (int)serial;
+}
+
+static void write_le16(unsigned char* dst, uint16_t value) {
+    dst[0] = value & 0xFF;
+    dst[1] = (value >> 8) & 0xFF;
+}
+
+static void write_le32(unsigned char* dst, uint32_t value) {
+    dst[0] = value & 0xFF;
+    dst[1] = (value >> 8) & 0xFF;
+    dst[2] = (value >> 16) & 0xFF;
+    dst[3] = (value >> 24) & 0xFF;
+}
+
+fmice_codec_opus::fmice_codec_opus(int sampleRate, int channels, const fmice_codec_opus_settings_t* settings) : fmice_codec(sampleRate, channels),
+    settings(settings),
+    encoder(NULL),
+    ogg_active(false),
+    granule(0),
+    packet_no(0),
+    pre_skip(0),
+    frame_use(0)
+{
+    //Sanity check - Samples are handled as stereo pairs
+    if (channels != 2)
+        throw new std::runtime_error("Opus codec only supports stereo.");
+
+    //Set up resampler
+    if (sampleRate != FMICE_OPUS_SAMP_RATE)
+        resamp.init(NULL, sampleRate, FMICE_OPUS_SAMP_RATE);
+
+    //Allocate buffers - A block can't grow when resampled down, but leave room in case the rate is raised instead
+    resamp_buffer_len = (int)(((int64_t)FMICE_BLOCK_SIZE * FMICE_OPUS_SAMP_RATE) / sampleRate) + 16;
+    resamp_buffer = (dsp::stereo_t*)malloc(sizeof(dsp::stereo_t) * resamp_buffer_len);
+    frame_buffer = (float*)malloc(sizeof(float) * FMICE_OPUS_MAX_FRAME * channels);
+    packet_buffer = (unsigned char*)malloc(FMICE_OPUS_MAX_PACKET);
+    if (resamp_buffer == NULL || frame_buffer == NULL || packet_buffer == NULL)
+        throw new std::runtime_error("Failed to allocate Opus buffers.");
+}
+
+fmice_codec_opus::~fmice_codec_opus() {
+    //Destroy encoder
+    destroy_encoder();
+
+    //Free buffers
+    free(resamp_buffer);
+    free(frame_buffer);
+    free(packet_buffer);
+}
+
+bool fmice_codec_opus::parse_frame_size(const char* ms, int* frameSize) {
+    //Opus takes 2.5 ms times a power of two up to 20 ms, plus 40 and 60
+    int tenths = (int)(atof(ms) * 10 + 0.5);
+    if (tenths != 25 && tenths != 50 && tenths != 100 && tenths != 200 && tenths != 400 && tenths != 600)
+        return false;
+    *frameSize = (tenths * FMICE_OPUS_SAMP_RATE) / 10000;
+    return true;
+}
+
+void fmice_codec_opus::configure_shout(shout_t* ice) {
+    //Set the content type
+    shout_set_content_format(ice, SHOUT_FORMAT_OGG, SHOUT_USAGE_AUDIO, NULL);
+}
+
+void fmice_codec_opus::create_encoder() {
+    //Create encoder
+    int err;
+    encoder = opus_encoder_create(FMICE_OPUS_SAMP_RATE, channels, OPUS_APPLICATION_AUDIO, &err);
+    if (err != OPUS_OK || encoder == NULL)
+        throw new std::runtime_error("Failed to create Opus encoder.");
+
+    //Configure
+    opus_encoder_ctl(encoder, OPUS_SET_BITRATE(settings->bitrate * 1000));
+    opus_encoder_ctl(encoder, OPUS_SET_COMPLEXITY(settings->complexity));
+    opus_encoder_ctl(encoder, OPUS_SET_SIGNAL(OPUS_SIGNAL_MUSIC));
+    opus_int32 lookahead = 0;
+    opus_encoder_ctl(encoder, OPUS_GET_LOOKAHEAD(&lookahead));
+
+    //Start a new Ogg stream with a fresh serial so listeners can tell it apart from the last one
+    if (ogg_stream_init(&ogg, next_serial()) != 0)
+        throw new std::runtime_error("Failed to create Ogg stream.");
+    ogg_active = true;
+    granule = 0;
+    packet_no = 0;
+    pre_skip = lookahead;
+    frame_use = 0;
+
+    //Write the ID header (RFC 7845 section 5.1)
+    unsigned char head[19];
+    memcpy(head, "OpusHead", 8);
+    head[8] = 1; // Version
+    head[9] = channels;
+    write_le16(&head[10], (uint16_t)pre_skip); // Pre-skip
+    write_le32(&head[12], sample_rate); // Original rate, informational
+    write_le16(&head[16], 0); // Output gain
+    head[18] = 0; // Channel mapping family
+    ogg_packet packet;
+    memset(&packet, 0, sizeof(packet));
+    packet.packet = head;
+    packet.bytes = sizeof(head);
+    packet.b_o_s = 1;
+    packet.packetno = packet_no++;
+    ogg_stream_packetin(&ogg, &packet);
+    push_pages(true);
+
+    //Write the comment header, with just the vendor string
+    const char* vendor = opus_get_version_string();
+    int vendorLen = (int)strlen(vendor);
+    unsigned char tags[256];
+    vendorLen = std::min(vendorLen, (int)sizeof(tags) - 16);
+    memcpy(tags, "OpusTags", 8);
+    write_le32(&tags[8], vendorLen);
+    memcpy(&tags[12], vendor, vendorLen);
+    write_le32(&tags[12 + vendorLen], 0); // No user comments
+    memset(&packet, 0, sizeof(packet));
+    packet.packet = tags;
+    packet.bytes = 16 + vendorLen;
+    packet.packetno = packet_no++;
+    ogg_stream_packetin(&ogg, &packet);
+    push_pages(true);
+}
+
+void fmice_codec_opus::destroy_encoder() {
+    if (encoder != NULL) {
+        opus_encoder_destroy(encoder);
+        encoder = NULL;
+    }
+    if (ogg_active) {
+        ogg_stream_clear(&ogg);
+        ogg_active = false;
+    }
+}
+
+void fmice_codec_opus::reset() {
+    //Destroy
+    destroy_encoder();
+
+    //Recreate
+    resamp.reset();
+    create_encoder();
+}
+
+void fmice_codec_opus::process(float* samples, int count) {
+    //Sanity check
+    assert(encoder != NULL);
+
+    //Clip - Count is per channel
+    count_clipped(clip(samples, count * channels));
+
+    //Resample
+    const float* input = samples;
+    if (sample_rate != FMICE_OPUS_SAMP_RATE) {
+        count = resamp.process(count, (dsp::stereo_t*)samples, resamp_buffer);
+        assert(count <= resamp_buffer_len);
+        input = (float*)resamp_buffer;
+    }
+
+    //Encode, then send everything out now rather than waiting for pages to fill
+    if (!encode(input, count)) {
+        signal_error();
+        return;
+    }
+    push_pages(true);
+}
+
+bool fmice_codec_opus::encode(const float* samples, int count) {
+    while (count > 0) {
+        //Fill the frame
+        int readable = std::min(count, settings->frame_size - frame_use);
+        memcpy(&frame_buffer[frame_use * channels], samples, sizeof(float) * readable * channels);
+        frame_use += readable;
+        samples += readable * channels;
+        count -= readable;
+        if (frame_use < settings->frame_size)
+            break;
+
+        //Encode it
+        if (!encode_frame(settings->frame_size, false))
+            return false;
+    }
+    return true;
+}
+
+bool fmice_codec_opus::encode_frame(int samples, bool last) {
+    //Encode
+    opus_int32 bytes = opus_encode_float(encoder, frame_buffer, settings->frame_size, packet_buffer, FMICE_OPUS_MAX_PACKET);
+    frame_use = 0;
+    if (bytes < 0) {
+        printf("[CODEC-OPUS] Encoder returned bad error code: %s!\n", opus_strerror(bytes));
+        return false;
+    }
+
+    //Wrap it in Ogg - A short granule on the last page tells the decoder to trim the padding
+    granule += samples;
+    ogg_packet packet;
+    memset(&packet, 0, sizeof(packet));
+    packet.packet = packet_buffer;
+    packet.bytes = bytes;
+    packet.granulepos = granule;
+    packet.packetno = packet_no++;
+    packet.e_o_s = last ? 1 : 0;
+    ogg_stream_packetin(&ogg, &packet);
+    push_pages(last);
+    return true;
+}
+
+void fmice_codec_opus::finish() {
+    //Sanity check
+    assert(encoder != NULL);
+
+    //The decoder drops the pre-skip from the start, so the stream has to run that far past the real audio to play all of it
+    int64_t end = granule + frame_use + pre_skip;
+
+    //Pad with silence until that's covered, ending the stream on the frame that gets there
+    while (granule < end) {
+        memset(&frame_buffer[frame_use * channels], 0, sizeof(float) * (settings->frame_size - frame_use) * channels);
+        int64_t remaining = end - granule;
+        bool last = remaining <= settings->frame_size;
+        if (!encode_frame(last ? (int)remaining : settings->frame_size, last)) {
+            signal_error();
+            return;
+        }
+    }
+}
+
+void fmice_codec_opus::push_pages(bool flush) {
+    ogg_page page;
+    while (flush ? ogg_stream_flush(&ogg, &page) : ogg_stream_pageout(&ogg, &page)) {
+        push_out(page.header, (int)page.header_len);
+        push_out(page.body, (int)page.body_len);
+    }
+}
@@ -0,0 +1,89 @@
+#pragma once
+
+#include "../codec.h"
+#include <opus/opus.h>
+#include <ogg/ogg.h>
+#include <dsp/multirate/rational_resampler.h>
+
+#define FMICE_OPUS_SAMP_RATE 48000 // Opus only takes a few rates, so everything is resampled to this
+#define FMICE_OPUS_MAX_FRAME 2880 // 60 ms at 48 kHz, the longest frame Opus allows
+#define FMICE_OPUS_MAX_PACKET 4000 // Recommended maximum encoded packet size
+
+#define FMICE_OPUS_DEFAULT_BITRATE 128 // kbps
+#define FMICE_OPUS_DEFAULT_COMPLEXITY 5
+#define FMICE_OPUS_DEFAULT_FRAME_SIZE 960 // 20 ms at 48 kHz
+
+struct fmice_codec_opus_settings_t {
+
+	int bitrate; // kbps
+	int complexity; // 0-10
+	int frame_size; // Samples per channel at 48 kHz
+
+};
+
+/// <summary>
+/// Opus in Ogg. Input is resampled to 48 kHz. Each call to process flushes its pages out right away so nothing waits on the next block.
+/// </summary>
+class fmice_codec_opus : public fmice_codec {
+
+public:
+	/// <summary>
+	/// Creates the codec. Settings are read every time the codec is reset and so must outlive it.
+	/// </summary>
+	fmice_codec_opus(int sampleRate, int channels, const fmice_codec_opus_settings_t* settings);
+	~fmice_codec_opus();
+
+	void reset() override;
+	void process(float* samples, int count) override;
+	void finish() override;
+	void configure_shout(shout_t* ice) override;
+
+	/// <summary>
+	/// Converts a frame duration in milliseconds (2.5, 5, 10, 20, 40 or 60) to samples at 48 kHz. Returns false if it isn't one Opus supports.
+	/// </summary>
+	static bool parse_frame_size(const char* ms, int* frameSize);
+
+private:
+	const fmice_codec_opus_settings_t* settings;
+
+	OpusEncoder* encoder;
+	ogg_stream_state ogg;
+	bool ogg_active;
+	int64_t granule; // Samples per channel decoded so far, which includes the pre-skip
+	int64_t packet_no;
+	int pre_skip; // Encoder lookahead the decoder drops from the start
+
+	dsp::multirate::RationalResampler<dsp::stereo_t> resamp;
+	dsp::stereo_t* resamp_buffer;
+	int resamp_buffer_len;
+
+	float* frame_buffer; // Interleaved, collects samples until there is a full frame
+	int frame_use; // Samples per channel in the frame buffer
+	unsigned char* packet_buffer;
+
+	/// <summary>
+	/// Creates the encoder and Ogg stream and writes out the stream headers. Assumes neither exists.
+	/// </summary>
+	void create_encoder();
+
+	/// <summary>
+	/// Destroys the encoder and Ogg stream if they exist.
+	/// </summary>
+	void destroy_encoder();
+
+	/// <summary>
+	/// Adds resampled samples to the frame buffer, encoding each frame as it fills. Returns false on error.
+	/// </summary>
+	bool encode(const float* samples, int count);
+
+	/// <summary>
+	/// Encodes the full frame buffer and wraps it in Ogg, advancing the granule by samples. If last is set, the packet ends the stream. Returns false on error.
+	/// </summary>
+	bool encode_frame(int samples, bool last);
+
+	/// <summary>
+	/// Sends finished Ogg pages out, or every buffered packet if flush is set.
+	/// </summary>
+	void push_pages(bool flush);
+
+};
@@ -0,0 +1,205 @@
+#include "decimator.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <cassert>
+#include <stdexcept>
+#include <volk/volk.h>
+#include <dsp/taps/low_pass.h>
+
+fmice_decimator::fmice_decimator(int bufferSize) :
+	buffer_size(bufferSize),
+	stage_count(0)
+{
+	out.setBufferSize(bufferSize);
+}
+
+fmice_decimator::~fmice_decimator() {
+	//Free taps and half-band buffers
+	for (int i = 0; i < stage_count; i++) {
+		dsp::taps::free(stages[i].taps);
+		if (stages[i].half_band) {
+			volk_free(stages[i].hb_taps);
+			volk_free(stages[i].hb_history);
+			volk_free(stages[i].hb_even);
+			volk_free(stages[i].hb_odd);
+			volk_free(stages[i].hb_out);
+		}
+	}
+}
+
+void fmice_decimator::init(int inRate, int outRate, double cutoff, double trans, int coarseRate) {
+	//Sanity check
+	if (outRate > inRate)
+		throw std::runtime_error("Decimator output rate must not exceed the input rate.");
+
+	//Everything above this will be removed by the final stage, so earlier stages only need to keep it alias free
+	double passEdge = cutoff + (trans / 2);
+
+	//Take a wide first step to the coarse rate if there's room - Its cost goes with its transition width, so it's far cheaper than doing the sharp filter from here
+	int rate = inRate;
+	if (coarseRate > outRate && coarseRate < inRate && coarseRate - (2 * passEdge) > 0) {
+		int coarseDiv = fmice_gcd(inRate, coarseRate);
+		add_stage(inRate, coarseRate / coarseDiv, inRate / coarseDiv, coarseRate / 2.0, coarseRate - (2 * passEdge));
+		rate = coarseRate;
+	}
+
+	//Reduce the ratio
+	int div = fmice_gcd(rate, outRate);
+	int interp = outRate / div;
+	int decim = rate / div;
+
+	//Peel off half-band stages while there is still at least another 2x of decimation left for the final stage
+	while ((decim % 2) == 0 && (decim / 2) >= 2 * interp && stage_count < FMICE_DECIMATOR_MAX_STAGES - 1) {
+		//Transition goes from the pass edge up to the frequency that aliases back onto it
+		int stageOut = rate / 2;
+		double stageTrans = stageOut - (2 * passEdge);
+		if (stageTrans <= 0)
+			break;
+
+		//Add
+		add_half_band(rate, stageTrans);
+		rate = stageOut;
+		decim /= 2;
+	}
+
+	//Final stage does the channel filtering
+	add_stage(rate, interp, decim, cutoff, trans);
+}
+
+fmice_decimator_stage_t* fmice_decimator::add_stage(int inRate, int interp, int decim, double cutoff, double trans) {
+	//Get stage
+	assert(stage_count < FMICE_DECIMATOR_MAX_STAGES);
+	fmice_decimator_stage_t* stage = &stages[stage_count++];
+	stage->interp = interp;
+	stage->decim = decim;
+	stage->in_rate = inRate;
+	stage->out_rate = (int)(((int64_t)inRate * interp) / decim);
+	stage->half_band = false;
+	if (cutoff <= 0)
+		return stage; // Filter is designed by the caller
+
+	//Design the filter at the interpolated rate
+	stage->taps = dsp::taps::lowPass(cutoff, trans, (double)inRate * interp);
+
+	//Init the filter
+	if (interp == 1) {
+		stage->fir.init(NULL, stage->taps, decim);
+		stage->fir.out.setBufferSize(buffer_size);
+	}
+	else {
+		//Polyphase resamplers need unity gain per phase
+		volk_32f_s32f_multiply_32f(stage->taps.taps, stage->taps.taps, (float)interp, stage->taps.size);
+		stage->resamp.init(NULL, interp, decim, stage->taps);
+		stage->resamp.out.setBufferSize(buffer_size);
+	}
+	return stage;
+}
+
+void fmice_decimator::add_half_band(int inRate, double trans) {
+	//Same length a regular low-pass would get, rounded up to 4k + 3 so the center lands on an odd index and the zeros on the even ones around it
+	int count = (int)ceil(3.8 * inRate / trans);
+	count += (3 - (count % 4) + 4) % 4;
+	int center = (count - 1) / 2;
+
+	//Windowed sinc with the cutoff at a quarter of the rate - Every tap an even distance from the center is zero
+	fmice_decimator_stage_t* stage = add_stage(inRate, 1, 2, 0, 0);
+	stage->taps = dsp::taps::alloc<float>(count);
+	double sum = 0;
+	for (int i = 0; i < count; i++) {
+		int n = i - center;
+		double w = 0.355768 - 0.487396 * cos(2 * M_PI * i / (count - 1)) + 0.144232 * cos(4 * M_PI * i / (count - 1)) - 0.012604 * cos(6 * M_PI * i / (count - 1)); // Nuttall
+		double h = (n == 0) ? 0.5 : ((n % 2) == 0 ? 0 : sin(M_PI * n / 2) / (M_PI * n));
+		stage->taps.taps[i] = (float)(h * w);
+		sum += h * w;
+	}
+	for (int i = 0; i < count; i++)
+		stage->taps.taps[i] /= (float)sum;
+
+	//Keep just the taps that aren't zero
+	size_t alignment = volk_get_alignment();
+	stage->half_band = true;
+	stage->hb_count = (count + 1) / 2;
+	stage->hb_taps = (float*)volk_malloc(sizeof(float) * stage->hb_count, alignment);
+	for (int i = 0; i < stage->hb_count; i++)
+		stage->hb_taps[i] = stage->taps.taps[i * 2];
+	stage->hb_center = stage->taps.taps[center];
+
+	//Allocate buffers
+	int historyLen = count - 1 + buffer_size;
+	stage->hb_offset = 0;
+	stage->hb_history = (dsp::complex_t*)volk_malloc(sizeof(dsp::complex_t) * historyLen, alignment);
+	stage->hb_even = (dsp::complex_t*)volk_malloc(sizeof(dsp::complex_t) * (historyLen / 2 + 1), alignment);
+	stage->hb_odd = (dsp::complex_t*)volk_malloc(sizeof(dsp::complex_t) * (historyLen / 2 + 1), alignment);
+	stage->hb_out = (dsp::complex_t*)volk_malloc(sizeof(dsp::complex_t) * (buffer_size / 2 + 1), alignment);
+	if (stage->hb_taps == NULL || stage->hb_history == NULL || stage->hb_even == NULL || stage->hb_odd == NULL || stage->hb_out == NULL)
+		throw std::runtime_error("Failed to allocate half-band buffers.");
+	memset(stage->hb_history, 0, sizeof(dsp::complex_t) * (count - 1));
+}
+
+void fmice_decimator::print_plan(const char* name) {
+	printf("%s: %i -> %i Hz in %i stage(s)\n", name, stages[0].in_rate, stages[stage_count - 1].out_rate, stage_count);
+	for (int i = 0; i < stage_count; i++) {
+		int perOutput = stages[i].half_band ? stages[i].hb_count + 1 : stages[i].taps.size / stages[i].interp;
+		printf("    stage %i: x%i/%i%s, %i taps (%i per output)\n", i + 1, stages[i].interp, stages[i].decim, stages[i].half_band ? " half-band" : "", stages[i].taps.size, perOutput);
+	}
+}
+
+int fmice_decimator::process_half_band(fmice_decimator_stage_t* stage, int count, const dsp::complex_t* in, dsp::complex_t* out) {
+	//Sanity check
+	assert(count <= buffer_size);
+
+	//Add the new block in after the history
+	int tapCount = stage->taps.size;
+	int len = tapCount - 1 + count;
+	memcpy(&stage->hb_history[tapCount - 1], in, sizeof(dsp::complex_t) * count);
+
+	//Split the history by parity, starting at the next output - Each output's nonzero taps are then one contiguous run of the even half,
+	//and its center one sample of the odd half. This takes the place of the copy a regular FIR does anyway.
+	int start = stage->hb_offset;
+	for (int i = 0; start + (i * 2) < len; i++)
+		stage->hb_even[i] = stage->hb_history[start + (i * 2)];
+	for (int i = 0; start + (i * 2) + 1 < len; i++)
+		stage->hb_odd[i] = stage->hb_history[start + (i * 2) + 1];
+
+	//Filter each kept output
+	int outCount = 0;
+	int centerIndex = (tapCount - 1) / 4; // Center's position in the odd half, relative to the output
+	for (; start + (outCount * 2) < count; outCount++) {
+		lv_32fc_t sum;
+		volk_32fc_32f_dot_prod_32fc(&sum, (lv_32fc_t*)&stage->hb_even[outCount], stage->hb_taps, stage->hb_count);
+		dsp::complex_t c = stage->hb_odd[outCount + centerIndex];
+		out[outCount].re = lv_creal(sum) + (c.re * stage->hb_center);
+		out[outCount].im = lv_cimag(sum) + (c.im * stage->hb_center);
+	}
+	stage->hb_offset = start + (outCount * 2) - count;
+
+	//Keep the end for the next block
+	memmove(stage->hb_history, &stage->hb_history[count], sizeof(dsp::complex_t) * (tapCount - 1));
+
+	return outCount;
+}
+
+int fmice_decimator::process_stage(fmice_decimator_stage_t* stage, int count, const dsp::complex_t* in, dsp::complex_t* out) {
+	if (stage->half_band)
+		return process_half_band(stage, count, in, out);
+	else if (stage->interp == 1)
+		return stage->fir.process(count, in, out);
+	else
+		return stage->resamp.process(count, in, out);
+}
+
+int fmice_decimator::process(int count, const dsp::complex_t* in, dsp::complex_t* out) {
+	//Run all but the last stage into their own buffers
+	const dsp::complex_t* stageIn = in;
+	for (int i = 0; i < stage_count - 1; i++) {
+		dsp::complex_t* stageOut = stages[i].half_band ? stages[i].hb_out : (stages[i].interp == 1) ? stages[i].fir.out.writeBuf : stages[i].resamp.out.writeBuf;
+		count = process_stage(&stages[i], count, stageIn, stageOut);
+		stageIn = stageOut;
+	}
+
+	//Run the final stage into the output
+	return process_stage(&stages[stage_count - 1], count, stageIn, out);
+}
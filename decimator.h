@@ -0,0 +1,92 @@
+#pragma once
+
+#include <dsp/stream.h>
+#include <dsp/taps/tap.h>
+#include <dsp/filter/decimating_fir.h>
+#include <dsp/multirate/polyphase_resampler.h>
+
+#define FMICE_DECIMATOR_MAX_STAGES 8
+
+struct fmice_decimator_stage_t {
+
+	int interp;
+	int decim;
+	int in_rate;
+	int out_rate;
+
+	dsp::tap<float> taps; // Full set, including the zeros of a half-band
+	dsp::filter::DecimatingFIR<dsp::complex_t, float> fir; // Used when interp is 1 and it isn't a half-band
+	dsp::multirate::PolyphaseResampler<dsp::complex_t> resamp; // Used when interp isn't 1
+
+	// Half-band only - Every other tap is zero apart from the center, so only the rest are stored and run
+	bool half_band;
+	float* hb_taps; // Taps at even indices, which are the ones that aren't zero
+	int hb_count;
+	float hb_center; // Center tap, at an odd index
+	int hb_offset; // Input index of the next output, carried across blocks
+	dsp::complex_t* hb_history; // Last taps.size - 1 samples followed by the current block
+	dsp::complex_t* hb_even; // History samples at the parity of the next output, then the others
+	dsp::complex_t* hb_odd;
+	dsp::complex_t* hb_out;
+
+};
+
+/// <summary>
+/// Multi-stage decimating channel filter. Half-band stages, which skip their zero taps and so cost about half a regular FIR of the
+/// same length, bring the rate down first and a single polyphase stage does the sharp channel filtering at the lowest rate.
+/// </summary>
+class fmice_decimator {
+
+public:
+	fmice_decimator(int bufferSize);
+	~fmice_decimator();
+
+	/// <summary>
+	/// Plans the stages needed to go from inRate to outRate and designs their filters. The channel filter (cutoff/trans) is applied by the last stage.
+	/// </summary>
+	/// <param name="inRate">Input sample rate.</param>
+	/// <param name="outRate">Output sample rate. Must be less than or equal to the input rate.</param>
+	/// <param name="cutoff">Channel filter cutoff.</param>
+	/// <param name="trans">Channel filter transition width.</param>
+	/// <param name="coarseRate">If set, a wide polyphase stage first brings an awkward ratio down to this rate, only keeping the channel alias free.</param>
+	void init(int inRate, int outRate, double cutoff, double trans, int coarseRate = 0);
+
+	/// <summary>
+	/// Filters and decimates count samples from in into out. Returns the number of output samples. In and out may not overlap.
+	/// </summary>
+	int process(int count, const dsp::complex_t* in, dsp::complex_t* out);
+
+	/// <summary>
+	/// Prints the stage plan and tap counts.
+	/// </summary>
+	void print_plan(const char* name);
+
+	dsp::stream<dsp::complex_t> out;
+
+private:
+	int buffer_size;
+
+	fmice_decimator_stage_t stages[FMICE_DECIMATOR_MAX_STAGES];
+	int stage_count;
+
+	/// <summary>
+	/// Appends a stage and designs its low-pass filter at the stage's interpolated rate.
+	/// </summary>
+	fmice_decimator_stage_t* add_stage(int inRate, int interp, int decim, double cutoff, double trans);
+
+	/// <summary>
+	/// Appends a decimate-by-2 half-band stage whose transition band is trans wide and centered on a quarter of inRate.
+	/// </summary>
+	void add_half_band(int inRate, double trans);
+
+	/// <summary>
+	/// Runs a half-band stage, computing only the kept outputs from the taps that aren't zero.
+	/// </summary>
+	int process_half_band(fmice_decimator_stage_t* stage, int count, const dsp::complex_t* in, dsp::complex_t* out);
+
+	/// <summary>
+	/// Runs a single stage.
+	/// </summary>
+	int process_stage(fmice_decimator_stage_t* stage, int count, const dsp::complex_t* in, dsp::complex_t* out);
+
+};
@@ -6,6 +6,7 @@
 #define AUDIO_DECIM_RATE 2
 #define MPX_SAMP_RATE (SAMP_RATE / DECIM_RATE)
 #define AUDIO_SAMP_RATE (MPX_SAMP_RATE / AUDIO_DECIM_RATE)
+#define WIDEBAND_SAMP_RATE 912000 /* Device rate when channelizing several stations */
 
 #define FMICE_BLOCK_SIZE 32768 /* Block size going to encoder */
 #define FMICE_BLOCK_COUNT 8
@@ -6,10 +6,28 @@
 class fmice_device {
 
 public:
+	virtual ~fmice_device() {}
+
 	virtual void start() = 0;
 
 	virtual int get_dropped_samples() = 0;
 
+	/// <summary>
+	/// True if samples arrive in real time and must be dropped when nothing keeps up. False for sources that wait on the reader, like a file played as fast as possible.
+	/// </summary>
+	virtual bool is_realtime() { return true; }
+
 	virtual int read(dsp::complex_t* samples, int count) = 0;
 
+	/// <summary>
+	/// Waits for count samples and returns them in place without copying. The samples may be modified and stay valid until release_read.
+	/// Returns NULL once a finite source has run out.
+	/// </summary>
+	virtual dsp::complex_t* acquire_read(int count) = 0;
+
+	/// <summary>
+	/// Releases samples returned by acquire_read.
+	/// </summary>
+	virtual void release_read(int count) = 0;
+
 };
\ No newline at end of file
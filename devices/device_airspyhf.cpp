@@ -4,7 +4,7 @@
 
 fmice_device_airspyhf::fmice_device_airspyhf(int sampleRate) :
 	radio(NULL),
-	radio_buffer(new fmice_circular_buffer<airspyhf_complex_float_t>(sampleRate)),
+	radio_buffer(new fmice_spsc_buffer<airspyhf_complex_float_t>(sampleRate)),
 	sample_rate(sampleRate),
 	dropped_samples(0)
 {
@@ -90,4 +90,12 @@ int fmice_device_airspyhf::airspyhf_rx_cb(airspyhf_transfer_t* transfer) {
 
 int fmice_device_airspyhf::read(dsp::complex_t* samples, int count) {
 	return radio_buffer->read((airspyhf_complex_float_t*)samples, count);
+}
+
+dsp::complex_t* fmice_device_airspyhf::acquire_read(int count) {
+	return (dsp::complex_t*)radio_buffer->acquire_read(count);
+}
+
+void fmice_device_airspyhf::release_read(int count) {
+	radio_buffer->release_read(count);
 }
\ No newline at end of file
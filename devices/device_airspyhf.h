@@ -1,7 +1,7 @@
 #pragma once
 
 #include "../device.h"
-#include "../circular_buffer.h"
+#include "../spsc_buffer.h"
 
 #include <libairspyhf/airspyhf.h>
 
@@ -19,10 +19,14 @@ public:
 
 	virtual int read(dsp::complex_t* samples, int count) override;
 
+	virtual dsp::complex_t* acquire_read(int count) override;
+
+	virtual void release_read(int count) override;
+
 private:
 	int sample_rate;
 	airspyhf_device_t* radio;
-	fmice_circular_buffer<airspyhf_complex_float_t>* radio_buffer;
+	fmice_spsc_buffer<airspyhf_complex_float_t>* radio_buffer; // Written only by the USB callback, read only by the radio
 
 	pthread_mutex_t mutex;
 	uint64_t dropped_samples; // must only be accessed while in mutex
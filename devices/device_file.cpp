@@ -0,0 +1,273 @@
+#include "device_file.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <volk/volk.h>
+
+fmice_device_file::fmice_device_file(int sampleRate) :
+	sample_rate(sampleRate),
+	loop(false),
+	realtime(true),
+	format(FMICE_FILE_FORMAT_CF32),
+	mapped(0),
+	mapped_size(0),
+	samples(0),
+	sample_count(0),
+	sample_size(0),
+	position(0),
+	buffer(0),
+	buffer_size(0),
+	span_mapped(false),
+	samples_released(0)
+{
+
+}
+
+fmice_device_file::~fmice_device_file() {
+	//Unmap
+	if (mapped != 0)
+		munmap(mapped, mapped_size);
+
+	//Free buffer
+	if (buffer != 0)
+		volk_free(buffer);
+}
+
+bool fmice_device_file::parse_format(const char* name, fmice_device_file_format* format) {
+	if (strcmp(name, "cf32") == 0)
+		*format = FMICE_FILE_FORMAT_CF32;
+	else if (strcmp(name, "cs16") == 0)
+		*format = FMICE_FILE_FORMAT_CS16;
+	else if (strcmp(name, "cu8") == 0)
+		*format = FMICE_FILE_FORMAT_CU8;
+	else if (strcmp(name, "wav") == 0)
+		*format = FMICE_FILE_FORMAT_WAV;
+	else
+		return false;
+	return true;
+}
+
+void fmice_device_file::open(const char* path, fmice_device_file_format format, bool loop, bool realtime) {
+	//Open
+	int fd = ::open(path, O_RDONLY);
+	if (fd < 0) {
+		printf("Failed to open IQ file \"%s\".\n", path);
+		throw std::runtime_error("Failed to open IQ file.");
+	}
+
+	//Map the whole file
+	struct stat info;
+	if (fstat(fd, &info) != 0 || info.st_size == 0) {
+		close(fd);
+		throw std::runtime_error("Failed to get IQ file size.");
+	}
+	mapped_size = info.st_size;
+	mapped = (uint8_t*)mmap(NULL, mapped_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0); // Copy on write, so spans handed out may be modified without touching the file
+	close(fd);
+	if (mapped == MAP_FAILED) {
+		mapped = 0;
+		throw std::runtime_error("Failed to map IQ file.");
+	}
+
+	//Read ahead, since it's going to be read front to back
+	madvise(mapped, mapped_size, MADV_SEQUENTIAL);
+
+	//Find the samples
+	this->format = format;
+	this->loop = loop;
+	this->realtime = realtime;
+	samples = mapped;
+	if (format == FMICE_FILE_FORMAT_WAV)
+		parse_wav();
+	else
+		sample_count = mapped_size;
+
+	//Get the number of samples
+	switch (this->format) {
+	case FMICE_FILE_FORMAT_CF32: sample_size = sizeof(float) * 2; break;
+	case FMICE_FILE_FORMAT_CS16: sample_size = sizeof(int16_t) * 2; break;
+	default: sample_size = sizeof(uint8_t) * 2; break;
+	}
+	sample_count /= sample_size;
+	if (sample_count == 0)
+		throw std::runtime_error("IQ file contains no samples.");
+}
+
+void fmice_device_file::parse_wav() {
+	//Check header
+	if (mapped_size < 12 || memcmp(mapped, "RIFF", 4) != 0 || memcmp(mapped + 8, "WAVE", 4) != 0)
+		throw std::runtime_error("IQ file is not a WAV file.");
+
+	//Walk chunks
+	uint16_t wavFormat = 0;
+	uint16_t channels = 0;
+	uint32_t rate = 0;
+	uint16_t bits = 0;
+	size_t offset = 12;
+	while (offset + 8 <= mapped_size) {
+		//Read chunk header
+		uint32_t chunkSize;
+		memcpy(&chunkSize, mapped + offset + 4, sizeof(chunkSize));
+		const uint8_t* chunk = mapped + offset + 8;
+
+		//Handle
+		if (memcmp(mapped + offset, "fmt ", 4) == 0 && chunkSize >= 16) {
+			memcpy(&wavFormat, chunk, sizeof(wavFormat));
+			memcpy(&channels, chunk + 2, sizeof(channels));
+			memcpy(&rate, chunk + 4, sizeof(rate));
+			memcpy(&bits, chunk + 14, sizeof(bits));
+		}
+		else if (memcmp(mapped + offset, "data", 4) == 0) {
+			samples = chunk;
+			sample_count = std::min((size_t)chunkSize, mapped_size - (offset + 8));
+			break;
+		}
+
+		//Chunks are padded to an even size
+		offset += 8 + chunkSize + (chunkSize & 1);
+	}
+
+	//Validate
+	if (samples == mapped || channels != 2)
+		throw std::runtime_error("WAV IQ file must have a data chunk and two channels.");
+	if ((int)rate != sample_rate) {
+		printf("WAV IQ file is at %i Hz, but %i Hz is needed.\n", rate, sample_rate);
+		throw std::runtime_error("WAV IQ file is at the wrong sample rate.");
+	}
+
+	//Get format
+	if (wavFormat == 3 && bits == 32)
+		format = FMICE_FILE_FORMAT_CF32;
+	else if (wavFormat == 1 && bits == 16)
+		format = FMICE_FILE_FORMAT_CS16;
+	else if (wavFormat == 1 && bits == 8)
+		format = FMICE_FILE_FORMAT_CU8;
+	else
+		throw std::runtime_error("WAV IQ file must be 32-bit float, 16-bit or 8-bit.");
+}
+
+void fmice_device_file::start() {
+	//Sanity check
+	if (mapped == 0)
+		throw std::runtime_error("IQ file is not opened. Call open function.");
+
+	//Pacing starts now
+	clock_gettime(CLOCK_MONOTONIC, &start_time);
+}
+
+bool fmice_device_file::is_realtime() {
+	return realtime;
+}
+
+int fmice_device_file::get_dropped_samples() {
+	return 0;
+}
+
+void fmice_device_file::convert(dsp::complex_t* out, size_t offset, int count) {
+	const uint8_t* in = samples + (offset * sample_size);
+	switch (format) {
+	case FMICE_FILE_FORMAT_CF32:
+		memcpy(out, in, sizeof(dsp::complex_t) * count);
+		break;
+	case FMICE_FILE_FORMAT_CS16:
+		volk_16i_s32f_convert_32f((float*)out, (const int16_t*)in, 32768.0f, count * 2);
+		break;
+	default:
+		for (int i = 0; i < count * 2; i++)
+			((float*)out)[i] = (in[i] - 127.5f) / 127.5f;
+		break;
+	}
+}
+
+void fmice_device_file::pace(int count) {
+	//Work out when the last of these samples would have come off a real device
+	uint64_t due = ((samples_released + count) * 1000000000ULL) / sample_rate;
+	struct timespec wake = start_time;
+	wake.tv_sec += due / 1000000000ULL;
+	wake.tv_nsec += due % 1000000000ULL;
+	if (wake.tv_nsec >= 1000000000L) {
+		wake.tv_sec++;
+		wake.tv_nsec -= 1000000000L;
+	}
+
+	//Sleep until then
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake, NULL) != 0);
+}
+
+dsp::complex_t* fmice_device_file::acquire_read(int count) {
+	//Stop at the end unless looping
+	if (!loop && sample_count - position < (size_t)count)
+		return 0;
+
+	//cf32 is already in the right format, so hand out the mapping itself unless the span wraps around the loop point
+	const uint8_t* in = samples + (position * sample_size);
+	span_mapped = format == FMICE_FILE_FORMAT_CF32 && sample_count - position >= (size_t)count && ((uintptr_t)in % alignof(dsp::complex_t)) == 0;
+	if (span_mapped) {
+		if (realtime)
+			pace(count);
+		return (dsp::complex_t*)in;
+	}
+
+	//Make sure the buffer is big enough
+	if (count > buffer_size) {
+		if (buffer != 0)
+			volk_free(buffer);
+		buffer = (dsp::complex_t*)volk_malloc(sizeof(dsp::complex_t) * count, volk_get_alignment());
+		if (buffer == 0)
+			throw std::runtime_error("Failed to allocate buffer.");
+		buffer_size = count;
+	}
+
+	//Convert, wrapping around as many times as needed
+	int converted = 0;
+	size_t pos = position;
+	while (converted < count) {
+		int chunk = (int)std::min((size_t)(count - converted), sample_count - pos);
+		convert(buffer + converted, pos, chunk);
+		converted += chunk;
+		pos = (pos + chunk) % sample_count;
+	}
+
+	//Wait until they're due
+	if (realtime)
+		pace(count);
+
+	return buffer;
+}
+
+void fmice_device_file::release_read(int count) {
+	//A looping file plays these pages again - Drop them so any changes made to the span are replaced by the file's contents next time.
+	//Pages it shares with its neighbours go too, as nothing else is handed out and samples that haven't been are unchanged anyway.
+	if (span_mapped && loop) {
+		uintptr_t page = (uintptr_t)sysconf(_SC_PAGESIZE);
+		uintptr_t start = (uintptr_t)(samples + (position * sample_size)) & ~(page - 1);
+		uintptr_t end = ((uintptr_t)(samples + ((position + count) * sample_size)) + page - 1) & ~(page - 1); // The mapping covers whole pages
+		if (end > start)
+			madvise((void*)start, end - start, MADV_DONTNEED);
+	}
+	span_mapped = false;
+
+	position += count;
+	if (loop)
+		position %= sample_count;
+	samples_released += count;
+}
+
+int fmice_device_file::read(dsp::complex_t* samples, int count) {
+	//Get samples
+	dsp::complex_t* span = acquire_read(count);
+	if (span == 0)
+		return 0;
+
+	//Copy out and release
+	memcpy(samples, span, sizeof(dsp::complex_t) * count);
+	release_read(count);
+
+	return count;
+}
@@ -0,0 +1,89 @@
+#pragma once
+
+#include "../device.h"
+
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+
+enum fmice_device_file_format {
+
+	FMICE_FILE_FORMAT_CF32, // Interleaved 32-bit float I/Q
+	FMICE_FILE_FORMAT_CS16, // Interleaved signed 16-bit I/Q
+	FMICE_FILE_FORMAT_CU8, // Interleaved unsigned 8-bit I/Q, as from an RTL-SDR
+	FMICE_FILE_FORMAT_WAV // Stereo WAV in any of the above, format taken from the header
+
+};
+
+/// <summary>
+/// Plays back a recorded IQ file. It can be paced to the sample rate like a real device, or read as fast as the radio can go for benchmarking.
+/// cf32 samples are handed out straight from the mapping without a copy.
+/// </summary>
+class fmice_device_file : public fmice_device {
+
+public:
+	fmice_device_file(int sampleRate);
+	~fmice_device_file();
+
+	/// <summary>
+	/// Maps the file and parses its header (for WAV).
+	/// </summary>
+	/// <param name="path">File to open.</param>
+	/// <param name="format">Sample format.</param>
+	/// <param name="loop">If true, starts over at the end instead of stopping.</param>
+	/// <param name="realtime">If true, samples are released no faster than the sample rate.</param>
+	void open(const char* path, fmice_device_file_format format, bool loop, bool realtime);
+
+	virtual void start() override;
+
+	virtual int get_dropped_samples() override;
+
+	virtual bool is_realtime() override;
+
+	virtual int read(dsp::complex_t* samples, int count) override;
+
+	virtual dsp::complex_t* acquire_read(int count) override;
+
+	virtual void release_read(int count) override;
+
+	/// <summary>
+	/// Parses a format name (cf32, cs16, cu8, wav). Returns false if it is unknown.
+	/// </summary>
+	static bool parse_format(const char* name, fmice_device_file_format* format);
+
+private:
+	int sample_rate;
+	bool loop;
+	bool realtime;
+
+	fmice_device_file_format format; // Never WAV once opened
+	uint8_t* mapped;
+	size_t mapped_size;
+	const uint8_t* samples; // Start of the sample data within the mapping
+	size_t sample_count;
+	size_t sample_size;
+	size_t position;
+
+	dsp::complex_t* buffer; // Converted samples for formats other than cf32, or a cf32 span that wraps around
+	int buffer_size;
+	bool span_mapped; // The last span handed out points into the mapping rather than the buffer
+
+	uint64_t samples_released;
+	struct timespec start_time;
+
+	/// <summary>
+	/// Finds the sample data and format within a WAV file.
+	/// </summary>
+	void parse_wav();
+
+	/// <summary>
+	/// Converts count samples starting at position into out.
+	/// </summary>
+	void convert(dsp::complex_t* out, size_t offset, int count);
+
+	/// <summary>
+	/// Sleeps until the next count samples are due.
+	/// </summary>
+	void pace(int count);
+
+};
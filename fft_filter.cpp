@@ -0,0 +1,171 @@
+#include "fft_filter.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <stdexcept>
+#include <algorithm>
+#include <volk/volk.h>
+
+#define FFT_FILTER_MAX_GROWTH 16 // Largest FFT tried, as a multiple of the smallest that fits the taps
+
+fmice_fft_filter::fmice_fft_filter() :
+	tap_count(0),
+	use_fft(false),
+	fft_size(0),
+	block_size(0),
+	block_fill(0),
+	time_buffer(0),
+	pending(0),
+	spectrum(0),
+	taps_spectrum(0),
+	result(0),
+	forward(0),
+	backward(0)
+{
+
+}
+
+fmice_fft_filter::~fmice_fft_filter() {
+	free_fft();
+}
+
+void fmice_fft_filter::free_fft() {
+	if (forward != 0)
+		fftwf_destroy_plan(forward);
+	if (backward != 0)
+		fftwf_destroy_plan(backward);
+	fftwf_free(time_buffer);
+	fftwf_free(pending);
+	fftwf_free(spectrum);
+	fftwf_free(taps_spectrum);
+	fftwf_free(result);
+	forward = 0;
+	backward = 0;
+	time_buffer = 0;
+	pending = 0;
+	spectrum = 0;
+	taps_spectrum = 0;
+	result = 0;
+}
+
+double fmice_fft_filter::estimate_cost(int n) {
+	//Direct form is a multiply and add per tap
+	if (n == 0)
+		return 2.0 * tap_count;
+
+	//Real FFT each way is about 2.5 N log2(N), plus a complex multiply per bin, spread over the L outputs of the block
+	double perBlock = (2 * 2.5 * n * log2((double)n)) + (6.0 * ((n / 2) + 1));
+	return perBlock / (n - tap_count + 1);
+}
+
+void fmice_fft_filter::init(dsp::tap<float> taps, int blockSize) {
+	//Reset
+	free_fft();
+	tap_count = taps.size;
+	block_fill = 0;
+
+	//Find the cheapest FFT size, without letting a block get much longer than the caller's so output stays even
+	int smallest = 1;
+	while (smallest < 2 * tap_count)
+		smallest <<= 1;
+	int largest = std::max(smallest, (int)std::min((int64_t)smallest * FFT_FILTER_MAX_GROWTH, (int64_t)(tap_count + blockSize) * 2));
+	double bestCost = estimate_cost(0);
+	fft_size = 0;
+	for (int n = smallest; n <= largest; n <<= 1) {
+		double cost = estimate_cost(n);
+		if (cost < bestCost) {
+			bestCost = cost;
+			fft_size = n;
+		}
+	}
+	use_fft = fft_size != 0;
+
+	//Set up the direct form if it won
+	if (!use_fft) {
+		fir.init(NULL, taps);
+		return;
+	}
+
+	//Allocate
+	block_size = fft_size - tap_count + 1;
+	int bins = (fft_size / 2) + 1;
+	time_buffer = (float*)fftwf_malloc(sizeof(float) * fft_size);
+	pending = (float*)fftwf_malloc(sizeof(float) * block_size);
+	result = (float*)fftwf_malloc(sizeof(float) * fft_size);
+	spectrum = (fftwf_complex*)fftwf_malloc(sizeof(fftwf_complex) * bins);
+	taps_spectrum = (fftwf_complex*)fftwf_malloc(sizeof(fftwf_complex) * bins);
+	if (time_buffer == 0 || pending == 0 || result == 0 || spectrum == 0 || taps_spectrum == 0)
+		throw std::runtime_error("Failed to allocate FFT filter buffers.");
+
+	//Plan - Measuring trashes the buffers, so do it before filling them
+	forward = fftwf_plan_dft_r2c_1d(fft_size, time_buffer, spectrum, FFTW_MEASURE);
+	backward = fftwf_plan_dft_c2r_1d(fft_size, spectrum, result, FFTW_MEASURE);
+	if (forward == 0 || backward == 0)
+		throw std::runtime_error("Failed to plan FFT filter.");
+
+	//Transform the taps, scaled so the unnormalized round trip comes out at unity gain
+	memset(time_buffer, 0, sizeof(float) * fft_size);
+	for (int i = 0; i < tap_count; i++)
+		time_buffer[i] = taps.taps[i] / fft_size;
+	fftwf_execute_dft_r2c(forward, time_buffer, taps_spectrum);
+
+	//Start with silence
+	memset(time_buffer, 0, sizeof(float) * fft_size);
+	memset(pending, 0, sizeof(float) * block_size);
+}
+
+bool fmice_fft_filter::is_fft() {
+	return use_fft;
+}
+
+int fmice_fft_filter::get_delay() {
+	return use_fft ? block_size : 0;
+}
+
+void fmice_fft_filter::print_plan(const char* name) {
+	if (use_fft)
+		printf("%s: %i taps, FFT %i (block %i, delay %i), ~%.0f flops/sample vs %.0f direct\n", name, tap_count, fft_size, block_size, block_size, estimate_cost(fft_size), estimate_cost(0));
+	else
+		printf("%s: %i taps, direct form\n", name, tap_count);
+}
+
+void fmice_fft_filter::process_block() {
+	//Convolve
+	fftwf_execute_dft_r2c(forward, time_buffer, spectrum);
+	volk_32fc_x2_multiply_32fc((lv_32fc_t*)spectrum, (const lv_32fc_t*)spectrum, (const lv_32fc_t*)taps_spectrum, (fft_size / 2) + 1);
+	fftwf_execute_dft_c2r(backward, spectrum, result);
+
+	//The first taps-1 outputs wrapped around, the rest are good
+	memcpy(pending, &result[tap_count - 1], sizeof(float) * block_size);
+
+	//Keep the end of this block as history for the next
+	memmove(time_buffer, &time_buffer[block_size], sizeof(float) * (tap_count - 1));
+}
+
+int fmice_fft_filter::process(int count, const float* in, float* out) {
+	//Direct form
+	if (!use_fft)
+		return fir.process(count, in, out);
+
+	//Fill the block, handing out the last block's results for the same positions as we go
+	int remaining = count;
+	while (remaining > 0) {
+		//Take as much as fits - Read the input before writing output since they may be the same
+		int n = std::min(remaining, block_size - block_fill);
+		memcpy(&time_buffer[tap_count - 1 + block_fill], in, sizeof(float) * n);
+		memcpy(out, &pending[block_fill], sizeof(float) * n);
+		block_fill += n;
+		in += n;
+		out += n;
+		remaining -= n;
+
+		//Filter once the block is full
+		if (block_fill == block_size) {
+			process_block();
+			block_fill = 0;
+		}
+	}
+
+	return count;
+}
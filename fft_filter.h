@@ -0,0 +1,77 @@
+#pragma once
+
+#include <dsp/taps/tap.h>
+#include <dsp/filter/fir.h>
+#include <fftw3.h>
+
+/// <summary>
+/// Real FIR filter that can stand in for a long dsp::filter::FIR. It runs as an overlap-save FFT convolution when that is
+/// cheaper than the direct form, which it almost always is past a few hundred taps.
+/// In FFT form the output is delayed by exactly one FFT block (see get_delay) on top of the filter's own delay, no matter how
+/// samples are passed in.
+/// </summary>
+class fmice_fft_filter {
+
+public:
+	fmice_fft_filter();
+	~fmice_fft_filter();
+
+	/// <summary>
+	/// Sets the taps and picks the cheaper form for them. Not thread safe (FFTW planning), so call while setting up.
+	/// </summary>
+	/// <param name="taps">Taps to filter with. Must stay valid while the filter is in use.</param>
+	/// <param name="blockSize">Typical number of samples per process call. The FFT block is kept from getting much longer than this.</param>
+	void init(dsp::tap<float> taps, int blockSize);
+
+	/// <summary>
+	/// Filters count samples. In and out may be the same buffer.
+	/// </summary>
+	int process(int count, const float* in, float* out);
+
+	/// <summary>
+	/// Returns true if running as an FFT convolution rather than the direct form.
+	/// </summary>
+	bool is_fft();
+
+	/// <summary>
+	/// Extra delay, in samples, added by block processing. Zero in direct form.
+	/// </summary>
+	int get_delay();
+
+	/// <summary>
+	/// Prints the chosen form and its cost.
+	/// </summary>
+	void print_plan(const char* name);
+
+private:
+	int tap_count;
+	bool use_fft;
+
+	// Direct form
+	dsp::filter::FIR<float, float> fir;
+
+	// FFT form
+	int fft_size; // N
+	int block_size; // L - New samples per FFT, N - taps + 1
+	int block_fill; // New samples waiting in time_buffer
+	float* time_buffer; // Last taps-1 samples, then the new block
+	float* pending; // Outputs of the last block, handed out as the next one fills
+	fftwf_complex* spectrum; // Scratch
+	fftwf_complex* taps_spectrum; // Taps, scaled by 1/N so the round trip is unity gain
+	float* result; // Scratch, N samples, only the last L are valid
+	fftwf_plan forward;
+	fftwf_plan backward;
+
+	/// <summary>
+	/// Returns the estimated floating point operations per output sample for an FFT of size n, or for the direct form if n is 0.
+	/// </summary>
+	double estimate_cost(int n);
+
+	/// <summary>
+	/// Convolves the full block in time_buffer into pending.
+	/// </summary>
+	void process_block();
+
+	void free_fft();
+
+};
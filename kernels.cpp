@@ -0,0 +1,275 @@
+#include "kernels.h"
+#include "codec.h"
+#include "stereo_demod.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <cassert>
+
+#define KERNEL_FIR_TAPS 256 // Dot products are timed at a typical filter length...
+#define KERNEL_FIR_OUTPUTS 1024 // ...sliding along a block like a FIR does
+#define KERNEL_BLOCK 8192 // Element-wise kernels are timed over a block this long
+#define KERNEL_BUFFER (KERNEL_BLOCK + KERNEL_FIR_TAPS + 16)
+
+/// <summary>
+/// Scratch buffers shared by every benchmark. Sized so a kernel can be started one element in to test unaligned access.
+/// </summary>
+struct kernel_buffers_t {
+
+	lv_32fc_t* ca;
+	lv_32fc_t* cb;
+	lv_32fc_t* cout;
+	float* fa;
+	float* fb;
+	float* fout;
+	int16_t* s16;
+
+};
+
+/// <summary>
+/// A kernel to profile.
+/// </summary>
+struct kernel_t {
+
+	const char* name;
+	const char* stages; // Where the radio uses it
+	volk_func_desc_t(*get_desc)();
+	void (*run)(kernel_buffers_t* b, int offset, const char* impl); // One timed call, starting offset elements into each buffer
+
+};
+
+static void run_dot_prod_32fc(kernel_buffers_t* b, int offset, const char* impl) {
+	for (int i = 0; i < KERNEL_FIR_OUTPUTS; i++)
+		volk_32fc_32f_dot_prod_32fc_manual(&b->cout[0], &b->ca[offset], &b->fa[offset], KERNEL_FIR_TAPS, impl);
+}
+
+static void run_dot_prod_32f(kernel_buffers_t* b, int offset, const char* impl) {
+	for (int i = 0; i < KERNEL_FIR_OUTPUTS; i++)
+		volk_32f_x2_dot_prod_32f_manual(&b->fout[0], &b->fa[offset], &b->fb[offset], KERNEL_FIR_TAPS, impl);
+}
+
+static void run_multiply_32fc(kernel_buffers_t* b, int offset, const char* impl) {
+	volk_32fc_x2_multiply_32fc_manual(&b->cout[offset], &b->ca[offset], &b->cb[offset], KERNEL_BLOCK, impl);
+}
+
+static void run_rotator_32fc(kernel_buffers_t* b, int offset, const char* impl) {
+	lv_32fc_t phase = lv_32fc_t(1, 0);
+	volk_32fc_s32fc_x2_rotator_32fc_manual(&b->cout[offset], &b->ca[offset], lv_32fc_t(0.99f, 0.14f), &phase, KERNEL_BLOCK, impl);
+}
+
+static void run_multiply_32f(kernel_buffers_t* b, int offset, const char* impl) {
+	volk_32f_x2_multiply_32f_manual(&b->fout[offset], &b->fa[offset], &b->fb[offset], KERNEL_BLOCK, impl);
+}
+
+static void run_scale_32f(kernel_buffers_t* b, int offset, const char* impl) {
+	volk_32f_s32f_multiply_32f_manual(&b->fout[offset], &b->fa[offset], 2.0f, KERNEL_BLOCK, impl);
+}
+
+static void run_convert_16i(kernel_buffers_t* b, int offset, const char* impl) {
+	volk_16i_s32f_convert_32f_manual(&b->fout[offset], &b->s16[offset], 32768.0f, KERNEL_BLOCK, impl);
+}
+
+static const kernel_t KERNELS[FMICE_KERNEL_COUNT] = {
+	{ "volk_32fc_32f_dot_prod_32fc", "baseband filter, stereo audio filter, pilot PLL", volk_32fc_32f_dot_prod_32fc_get_func_desc, run_dot_prod_32fc },
+	{ "volk_32f_x2_dot_prod_32f", "composite filter, stereo encoder, RDS", volk_32f_x2_dot_prod_32f_get_func_desc, run_dot_prod_32f },
+	{ "volk_32fc_x2_multiply_32fc", "stereo decoder (complex)", volk_32fc_x2_multiply_32fc_get_func_desc, run_multiply_32fc },
+	{ "volk_32fc_s32fc_x2_rotator_32fc", "NCO bank", volk_32fc_s32fc_x2_rotator_32fc_get_func_desc, run_rotator_32fc },
+	{ "volk_32f_x2_multiply_32f", "stereo encoder", volk_32f_x2_multiply_32f_get_func_desc, run_multiply_32f },
+	{ "volk_32f_s32f_multiply_32f", "gain", volk_32f_s32f_multiply_32f_get_func_desc, run_scale_32f },
+	{ "volk_16i_s32f_convert_32f", "cs16 input", volk_16i_s32f_convert_32f_get_func_desc, run_convert_16i }
+};
+
+/// <summary>
+/// Reads a short name for the CPU from /proc/cpuinfo - The model name on x86, the part number on ARM.
+/// </summary>
+static void read_cpu_name(char* output, size_t len) {
+	strncpy(output, "unknown", len);
+	FILE* file = fopen("/proc/cpuinfo", "r");
+	if (file == NULL)
+		return;
+	char line[256];
+	while (fgets(line, sizeof(line), file) != NULL) {
+		if (strncmp(line, "model name", 10) != 0 && strncmp(line, "CPU part", 8) != 0)
+			continue;
+		char* value = strchr(line, ':');
+		if (value == NULL)
+			continue;
+		value++;
+		while (*value == ' ' || *value == '\t')
+			value++;
+		value[strcspn(value, "\n")] = 0;
+		strncpy(output, value, len - 1);
+		output[len - 1] = 0;
+		break;
+	}
+	fclose(file);
+}
+
+static bool make_dir(const char* path) {
+	return mkdir(path, 0755) == 0 || errno == EEXIST;
+}
+
+fmice_kernel_profile::fmice_kernel_profile() :
+	loaded(false)
+{
+	strncpy(machine, volk_get_machine(), sizeof(machine) - 1);
+	machine[sizeof(machine) - 1] = 0;
+	read_cpu_name(cpu, sizeof(cpu));
+	memset(choices, 0, sizeof(choices));
+}
+
+bool fmice_kernel_profile::apply(const char* dir, bool force) {
+	//VOLK looks for its config at $VOLK_CONFIGPATH/volk/volk_config
+	char volkDir[512];
+	char path[512];
+	snprintf(volkDir, sizeof(volkDir), "%s/volk", dir);
+	snprintf(path, sizeof(path), "%s/volk_config", volkDir);
+
+	//Use the saved profile if it was made here, otherwise make a new one
+	loaded = !force && load(path);
+	if (!loaded) {
+		printf("Profiling kernels for %s (%s)...\n", cpu, machine);
+		run();
+		if (!make_dir(dir) || !make_dir(volkDir) || !save(path)) {
+			printf("[KERNELS] Failed to save kernel profile to \"%s\": %s\n", path, strerror(errno));
+			return false;
+		}
+	}
+
+	//Point VOLK at it
+	setenv("VOLK_CONFIGPATH", dir, 1);
+	return true;
+}
+
+bool fmice_kernel_profile::load(const char* path) {
+	//Open
+	FILE* file = fopen(path, "r");
+	if (file == NULL)
+		return false;
+
+	//The first line says what it was made on
+	char line[512];
+	char expected[512];
+	snprintf(expected, sizeof(expected), "#fmice machine=%s cpu=%s\n", machine, cpu);
+	bool ok = fgets(line, sizeof(line), file) != NULL && strcmp(line, expected) == 0;
+
+	//Every kernel must be listed
+	int found = 0;
+	while (ok && fgets(line, sizeof(line), file) != NULL) {
+		char name[FMICE_KERNEL_NAME_LEN];
+		char implA[FMICE_KERNEL_NAME_LEN];
+		char implU[FMICE_KERNEL_NAME_LEN];
+		if (line[0] == '#' || sscanf(line, "%127s %127s %127s", name, implA, implU) != 3)
+			continue;
+		for (int i = 0; i < FMICE_KERNEL_COUNT; i++) {
+			if (strcmp(name, KERNELS[i].name) == 0 && choices[i].impl_a[0] == 0) {
+				strcpy(choices[i].impl_a, implA);
+				strcpy(choices[i].impl_u, implU);
+				found++;
+			}
+		}
+	}
+	fclose(file);
+	return ok && found == FMICE_KERNEL_COUNT;
+}
+
+bool fmice_kernel_profile::save(const char* path) {
+	FILE* file = fopen(path, "w");
+	if (file == NULL)
+		return false;
+	fprintf(file, "#fmice machine=%s cpu=%s\n", machine, cpu);
+	fprintf(file, "#Generated by fmice, in the volk_profile format. Delete it or run with --reprofile to profile again.\n");
+	for (int i = 0; i < FMICE_KERNEL_COUNT; i++)
+		fprintf(file, "%s %s %s\n", KERNELS[i].name, choices[i].impl_a, choices[i].impl_u);
+	return fclose(file) == 0;
+}
+
+void fmice_kernel_profile::run() {
+	//Allocate and fill buffers
+	size_t alignment = volk_get_alignment();
+	kernel_buffers_t b;
+	b.ca = (lv_32fc_t*)volk_malloc(sizeof(lv_32fc_t) * KERNEL_BUFFER, alignment);
+	b.cb = (lv_32fc_t*)volk_malloc(sizeof(lv_32fc_t) * KERNEL_BUFFER, alignment);
+	b.cout = (lv_32fc_t*)volk_malloc(sizeof(lv_32fc_t) * KERNEL_BUFFER, alignment);
+	b.fa = (float*)volk_malloc(sizeof(float) * KERNEL_BUFFER, alignment);
+	b.fb = (float*)volk_malloc(sizeof(float) * KERNEL_BUFFER, alignment);
+	b.fout = (float*)volk_malloc(sizeof(float) * KERNEL_BUFFER, alignment);
+	b.s16 = (int16_t*)volk_malloc(sizeof(int16_t) * KERNEL_BUFFER, alignment);
+	assert(b.ca != NULL && b.cb != NULL && b.cout != NULL && b.fa != NULL && b.fb != NULL && b.fout != NULL && b.s16 != NULL);
+	for (int i = 0; i < KERNEL_BUFFER; i++) {
+		b.ca[i] = lv_32fc_t((rand() / (float)RAND_MAX) - 0.5f, (rand() / (float)RAND_MAX) - 0.5f);
+		b.cb[i] = lv_32fc_t((rand() / (float)RAND_MAX) - 0.5f, (rand() / (float)RAND_MAX) - 0.5f);
+		b.fa[i] = (rand() / (float)RAND_MAX) - 0.5f;
+		b.fb[i] = (rand() / (float)RAND_MAX) - 0.5f;
+		b.s16[i] = (int16_t)(rand() - (RAND_MAX / 2));
+	}
+
+	for (int k = 0; k < FMICE_KERNEL_COUNT; k++) {
+		const kernel_t* kernel = &KERNELS[k];
+		fmice_kernel_choice_t* choice = &choices[k];
+		choice->ns_a = 0;
+		choice->ns_u = 0;
+		volk_func_desc_t desc = kernel->get_desc();
+		for (size_t i = 0; i < desc.n_impls; i++) {
+			//Time it on aligned buffers, and on unaligned ones if it can take them - Keep the fastest run, the rest are interruptions
+			double bestA = 0;
+			double bestU = 0;
+			bool canUnaligned = !desc.impl_alignment[i];
+			for (int t = 0; t < FMICE_KERNEL_TRIALS; t++) {
+				int64_t start = fmice_now_ns();
+				kernel->run(&b, 0, desc.impl_names[i]);
+				double elapsed = fmice_now_ns() - start;
+				if (t == 0 || elapsed < bestA)
+					bestA = elapsed;
+				if (canUnaligned) {
+					start = fmice_now_ns();
+					kernel->run(&b, 1, desc.impl_names[i]);
+					elapsed = fmice_now_ns() - start;
+					if (t == 0 || elapsed < bestU)
+						bestU = elapsed;
+				}
+			}
+
+			//Keep the fastest of each
+			if (choice->ns_a == 0 || bestA < choice->ns_a) {
+				strncpy(choice->impl_a, desc.impl_names[i], FMICE_KERNEL_NAME_LEN - 1);
+				choice->ns_a = bestA;
+			}
+			if (canUnaligned && (choice->ns_u == 0 || bestU < choice->ns_u)) {
+				strncpy(choice->impl_u, desc.impl_names[i], FMICE_KERNEL_NAME_LEN - 1);
+				choice->ns_u = bestU;
+			}
+		}
+
+		//VOLK always has a generic implementation, but don't write out a broken line if it somehow didn't
+		if (choice->impl_u[0] == 0)
+			strcpy(choice->impl_u, "generic");
+	}
+
+	//Clean up
+	volk_free(b.ca);
+	volk_free(b.cb);
+	volk_free(b.cout);
+	volk_free(b.fa);
+	volk_free(b.fb);
+	volk_free(b.fout);
+	volk_free(b.s16);
+}
+
+void fmice_kernel_profile::print() {
+	printf("Kernels for %s (%s, %s):\n", cpu, machine, loaded ? "saved profile" : "just profiled");
+	for (int i = 0; i < FMICE_KERNEL_COUNT; i++) {
+		if (loaded)
+			printf("    %-34s %-14s %-14s %s\n", KERNELS[i].name, choices[i].impl_a, choices[i].impl_u, KERNELS[i].stages);
+		else
+			printf("    %-34s %-14s %-14s %s (%.1f / %.1f us)\n", KERNELS[i].name, choices[i].impl_a, choices[i].impl_u, KERNELS[i].stages, choices[i].ns_a / 1000, choices[i].ns_u / 1000);
+	}
+
+	//Our own kernels pick once at startup from what the CPU has
+	printf("    %-34s %-29s %s\n", "clip", fmice_codec::get_clip_impl(), "codecs");
+	printf("    %-34s %-29s %s\n", "deemphasis", fmice_stereo_demod::get_deemphasis_impl(), "stereo decoder");
+}
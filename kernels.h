@@ -0,0 +1,64 @@
+#pragma once
+
+#include <volk/volk.h>
+
+#define FMICE_KERNEL_COUNT 7
+#define FMICE_KERNEL_NAME_LEN 128
+#define FMICE_KERNEL_TRIALS 5 // Timed runs per implementation, the fastest is kept
+
+/// <summary>
+/// The implementations picked for a VOLK kernel. VOLK picks separately for aligned and unaligned buffers.
+/// </summary>
+struct fmice_kernel_choice_t {
+
+	char impl_a[FMICE_KERNEL_NAME_LEN];
+	char impl_u[FMICE_KERNEL_NAME_LEN];
+	double ns_a; // Per call of the benchmark, or 0 if loaded from a profile
+	double ns_u;
+
+};
+
+/// <summary>
+/// Picks the fastest VOLK implementation of each hot kernel on this CPU. Every implementation VOLK has for the machine is timed on
+/// buffers shaped like the radio's, and the winners are written out as a VOLK config file that VOLK is then pointed at, so every call
+/// dispatches straight to them. The file notes which CPU it was made on and is reused on later starts until the CPU changes.
+/// Must be applied before any VOLK kernel is called, as VOLK only reads its config the first time a kernel is dispatched.
+/// </summary>
+class fmice_kernel_profile {
+
+public:
+	fmice_kernel_profile();
+
+	/// <summary>
+	/// Loads the profile from dir, or benchmarks and saves a new one if there isn't one for this CPU (or force is set), then points
+	/// VOLK at it. Returns false if the profile couldn't be saved, in which case VOLK is left to pick on its own.
+	/// </summary>
+	bool apply(const char* dir, bool force);
+
+	/// <summary>
+	/// Prints the implementation used for each kernel and which stages use it.
+	/// </summary>
+	void print();
+
+private:
+	char machine[FMICE_KERNEL_NAME_LEN];
+	char cpu[FMICE_KERNEL_NAME_LEN];
+	bool loaded;
+	fmice_kernel_choice_t choices[FMICE_KERNEL_COUNT];
+
+	/// <summary>
+	/// Reads the profile. Returns false if it's missing or made on a different CPU.
+	/// </summary>
+	bool load(const char* path);
+
+	/// <summary>
+	/// Writes the profile as a VOLK config file.
+	/// </summary>
+	bool save(const char* path);
+
+	/// <summary>
+	/// Times every implementation of every kernel.
+	/// </summary>
+	void run();
+
+};
@@ -1,13 +1,21 @@
 #include "stdio.h"
 #include "defines.h"
 #include "cast.h"
+#include "recorder.h"
 #include "radio.h"
 #include "codecs/codec_flac.h"
 #include "codecs/codec_mp3.h"
+#include "codecs/codec_opus.h"
 #include "devices/device_airspyhf.h"
+#include "devices/device_file.h"
+#include "channelizer.h"
+#include "kernels.h"
 
 #include <getopt.h>
+#include <strings.h>
+#include <pthread.h>
 
+#define DEFAULT_DEMOD_SAMP_RATE (MPX_SAMP_RATE * 2)
 #define DEFAULT_FM_DEVIATION 85000 // Gives headroom for overmodulation
 #define DEFAULT_DEEMPHASIS_RATE 75 // For USA
 #define DEFAULT_BB_FILTER_CUTOFF 125000
@@ -16,14 +24,56 @@
 #define DEFAULT_MPX_FILTER_TRANS 2000
 #define DEFAULT_AUD_FILTER_CUTOFF 15000
 #define DEFAULT_AUD_FILTER_TRANS 4000
-#define DEFAULT_RDS_BUFFER 1
+#define DEFAULT_RDS_BUFFER 0.25f
 #define DEFAULT_RDS_LEVEL -10
 #define DEFAULT_STEREO_PILOT_LEVEL -30
 
-static int frequency = 0;
-static fmice_icecast* icecast_mpx = 0;
-static fmice_icecast* icecast_aud = 0;
+#define MAX_STATIONS FMICE_CHANNELIZER_MAX_CHANNELS
+
+struct fmice_station_t {
+
+	int frequency;
+	fmice_icecast* icecast_mpx;
+	fmice_icecast* icecast_aud;
+	const char* icecast_mpx_codec;
+	const char* icecast_aud_codec;
+	const char* recorder_mpx_path; // May be null
+	const char* recorder_aud_path; // May be null
+
+	fmice_radio* radio;
+	pthread_t thread;
+
+};
+
+static int wideband_frequency = 0; // Device center frequency, or 0 to tune the device to the only station
+static fmice_station_t stations[MAX_STATIONS];
+static int station_count = 1;
 static fmice_radio_settings_t radio_settings;
+static const char* input_path = 0; // IQ file to play back instead of the AirSpy
+static fmice_device_file_format input_format = FMICE_FILE_FORMAT_CF32;
+static bool input_format_set = false;
+static bool input_loop = false;
+static bool input_fast = false;
+static fmice_codec_flac_settings_t flac_settings;
+static bool recorder_raw = false;
+static int recorder_rotate = FMICE_RECORDER_DEFAULT_ROTATE;
+static int recorder_rotate_size = 0; // MB
+static fmice_codec_opus_settings_t opus_settings;
+static const char* kernel_profile_dir = 0; // Set to "none" to leave VOLK to pick, defaults to ~/.fmice
+static bool kernel_reprofile = false;
+
+int parse_cpu_list(const char* input, int* cpus, int max) {
+	int count = 0;
+	const char* cursor = input;
+	while (*cursor != 0 && count < max) {
+		char* end;
+		cpus[count++] = (int)strtol(cursor, &end, 10);
+		if (end == cursor)
+			return -1;
+		cursor = (*end == ',') ? end + 1 : end;
+	}
+	return count;
+}
 
 int parse_freq(const char* input) {
 	int p1;
@@ -38,24 +88,55 @@ void help(char* pgm) {
 	printf("    Basic Settings:\n");
 	printf("        [-f Radio frequency]\n");
 	printf("        [-s Enable status output every 1s]\n");
+	printf("    Wideband (Multiple Stations):\n");
+	printf("        [--wideband Device center frequency - Must come first. Each -f after it adds a station with its own outputs (up to %i)]\n", MAX_STATIONS);
+	printf("    IQ File Input (Instead of AirSpy):\n");
+	printf("        [--input IQ file to play back, at %i Hz (or %i Hz with --wideband)]\n", SAMP_RATE, WIDEBAND_SAMP_RATE);
+	printf("        [--input-format File format <cf32|cs16|cu8|wav> (default is wav for .wav files, otherwise cf32)]\n");
+	printf("        [--input-loop Start over at the end of the file instead of exiting]\n");
+	printf("        [--input-fast Play back as fast as possible instead of in real time]\n");
 	printf("    Add Icecast Output:\n");
 	printf("        [--ice-mpx Composite Icecast codec <flac>]\n");
-	printf("        [--ice-aud Audio Icecast codec <flac>]\n");
+	printf("        [--ice-aud Audio Icecast codec <flac|mp3|opus>]\n");
+	printf("        (Repeat either to add another mount fed by the same encoder, up to %i)\n", FMICE_ICECAST_MAX_MOUNTS);
 	printf("    Configure Icecast Output Settings:\n");
 	printf("        [-h Composite Icecast hostname]\n");
 	printf("        [-o Composite Icecast port]\n");
 	printf("        [-m Composite Icecast mountpoint]\n");
 	printf("        [-u Composite Icecast username]\n");
 	printf("        [-p Composite Icecast password]\n");
+	printf("        [--ice-backlog Seconds of stream to hold and replay while disconnected (default is %i)]\n", FMICE_ICECAST_DEFAULT_BACKLOG);
+	printf("    Local Recording:\n");
+	printf("        [--rec-mpx Record composite to files starting with this path]\n");
+	printf("        [--rec-aud Record audio to files starting with this path]\n");
+	printf("        [--rec-format File format <flac|raw> - Raw is interleaved 32-bit float (default is flac)]\n");
+	printf("        [--rec-rotate Seconds per file, aligned to the clock - Set to 0 to disable (default is %i)]\n", FMICE_RECORDER_DEFAULT_ROTATE);
+	printf("        [--rec-rotate-size Start a new file after this many MB (default is off)]\n");
+	printf("    FLAC Settings:\n");
+	printf("        [--flac-bits Bits per sample <16|24> (default is %i)]\n", FMICE_FLAC_DEFAULT_BITS);
+	printf("        [--flac-level Compression level from 0 to 8 (default is %i)]\n", FMICE_FLAC_DEFAULT_LEVEL);
+	printf("        [--flac-blocksize Samples per FLAC frame (default is set by the level)]\n");
+	printf("        [--flac-threads Encoder threads, needs libFLAC 1.5 or newer (default is %i, up to %i)]\n", FMICE_FLAC_DEFAULT_THREADS, FMICE_FLAC_MAX_THREADS);
+	printf("    Opus Settings:\n");
+	printf("        [--opus-bitrate Bitrate in kbps (default is %i)]\n", FMICE_OPUS_DEFAULT_BITRATE);
+	printf("        [--opus-complexity Encoder complexity from 0 to 10, lower uses less CPU (default is %i)]\n", FMICE_OPUS_DEFAULT_COMPLEXITY);
+	printf("        [--opus-frame Frame duration in ms <2.5|5|10|20|40|60> - Shorter frames lower latency (default is %i)]\n", (FMICE_OPUS_DEFAULT_FRAME_SIZE * 1000) / FMICE_OPUS_SAMP_RATE);
 	printf("    RDS Re-Encoder:\n");
 	printf("        [--rds]\n");
 	printf("        [--rds-level RDS Level in dB (default is %i dB)]\n", DEFAULT_RDS_LEVEL);
-	printf("        [--rds-buffer RDS maximum skew in seconds (default is %is)]\n", DEFAULT_RDS_BUFFER);
+	printf("        [--rds-buffer RDS group buffer in seconds, about half of which is added to RDS latency. Never less than three radio blocks (default is %gs)]\n", DEFAULT_RDS_BUFFER);
 	printf("    Other Features:\n");
 	printf("        [--stereo-gen The stereo pilot level (default is %i dB)]\n", DEFAULT_STEREO_PILOT_LEVEL);
+	printf("    Performance:\n");
+	printf("        [--threads Number of threads to split the radio across (default is 1, up to %i)]\n", FMICE_RADIO_MAX_THREADS);
+	printf("        [--pin-cpus Comma separated CPUs to pin each radio thread to, starting with the front-end]\n");
+	printf("        [--kernel-profile Directory to keep the fastest kernels for this CPU in, or none to leave VOLK to pick (default is ~/.fmice)]\n");
+	printf("        [--reprofile Time the kernels again even if there is a profile for this CPU]\n");
 	printf("    Advanced Settings:\n");
+	printf("        [--demod-rate FM demodulator sample rate, a multiple of %i up to %i (default is %i)]\n", MPX_SAMP_RATE, SAMP_RATE, DEFAULT_DEMOD_SAMP_RATE);
 	printf("        [--deviation FM deviation (default is %i)]\n", DEFAULT_FM_DEVIATION);
 	printf("        [--deemphasis FM deemphasis rate (default is %i - Set to 0 to disable)]\n", DEFAULT_DEEMPHASIS_RATE);
+	printf("        [--stereo-engine Stereo decoder <complex|real> - Real tracks the pilot at a reduced rate for less CPU (default is complex)]\n");
 	printf("        [--bb-filter-cutoff Custom baseband filter cutoff (default is %i hz)]\n", DEFAULT_BB_FILTER_CUTOFF);
 	printf("        [--bb-filter-trans Custom baseband filter transition (default is %i hz)]\n", DEFAULT_BB_FILTER_TRANS);
 	printf("        [--mpx-filter-cutoff Custom composite filter cutoff (default is %i hz)]\n", DEFAULT_MPX_FILTER_CUTOFF);
@@ -68,16 +149,42 @@ static fmice_icecast* create_icecast(const char* codecName, int channels, int sa
 	//Determine the codec to create
 	fmice_codec* codec;
 	if (strcmp(codecName, "flac") == 0)
-		codec = new fmice_codec_flac(sampRate, channels);
+		codec = new fmice_codec_flac(sampRate, channels, &flac_settings);
 	else if (strcmp(codecName, "mp3") == 0)
 		codec = new fmice_codec_mp3(sampRate, channels);
+	else if (strcmp(codecName, "opus") == 0 && channels == 2)
+		codec = new fmice_codec_opus(sampRate, channels, &opus_settings);
+	else if (strcmp(codecName, "opus") == 0) {
+		printf("Opus can only be used for the audio output.\n");
+		return 0;
+	}
 	else {
-		printf("Unknown codec \"%s\". Options are: flac, mp3.\n", codecName);
+		printf("Unknown codec \"%s\". Options are: flac, mp3, opus.\n", codecName);
 		return 0;
 	}
 	return new fmice_icecast(channels, AUDIO_SAMP_RATE, codec);
 }
 
+static fmice_icecast_conn* add_mount(fmice_icecast** icecast, const char** codecName, const char* requested, int channels, int sampRate) {
+	//Create the encoder the first time - After that, every mount shares it and so must use the same codec
+	if (*icecast == 0) {
+		*icecast = create_icecast(requested, channels, sampRate);
+		if (*icecast == 0)
+			return 0;
+		*codecName = requested;
+	}
+	else if (strcmp(*codecName, requested) != 0) {
+		printf("All mounts of an output share one encoder, so they must use the same codec (\"%s\").\n", *codecName);
+		return 0;
+	}
+
+	//Add mount
+	fmice_icecast_conn* mount = (*icecast)->add_mount();
+	if (mount == 0)
+		printf("Too many mounts. Up to %i are supported per output.\n", FMICE_ICECAST_MAX_MOUNTS);
+	return mount;
+}
+
 int parse_args(int argc, char* argv[]) {
 	static const struct option long_opts[] = {
 		{ "ice-mpx", required_argument, NULL, 11 },
@@ -90,6 +197,30 @@ int parse_args(int argc, char* argv[]) {
 		{ "mpx-filter-trans", required_argument, NULL, 36 },
 		{ "aud-filter-cutoff", required_argument, NULL, 37 },
 		{ "aud-filter-trans", required_argument, NULL, 38 },
+		{ "demod-rate", required_argument, NULL, 39 },
+		{ "threads", required_argument, NULL, 40 },
+		{ "pin-cpus", required_argument, NULL, 41 },
+		{ "wideband", required_argument, NULL, 42 },
+		{ "input", required_argument, NULL, 43 },
+		{ "input-format", required_argument, NULL, 44 },
+		{ "input-loop", no_argument, NULL, 45 },
+		{ "input-fast", no_argument, NULL, 46 },
+		{ "ice-backlog", required_argument, NULL, 47 },
+		{ "opus-bitrate", required_argument, NULL, 48 },
+		{ "opus-complexity", required_argument, NULL, 49 },
+		{ "opus-frame", required_argument, NULL, 50 },
+		{ "flac-bits", required_argument, NULL, 51 },
+		{ "flac-level", required_argument, NULL, 52 },
+		{ "flac-blocksize", required_argument, NULL, 53 },
+		{ "flac-threads", required_argument, NULL, 54 },
+		{ "rec-mpx", required_argument, NULL, 55 },
+		{ "rec-aud", required_argument, NULL, 56 },
+		{ "rec-format", required_argument, NULL, 57 },
+		{ "rec-rotate", required_argument, NULL, 58 },
+		{ "rec-rotate-size", required_argument, NULL, 59 },
+		{ "stereo-engine", required_argument, NULL, 60 },
+		{ "kernel-profile", required_argument, NULL, 61 },
+		{ "reprofile", no_argument, NULL, 62 },
 		{ "freq", required_argument, NULL, 'f'},
 		{ "rds", no_argument, NULL, 15 },
 		{ "rds-level", required_argument, NULL, 16 },
@@ -99,13 +230,161 @@ int parse_args(int argc, char* argv[]) {
 	};
 
 	int opt;
-	fmice_icecast* currentOutput = 0;
+	fmice_icecast_conn* currentOutput = 0;
+	fmice_station_t* station = &stations[0];
 	while ((opt = getopt_long(argc, argv, "f:h:o:m:u:p:s", long_opts, NULL)) != -1) {
 		switch (opt) {
 		
 		case 'f':
-			// FREQUENCY
-			frequency = parse_freq(optarg);
+			// FREQUENCY - In wideband mode, each one after the first starts a new station
+			if (wideband_frequency != 0 && station->frequency != 0) {
+				if (station_count == MAX_STATIONS) {
+					printf("Too many stations. Up to %i are supported.\n", MAX_STATIONS);
+					return -1;
+				}
+				station = &stations[station_count++];
+				currentOutput = 0;
+			}
+			station->frequency = parse_freq(optarg);
+			break;
+
+		case 42:
+			// WIDEBAND
+			wideband_frequency = parse_freq(optarg);
+			break;
+
+		case 43:
+			// INPUT FILE
+			input_path = optarg;
+			break;
+
+		case 44:
+			// INPUT FILE FORMAT
+			if (!fmice_device_file::parse_format(optarg, &input_format)) {
+				printf("Unknown input format \"%s\". Options are: cf32, cs16, cu8, wav.\n", optarg);
+				return -1;
+			}
+			input_format_set = true;
+			break;
+
+		case 45:
+			// INPUT LOOP
+			input_loop = true;
+			break;
+
+		case 46:
+			// INPUT FAST
+			input_fast = true;
+			break;
+
+		case 48:
+			// OPUS BITRATE
+			opus_settings.bitrate = atoi(optarg);
+			if (opus_settings.bitrate < 6 || opus_settings.bitrate > 510) {
+				printf("Opus bitrate must be between 6 and 510 kbps.\n");
+				return -1;
+			}
+			break;
+
+		case 49:
+			// OPUS COMPLEXITY
+			opus_settings.complexity = atoi(optarg);
+			if (opus_settings.complexity < 0 || opus_settings.complexity > 10) {
+				printf("Opus complexity must be between 0 and 10.\n");
+				return -1;
+			}
+			break;
+
+		case 50:
+			// OPUS FRAME
+			if (!fmice_codec_opus::parse_frame_size(optarg, &opus_settings.frame_size)) {
+				printf("Invalid Opus frame duration \"%s\". Options are: 2.5, 5, 10, 20, 40, 60.\n", optarg);
+				return -1;
+			}
+			break;
+
+		case 51:
+			// FLAC BITS
+			flac_settings.bits = atoi(optarg);
+			if (flac_settings.bits != 16 && flac_settings.bits != 24) {
+				printf("FLAC bits per sample must be 16 or 24.\n");
+				return -1;
+			}
+			break;
+
+		case 52:
+			// FLAC LEVEL
+			flac_settings.level = atoi(optarg);
+			if (flac_settings.level < 0 || flac_settings.level > 8) {
+				printf("FLAC compression level must be between 0 and 8.\n");
+				return -1;
+			}
+			break;
+
+		case 53:
+			// FLAC BLOCKSIZE
+			flac_settings.blocksize = atoi(optarg);
+			if (flac_settings.blocksize < 16 || flac_settings.blocksize > 65535) {
+				printf("FLAC blocksize must be between 16 and 65535.\n");
+				return -1;
+			}
+			break;
+
+		case 54:
+			// FLAC THREADS
+			flac_settings.threads = atoi(optarg);
+			if (flac_settings.threads < 1 || flac_settings.threads > FMICE_FLAC_MAX_THREADS) {
+				printf("FLAC threads must be between 1 and %i.\n", FMICE_FLAC_MAX_THREADS);
+				return -1;
+			}
+			break;
+
+		case 55:
+			// RECORD MPX
+			station->recorder_mpx_path = optarg;
+			break;
+
+		case 56:
+			// RECORD AUDIO
+			station->recorder_aud_path = optarg;
+			break;
+
+		case 57:
+			// RECORDING FORMAT
+			if (strcmp(optarg, "flac") == 0)
+				recorder_raw = false;
+			else if (strcmp(optarg, "raw") == 0)
+				recorder_raw = true;
+			else {
+				printf("Unknown recording format \"%s\". Options are: flac, raw.\n", optarg);
+				return -1;
+			}
+			break;
+
+		case 58:
+			// RECORDING ROTATION
+			recorder_rotate = atoi(optarg);
+			if (recorder_rotate < 0) {
+				printf("Recording rotation must be 0 or more seconds.\n");
+				return -1;
+			}
+			break;
+
+		case 59:
+			// RECORDING ROTATION SIZE
+			recorder_rotate_size = atoi(optarg);
+			if (recorder_rotate_size < 0) {
+				printf("Recording rotation size must be 0 or more MB.\n");
+				return -1;
+			}
+			break;
+
+		case 60:
+			// STEREO ENGINE
+			if (!fmice_stereo_demod::parse_engine(optarg, &radio_settings.stereo_engine)) {
+				printf("Unknown stereo engine \"%s\". Options are: complex, real.\n", optarg);
+				return -1;
+			}
 			break;
 
 		case 's':
@@ -114,24 +393,29 @@ int parse_args(int argc, char* argv[]) {
 			break;
 
 		case 11:
-			// MPX ICECAST
-			if (icecast_mpx == 0)
-				icecast_mpx = create_icecast(optarg, 1, MPX_SAMP_RATE);
-			if (icecast_mpx == 0)
+			// MPX ICECAST - Repeat to send the same stream to more mounts
+			currentOutput = add_mount(&station->icecast_mpx, &station->icecast_mpx_codec, optarg, 1, MPX_SAMP_RATE);
+			if (currentOutput == 0)
 				return -1;
-			currentOutput = icecast_mpx;
 			break;
 
 		case 12:
-			// AUDIO ICECAST
-			if (icecast_aud == 0)
-				icecast_aud = create_icecast(optarg, 2, AUDIO_SAMP_RATE);
-			if (icecast_aud == 0)
+			// AUDIO ICECAST - Repeat to send the same stream to more mounts
+			currentOutput = add_mount(&station->icecast_aud, &station->icecast_aud_codec, optarg, 2, AUDIO_SAMP_RATE);
+			if (currentOutput == 0)
 				return -1;
-			currentOutput = icecast_aud;
 			break;
 		
 		// BELOW ARE SETTINGS FOR ICECAST - Intended to be grouped together
+		case 47:
+			if (currentOutput != 0) {
+				if (atoi(optarg) <= 0) {
+					printf("Icecast backlog must be 1 or more seconds.\n");
+					return -1;
+				}
+				currentOutput->set_backlog(atoi(optarg));
+				break;
+			}
 		case 'h':
 			if (currentOutput != 0) {
 				currentOutput->set_host(optarg);
@@ -202,6 +486,35 @@ int parse_args(int argc, char* argv[]) {
 			radio_settings.aud_filter_trans = atoi(optarg);
 			break;
 
+		case 39:
+			// DEMOD SAMPLE RATE
+			radio_settings.demod_samp_rate = atoi(optarg);
+			break;
+
+		case 40:
+			// THREADS
+			radio_settings.threads = atoi(optarg);
+			break;
+
+		case 41:
+			// PIN CPUS
+			radio_settings.pin_cpu_count = parse_cpu_list(optarg, radio_settings.pin_cpus, FMICE_RADIO_MAX_THREADS);
+			if (radio_settings.pin_cpu_count < 0) {
+				printf("Invalid CPU list \"%s\".\n", optarg);
+				return -1;
+			}
+			break;
+
+		case 61:
+			// KERNEL PROFILE
+			kernel_profile_dir = optarg;
+			break;
+
+		case 62:
+			// REPROFILE
+			kernel_reprofile = true;
+			break;
+
 		case 15:
 			// RDS ENABLE
 			radio_settings.rds_enable = true;
@@ -214,7 +527,7 @@ int parse_args(int argc, char* argv[]) {
 
 		case 17:
 			// RDS BUFFER
-			radio_settings.rds_max_skew = atoi(optarg);
+			radio_settings.rds_max_skew = atof(optarg);
 			break;
 
 		case 18:
@@ -236,27 +549,68 @@ int parse_args(int argc, char* argv[]) {
 /// </summary>
 /// <returns></returns>
 int check_args() {
-	//Check freq
-	if (frequency < 76000000 || frequency > 108000000) {
-		printf("Frequency (%i) isn't set correctly. Specify -f with 78.0-108.0.\n", frequency);
+	//Check the center frequency
+	if (wideband_frequency != 0 && (wideband_frequency < 76000000 || wideband_frequency > 108000000)) {
+		printf("Wideband frequency (%i) isn't set correctly. Specify --wideband with 78.0-108.0.\n", wideband_frequency);
 		return -1;
 	}
 
-	//Check if the MPX icecast is set and OK
-	if (icecast_mpx != 0 && !icecast_mpx->is_configured()) {
-		printf("MPX Icecast isn't fully configured. Set all options or remove it.\n");
+	//Check each station
+	for (int i = 0; i < station_count; i++) {
+		fmice_station_t* station = &stations[i];
+
+		//Check freq - A single station played back from a file doesn't need one
+		if ((input_path == 0 || wideband_frequency != 0) && (station->frequency < 76000000 || station->frequency > 108000000)) {
+			printf("Frequency (%i) isn't set correctly. Specify -f with 78.0-108.0.\n", station->frequency);
+			return -1;
+		}
+
+		//Check that the station fits within the device bandwidth
+		if (wideband_frequency != 0 && abs(station->frequency - wideband_frequency) + radio_settings.bb_filter_cutoff + (radio_settings.bb_filter_trans / 2) > WIDEBAND_SAMP_RATE / 2) {
+			printf("Frequency (%i) is too far from the wideband center frequency (%i).\n", station->frequency, wideband_frequency);
+			return -1;
+		}
+
+		//Check if the MPX icecast is set and OK
+		if (station->icecast_mpx != 0 && !station->icecast_mpx->is_configured()) {
+			printf("MPX Icecast isn't fully configured. Set all options or remove it.\n");
+			return -1;
+		}
+
+		//Check if the audio icecast is set and OK
+		if (station->icecast_aud != 0 && !station->icecast_aud->is_configured()) {
+			printf("Audio Icecast isn't fully configured. Set all options or remove it.\n");
+			return -1;
+		}
+
+		//Check that there's somewhere to send the MPX or audio
+		if (station->icecast_mpx == 0 && station->icecast_aud == 0 && station->recorder_mpx_path == 0 && station->recorder_aud_path == 0) {
+			printf("Neither audio or MPX Icecast output or recording is set.\n");
+			return -1;
+		}
+	}
+
+	//Pinning is per radio, so it can't be shared between stations
+	if (station_count > 1 && radio_settings.pin_cpu_count > 0) {
+		printf("CPU pinning is only supported with a single station.\n");
 		return -1;
 	}
 
-	//Check if the audio icecast is set and OK
-	if (icecast_aud != 0 && !icecast_aud->is_configured()) {
-		printf("Audio Icecast isn't fully configured. Set all options or remove it.\n");
+	//Check that the demodulator rate can be reached from the device and decimated to the composite rate
+	if (radio_settings.demod_samp_rate <= 0 || radio_settings.demod_samp_rate > SAMP_RATE || (radio_settings.demod_samp_rate % MPX_SAMP_RATE) != 0) {
+		printf("Demodulator rate (%i) must be a multiple of %i and no more than %i.\n", radio_settings.demod_samp_rate, MPX_SAMP_RATE, SAMP_RATE);
 		return -1;
 	}
 
-	//Check that either the MPX or audio icecast is set
-	if (icecast_mpx == 0 && icecast_aud == 0) {
-		printf("Neither audio or MPX Icecast output is set.\n");
+	//Check that the baseband filter fits within the demodulator rate
+	if (radio_settings.bb_filter_cutoff * 2 > radio_settings.demod_samp_rate) {
+		printf("Baseband filter cutoff (%i) is too wide for the demodulator rate (%i).\n", (int)radio_settings.bb_filter_cutoff, radio_settings.demod_samp_rate);
+		return -1;
+	}
+
+	//Check thread count
+	if (radio_settings.threads < 1 || radio_settings.threads > FMICE_RADIO_MAX_THREADS) {
+		printf("Thread count must be between 1 and %i.\n", FMICE_RADIO_MAX_THREADS);
 		return -1;
 	}
 
@@ -269,10 +623,80 @@ int check_args() {
 	return 0;
 }
 
+/// <summary>
+/// Creates a recorder for a stream with the recording settings.
+/// </summary>
+static fmice_recorder* create_recorder(const char* path, int channels, int sampRate) {
+	fmice_recorder* recorder;
+	if (recorder_raw)
+		recorder = new fmice_recorder(channels, sampRate, NULL, "f32");
+	else
+		recorder = new fmice_recorder(channels, sampRate, new fmice_codec_flac(sampRate, channels, &flac_settings), "oga");
+	recorder->set_path(path);
+	recorder->set_rotate_interval(recorder_rotate);
+	recorder->set_rotate_size((int64_t)recorder_rotate_size * 1024 * 1024);
+	recorder->set_realtime(!input_fast);
+	return recorder;
+}
+
+/// <summary>
+/// Initializes an output and returns it, or NULL on failure.
+/// </summary>
+static fmice_output* init_output(fmice_output* output, const char* name) {
+	try {
+		output->init();
+	}
+	catch (std::runtime_error* ex) {
+		printf("Error: Failed to initialize %s: %s\n", name, ex->what());
+		return 0;
+	}
+	return output;
+}
+
+/// <summary>
+/// Initializes the Icecast and recording outputs of a station and attaches them to its radio. Returns 0 if OK, otherwise -1.
+/// </summary>
+/// <returns></returns>
+int init_outputs(fmice_station_t* station) {
+	if (station->icecast_aud != 0) {
+		if (!init_output(station->icecast_aud, "audio icecast"))
+			return -1;
+		station->radio->add_audio_output(station->icecast_aud);
+	}
+	if (station->icecast_mpx != 0) {
+		if (!init_output(station->icecast_mpx, "composite icecast"))
+			return -1;
+		station->radio->add_mpx_output(station->icecast_mpx);
+	}
+	if (station->recorder_aud_path != 0) {
+		fmice_output* recorder = init_output(create_recorder(station->recorder_aud_path, 2, AUDIO_SAMP_RATE), "audio recording");
+		if (!recorder)
+			return -1;
+		station->radio->add_audio_output(recorder);
+	}
+	if (station->recorder_mpx_path != 0) {
+		fmice_output* recorder = init_output(create_recorder(station->recorder_mpx_path, 1, MPX_SAMP_RATE), "composite recording");
+		if (!recorder)
+			return -1;
+		station->radio->add_mpx_output(recorder);
+	}
+	return 0;
+}
+
+void* station_work(void* ctx) {
+	fmice_station_t* station = (fmice_station_t*)ctx;
+	while (station->radio->work());
+	station->radio->stop_outputs();
+	return 0;
+}
+
 int main(int argc, char* argv[]) {
 	//Configure settings with reasonable defaults
 	radio_settings.enable_status = false;
+	radio_settings.input_samp_rate = SAMP_RATE;
+	radio_settings.demod_samp_rate = DEFAULT_DEMOD_SAMP_RATE;
 	radio_settings.deemphasis_rate = DEFAULT_DEEMPHASIS_RATE;
+	radio_settings.stereo_engine = FMICE_STEREO_ENGINE_COMPLEX;
 	radio_settings.fm_deviation = DEFAULT_FM_DEVIATION;
 	radio_settings.bb_filter_cutoff = DEFAULT_BB_FILTER_CUTOFF;
 	radio_settings.bb_filter_trans = DEFAULT_BB_FILTER_TRANS;
@@ -284,7 +708,16 @@ int main(int argc, char* argv[]) {
 	radio_settings.rds_level = DEFAULT_RDS_LEVEL;
 	radio_settings.rds_max_skew = DEFAULT_RDS_BUFFER;
 	radio_settings.stereo_generator_enable = false;
+	flac_settings.bits = FMICE_FLAC_DEFAULT_BITS;
+	flac_settings.level = FMICE_FLAC_DEFAULT_LEVEL;
+	flac_settings.blocksize = FMICE_FLAC_DEFAULT_BLOCKSIZE;
+	flac_settings.threads = FMICE_FLAC_DEFAULT_THREADS;
+	opus_settings.bitrate = FMICE_OPUS_DEFAULT_BITRATE;
+	opus_settings.complexity = FMICE_OPUS_DEFAULT_COMPLEXITY;
+	opus_settings.frame_size = FMICE_OPUS_DEFAULT_FRAME_SIZE;
 	radio_settings.stereo_generator_level = DEFAULT_STEREO_PILOT_LEVEL;
+	radio_settings.threads = 1;
+	radio_settings.pin_cpu_count = 0;
 
 	//Parse command line args
 	if (parse_args(argc, argv))
@@ -294,44 +727,94 @@ int main(int argc, char* argv[]) {
 	if (check_args())
 		return -1;
 
-	//Open radio
-	printf("Opening AirSpy HF+ Device (on %i kHz)...\n", frequency / 1000);
-	fmice_device_airspyhf airspy(SAMP_RATE);
-	airspy.open(frequency);
-
-	//Set up radio
-	fmice_radio radio(&airspy, radio_settings);
+	//Pick the fastest kernels for this CPU - This must happen before anything calls into VOLK
+	char kernelDir[512];
+	if (kernel_profile_dir == 0 && getenv("HOME") != 0) {
+		snprintf(kernelDir, sizeof(kernelDir), "%s/.fmice", getenv("HOME"));
+		kernel_profile_dir = kernelDir;
+	}
+	if (kernel_profile_dir != 0 && strcmp(kernel_profile_dir, "none") != 0) {
+		fmice_kernel_profile kernels;
+		if (kernels.apply(kernel_profile_dir, kernel_reprofile))
+			kernels.print();
+	}
 
-	//Initialize icecast and attach
-	if (icecast_aud != 0) {
+	//Open radio
+	fmice_device* device;
+	fmice_channelizer* channelizer = 0;
+	int deviceSampRate = (wideband_frequency != 0) ? WIDEBAND_SAMP_RATE : SAMP_RATE;
+	int deviceFrequency = (wideband_frequency != 0) ? wideband_frequency : stations[0].frequency;
+	if (input_path != 0) {
+		//Pick the format from the extension if it wasn't given
+		size_t pathLen = strlen(input_path);
+		if (!input_format_set && pathLen > 4 && strcasecmp(input_path + pathLen - 4, ".wav") == 0)
+			input_format = FMICE_FILE_FORMAT_WAV;
+
+		//Open
+		printf("Opening IQ file \"%s\"...\n", input_path);
+		fmice_device_file* file = new fmice_device_file(deviceSampRate);
 		try {
-			icecast_aud->init();
+			file->open(input_path, input_format, input_loop, !input_fast);
 		}
-		catch (std::runtime_error* ex) {
-			printf("Error: Failed to initialize audio icecast: %s\n", ex->what());
+		catch (std::runtime_error& ex) {
+			printf("Error: Failed to open IQ file: %s\n", ex.what());
 			return -1;
 		}
-		radio.set_audio_output(icecast_aud);
+		device = file;
 	}
-	if (icecast_mpx != 0) {
-		try {
-			icecast_mpx->init();
+	else {
+		printf("Opening AirSpy HF+ Device (on %i kHz)...\n", deviceFrequency / 1000);
+		fmice_device_airspyhf* airspy = new fmice_device_airspyhf(deviceSampRate);
+		airspy->open(deviceFrequency);
+		device = airspy;
+	}
+	if (wideband_frequency != 0)
+		channelizer = new fmice_channelizer(device, WIDEBAND_SAMP_RATE);
+
+	//Set up each station
+	for (int i = 0; i < station_count; i++) {
+		//Get the source - A channel of the wideband device, which does the baseband filtering and comes out at the demod rate, or the device itself
+		fmice_device* source = device;
+		fmice_radio_settings_t settings = radio_settings;
+		if (channelizer != 0) {
+			source = channelizer->add_channel(stations[i].frequency - wideband_frequency, radio_settings.demod_samp_rate, radio_settings.bb_filter_cutoff, radio_settings.bb_filter_trans);
+			settings.input_samp_rate = radio_settings.demod_samp_rate;
 		}
-		catch (std::runtime_error* ex) {
-			printf("Error: Failed to initialize composite icecast: %s\n", ex->what());
-			return -1;
+
+		//Set up radio and outputs - Name each station after its frequency so their status lines can be told apart
+		stations[i].radio = new fmice_radio(source, settings);
+		if (channelizer != 0) {
+			char name[32];
+			snprintf(name, sizeof(name), "%.1fMHz", stations[i].frequency / 1000000.0);
+			stations[i].radio->set_name(name);
 		}
-		radio.set_mpx_output(icecast_mpx);
+		if (init_outputs(&stations[i]))
+			return -1;
 	}
 
 	//Start the radio
 	printf("Starting radio...\n");
-	airspy.start();
+	if (channelizer != 0)
+		channelizer->start();
+	else
+		device->start();
 
-	//Loop
+	//Loop - A single station runs right here, otherwise each gets its own thread
 	printf("Running...\n");
-	while (1)
-		radio.work();
+	if (station_count == 1) {
+		while (stations[0].radio->work());
+		stations[0].radio->stop_outputs();
+		printf("Exiting...\n");
+		return 0;
+	}
+	for (int i = 0; i < station_count; i++) {
+		if (pthread_create(&stations[i].thread, NULL, station_work, &stations[i]) != 0) {
+			printf("Error: Failed to create station thread.\n");
+			return -1;
+		}
+	}
+	for (int i = 0; i < station_count; i++)
+		pthread_join(stations[i].thread, NULL);
 
 	//Done
 	printf("Exiting...\n");
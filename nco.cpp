@@ -0,0 +1,103 @@
+#include "nco.h"
+#include "util.h"
+
+#include <string.h>
+#include <math.h>
+#include <cassert>
+#include <stdexcept>
+#include <algorithm>
+
+fmice_nco_bank::fmice_nco_bank(int bufferSize, int frequency, int sampleRate, int harmonics) :
+	buffer_size(bufferSize),
+	harmonics(harmonics),
+	period(0),
+	position(0),
+	ones(0),
+	scratch(0),
+	scratch_cos(0)
+{
+	//Sanity check
+	assert(harmonics >= 1 && harmonics <= FMICE_NCO_MAX_HARMONICS);
+
+	//Allocate outputs
+	size_t alignment = volk_get_alignment();
+	for (int h = 0; h < harmonics; h++) {
+		output[h] = (float*)volk_malloc(sizeof(float) * bufferSize, alignment);
+		table[h] = 0;
+		if (output[h] == 0)
+			throw std::runtime_error("Failed to allocate NCO buffers.");
+	}
+
+	//The waveform repeats every sampleRate / gcd samples
+	int repeat = sampleRate / fmice_gcd(sampleRate, frequency);
+	if (repeat <= FMICE_NCO_MAX_TABLE) {
+		//Build a table of one period per harmonic, computed in double so it's exact to float precision
+		period = repeat;
+		for (int h = 0; h < harmonics; h++) {
+			table[h] = (float*)volk_malloc(sizeof(float) * period, alignment);
+			if (table[h] == 0)
+				throw std::runtime_error("Failed to allocate NCO table.");
+			for (int i = 0; i < period; i++)
+				table[h][i] = (float)sin(2 * M_PI * (double)(h + 1) * frequency * i / sampleRate);
+		}
+	}
+	else {
+		//Set up a rotator per harmonic
+		ones = (lv_32fc_t*)volk_malloc(sizeof(lv_32fc_t) * bufferSize, alignment);
+		scratch = (lv_32fc_t*)volk_malloc(sizeof(lv_32fc_t) * bufferSize, alignment);
+		scratch_cos = (float*)volk_malloc(sizeof(float) * bufferSize, alignment);
+		if (ones == 0 || scratch == 0 || scratch_cos == 0)
+			throw std::runtime_error("Failed to allocate NCO buffers.");
+		for (int i = 0; i < bufferSize; i++)
+			ones[i] = lv_32fc_t(1, 0);
+		for (int h = 0; h < harmonics; h++) {
+			double inc = 2 * M_PI * (double)(h + 1) * frequency / sampleRate;
+			rotator_phase[h] = lv_32fc_t(1, 0);
+			rotator_inc[h] = lv_32fc_t((float)cos(inc), (float)sin(inc));
+		}
+	}
+}
+
+fmice_nco_bank::~fmice_nco_bank() {
+	for (int h = 0; h < harmonics; h++) {
+		volk_free(output[h]);
+		if (table[h] != 0)
+			volk_free(table[h]);
+	}
+	if (ones != 0) {
+		volk_free(ones);
+		volk_free(scratch);
+		volk_free(scratch_cos);
+	}
+}
+
+void fmice_nco_bank::process(int count) {
+	//Sanity check
+	assert(count <= buffer_size);
+
+	if (period != 0) {
+		//Copy out of the tables, a period at a time
+		int offset = 0;
+		int pos = position;
+		while (offset < count) {
+			int n = std::min(count - offset, period - pos);
+			for (int h = 0; h < harmonics; h++)
+				memcpy(&output[h][offset], &table[h][pos], sizeof(float) * n);
+			offset += n;
+			pos = (pos + n) % period;
+		}
+		position = pos;
+	}
+	else {
+		//Spin each rotator and keep the imaginary (sine) part
+		for (int h = 0; h < harmonics; h++) {
+			volk_32fc_s32fc_x2_rotator_32fc(scratch, ones, rotator_inc[h], &rotator_phase[h], count);
+			volk_32fc_deinterleave_32f_x2(scratch_cos, output[h], scratch, count);
+		}
+	}
+}
+
+const float* fmice_nco_bank::get(int harmonic) {
+	assert(harmonic >= 1 && harmonic <= harmonics);
+	return output[harmonic - 1];
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <volk/volk.h>
+
+#define FMICE_NCO_MAX_HARMONICS 3
+#define FMICE_NCO_MAX_TABLE 8192 // Longest period that gets a table, in samples
+
+/// <summary>
+/// Phase-coherent sine oscillators at a frequency and its harmonics (for example the 19 kHz pilot, 38 kHz stereo and 57 kHz RDS carriers).
+/// When the frequency divides the sample rate into a short period, a block is just copied out of a table built once, so there is no drift and no
+/// per-sample trig. Otherwise a VOLK rotator per harmonic is used, which renormalizes itself but may let the harmonics drift apart very slowly.
+/// </summary>
+class fmice_nco_bank {
+
+public:
+	/// <summary>
+	/// Creates the bank.
+	/// </summary>
+	/// <param name="bufferSize">Maximum samples per process call.</param>
+	/// <param name="frequency">Fundamental frequency in Hz.</param>
+	/// <param name="sampleRate">Sample rate in Hz.</param>
+	/// <param name="harmonics">Number of harmonics to generate, starting with the fundamental.</param>
+	fmice_nco_bank(int bufferSize, int frequency, int sampleRate, int harmonics);
+	~fmice_nco_bank();
+
+	/// <summary>
+	/// Generates the next count samples of every harmonic.
+	/// </summary>
+	void process(int count);
+
+	/// <summary>
+	/// Gets the samples of a harmonic from the last process call, sin(n * phase). Harmonic 1 is the fundamental.
+	/// </summary>
+	const float* get(int harmonic);
+
+private:
+	int buffer_size;
+	int harmonics;
+	float* output[FMICE_NCO_MAX_HARMONICS];
+
+	// Table mode
+	int period; // Samples per period, or 0 if using rotators
+	int position;
+	float* table[FMICE_NCO_MAX_HARMONICS];
+
+	// Rotator mode
+	lv_32fc_t* ones;
+	lv_32fc_t* scratch;
+	float* scratch_cos;
+	lv_32fc_t rotator_phase[FMICE_NCO_MAX_HARMONICS];
+	lv_32fc_t rotator_inc[FMICE_NCO_MAX_HARMONICS];
+
+};
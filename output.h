@@ -0,0 +1,46 @@
+#pragma once
+
+#include <dsp/types.h>
+
+/// <summary>
+/// Somewhere the radio sends composite or audio, such as an Icecast stream or a recording.
+/// </summary>
+class fmice_output {
+
+public:
+	virtual ~fmice_output() {}
+
+	/// <summary>
+	/// Starts the output. Called once, before anything is pushed.
+	/// </summary>
+	virtual void init() = 0;
+
+	/// <summary>
+	/// Pushes data into the output. Must never block, unless the output was told its input isn't real time. Called from the radio thread.
+	/// </summary>
+	/// <param name="samples">Interleaved samples in -1 to 1 format.</param>
+	/// <param name="count">Number of samples total across all channels.</param>
+	virtual void push(float* samples, int count) = 0;
+
+	/// <summary>
+	/// Pushes stereo data into the output. Called from the radio thread.
+	/// </summary>
+	void push(dsp::stereo_t* samples, int count) {
+		// Double up and use the regular float push.
+		push((float*)samples, count * 2);
+	}
+
+	/// <summary>
+	/// Writes a short status for the status line, ending with "; ". Thread safe.
+	/// </summary>
+	/// <param name="output">Buffer to write to. Up to 1 kB is written.</param>
+	/// <param name="name">Which stream this is, such as "mpx" or "aud".</param>
+	/// <returns>Number of characters written.</returns>
+	virtual int format_status(char* output, const char* name) = 0;
+
+	/// <summary>
+	/// Processes everything pushed so far, ends the stream and stops the output's threads. Called once, after the last push.
+	/// </summary>
+	virtual void stop() = 0;
+
+};
@@ -0,0 +1,117 @@
+#include "pilot_pll.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <cassert>
+#include <algorithm>
+#include <volk/volk.h>
+#include <dsp/taps/low_pass.h>
+
+fmice_pilot_pll::fmice_pilot_pll(int bufferSize) :
+	buffer_size(bufferSize),
+	sample_rate(0),
+	taps(0),
+	tap_count(0),
+	history(0),
+	offset(0),
+	freq(0),
+	freq_min(0),
+	freq_max(0),
+	alpha(0),
+	beta(0)
+{
+	phasor.re = 1;
+	phasor.im = 0;
+	step = phasor;
+}
+
+fmice_pilot_pll::~fmice_pilot_pll() {
+	//Free buffers
+	volk_free(taps);
+	volk_free(history);
+}
+
+void fmice_pilot_pll::init(int sampleRate) {
+	//Free old buffers if re-initialized
+	volk_free(taps);
+	volk_free(history);
+	sample_rate = sampleRate;
+
+	//Design the filter, keeping a copy of the taps
+	dsp::tap<float> design = dsp::taps::lowPass(FMICE_PILOT_PLL_FILTER_CUTOFF, FMICE_PILOT_PLL_FILTER_TRANS, sampleRate);
+	printf("Stereo Pilot PLL taps: %i (%i per loop update)\n", design.size, FMICE_PILOT_PLL_DECIM);
+	tap_count = design.size;
+	taps = (float*)volk_malloc(sizeof(float) * tap_count, volk_get_alignment());
+	assert(taps != NULL);
+	memcpy(taps, design.taps, sizeof(float) * tap_count);
+	dsp::taps::free(design);
+
+	//Allocate the history
+	history = (dsp::complex_t*)volk_malloc(sizeof(dsp::complex_t) * (tap_count - 1 + buffer_size), volk_get_alignment());
+	assert(history != NULL);
+	memset(history, 0, sizeof(dsp::complex_t) * (tap_count - 1));
+	offset = 0;
+
+	//Compute loop gains for a critically damped second order loop at the update rate
+	double damping = sqrt(2.0) / 2;
+	double bw = FMICE_PILOT_PLL_BANDWIDTH / ((double)sampleRate / FMICE_PILOT_PLL_DECIM);
+	double theta = bw / (damping + (1 / (4 * damping)));
+	double denom = 1 + (2 * damping * theta) + (theta * theta);
+	alpha = (float)((4 * damping * theta) / denom);
+	beta = (float)((4 * theta * theta) / denom);
+
+	//Reset the oscillator to 19 kHz
+	freq = (float)dsp::math::hzToRads(19000.0, sampleRate);
+	freq_min = (float)dsp::math::hzToRads(FMICE_PILOT_PLL_MIN_FREQ, sampleRate);
+	freq_max = (float)dsp::math::hzToRads(FMICE_PILOT_PLL_MAX_FREQ, sampleRate);
+	phasor.re = 1;
+	phasor.im = 0;
+	step.re = cosf(freq);
+	step.im = sinf(freq);
+}
+
+float fmice_pilot_pll::get_frequency() {
+	return freq * sample_rate / (float)(2 * M_PI);
+}
+
+void fmice_pilot_pll::process(const float* mpx, float* lmr, int count) {
+	//Sanity check
+	assert(count <= buffer_size);
+
+	dsp::complex_t* block = &history[tap_count - 1];
+	for (int i = 0; i < count; i++) {
+		//Mix down against the oscillator, and L-R against twice its phase - 2 * sin(2 * phase) = 4 * sin(phase) * cos(phase)
+		float x = mpx[i];
+		block[i].re = x * phasor.re;
+		block[i].im = -x * phasor.im;
+		lmr[i] = 4 * x * phasor.re * phasor.im;
+
+		//Advance
+		phasor = phasor * step;
+
+		//Update the loop from the filtered mix
+		if (i == offset) {
+			//Filter - The pilot's sine mixes down to -j/2 * e^(j * error), so rotate that back before taking the angle
+			dsp::complex_t sum;
+			volk_32fc_32f_dot_prod_32fc((lv_32fc_t*)&sum, (lv_32fc_t*)&history[i], taps, tap_count);
+			float error = atan2f(sum.re, -sum.im);
+
+			//Steer frequency
+			freq = std::clamp(freq + (beta * error / FMICE_PILOT_PLL_DECIM), freq_min, freq_max);
+			step.re = cosf(freq);
+			step.im = sinf(freq);
+
+			//Steer phase, renormalizing the oscillator while at it
+			dsp::complex_t correction = { cosf(alpha * error), sinf(alpha * error) };
+			phasor = phasor * correction;
+			phasor = phasor * (1.0f / phasor.amplitude());
+
+			offset += FMICE_PILOT_PLL_DECIM;
+		}
+	}
+	offset -= count;
+
+	//Keep the end for the next block
+	memmove(history, &history[count], sizeof(dsp::complex_t) * (tap_count - 1));
+}
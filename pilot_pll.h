@@ -0,0 +1,55 @@
+#pragma once
+
+#include <dsp/types.h>
+
+#define FMICE_PILOT_PLL_DECIM 32 // MPX samples per loop update
+#define FMICE_PILOT_PLL_FILTER_CUTOFF 1000.0 // Low-pass on the mixed down pilot - The nearest other signals are 4 kHz away
+#define FMICE_PILOT_PLL_FILTER_TRANS 2000.0
+#define FMICE_PILOT_PLL_BANDWIDTH 20.0 // Loop bandwidth in Hz
+#define FMICE_PILOT_PLL_MIN_FREQ 18750.0
+#define FMICE_PILOT_PLL_MAX_FREQ 19250.0
+
+/// <summary>
+/// Pilot PLL and L-R demodulator working on the real MPX. The composite is mixed against the oscillator and low-passed, with only every
+/// FMICE_PILOT_PLL_DECIM-th output computed, so the loop runs at a fraction of the MPX rate. The 38 kHz reference comes from doubling the
+/// oscillator phase, so L-R is a real multiply with no delay line, since the oscillator tracks the current sample rather than a filtered one.
+/// </summary>
+class fmice_pilot_pll {
+
+public:
+	fmice_pilot_pll(int bufferSize);
+	~fmice_pilot_pll();
+
+	/// <summary>
+	/// Designs the loop filter and resets the loop to 19 kHz.
+	/// </summary>
+	void init(int sampleRate);
+
+	/// <summary>
+	/// Tracks the pilot through count MPX samples, writing L-R mixed down to baseband to lmr.
+	/// </summary>
+	void process(const float* mpx, float* lmr, int count);
+
+	/// <summary>
+	/// Gets the current pilot frequency estimate in Hz.
+	/// </summary>
+	float get_frequency();
+
+private:
+	int buffer_size;
+	int sample_rate;
+
+	float* taps;
+	int tap_count;
+	dsp::complex_t* history; // Last tap_count - 1 mixed samples followed by the current block
+	int offset; // Input index of the next loop update, carried across blocks
+
+	dsp::complex_t phasor; // Oscillator, e^(j * phase) with the phase of the pilot's sine
+	dsp::complex_t step; // Advance per sample, e^(j * freq)
+	float freq; // Radians per sample
+	float freq_min;
+	float freq_max;
+	float alpha; // Phase gain per loop update
+	float beta; // Frequency gain per loop update
+
+};
@@ -0,0 +1,156 @@
+#include "profiler.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <cassert>
+
+static const char* PROFILER_STAGE_NAMES[FMICE_PROFILER_STAGE_COUNT] = {
+	"wait",
+	"filter_bb",
+	"demod",
+	"rds_decode",
+	"filter_mpx",
+	"stereo_decode",
+	"stereo_encode",
+	"rds_encode",
+	"out_aud",
+	"out_mpx"
+};
+
+fmice_profiler::fmice_profiler() {
+	init(PROFILER_STAGE_NAMES, FMICE_PROFILER_STAGE_COUNT);
+}
+
+fmice_profiler::fmice_profiler(const char* const* names, int count) {
+	init(names, count);
+}
+
+void fmice_profiler::init(const char* const* names, int count) {
+	assert(count > 0 && count <= FMICE_PROFILER_MAX_STAGES);
+	this->names = names;
+	stage_count = count;
+	for (int i = 0; i < count; i++) {
+		stage_t* stage = &stages[i];
+		stage->rate = 0;
+		stage->ns.store(0, std::memory_order_relaxed);
+		stage->samples.store(0, std::memory_order_relaxed);
+		stage->last_ns = 0;
+		stage->last_samples = 0;
+		for (int b = 0; b < FMICE_PROFILER_BUCKETS; b++) {
+			stage->buckets[b].store(0, std::memory_order_relaxed);
+			stage->last_buckets[b] = 0;
+		}
+	}
+}
+
+void fmice_profiler::set_rate(int stage, int sampleRate) {
+	assert(stage >= 0 && stage < stage_count);
+	stages[stage].rate = sampleRate;
+}
+
+int fmice_profiler::bucket_of(uint64_t ns) {
+	//Small times go in their own buckets
+	if (ns < FMICE_PROFILER_SUB_BUCKETS)
+		return (int)ns;
+
+	//Otherwise use the top bit for the doubling and the two after it for the sub bucket
+	int top = 63 - __builtin_clzll(ns);
+	int bucket = ((top - 1) * FMICE_PROFILER_SUB_BUCKETS) + (int)((ns >> (top - 2)) & (FMICE_PROFILER_SUB_BUCKETS - 1));
+	return bucket < FMICE_PROFILER_BUCKETS ? bucket : FMICE_PROFILER_BUCKETS - 1;
+}
+
+uint64_t fmice_profiler::bucket_max(int bucket) {
+	if (bucket < FMICE_PROFILER_SUB_BUCKETS)
+		return bucket;
+	int top = (bucket / FMICE_PROFILER_SUB_BUCKETS) + 1;
+	uint64_t sub = bucket % FMICE_PROFILER_SUB_BUCKETS;
+	return ((FMICE_PROFILER_SUB_BUCKETS + sub + 1) << (top - 2)) - 1;
+}
+
+int fmice_profiler::bucket_at(const uint32_t* counts, uint64_t blocks, double fraction) {
+	uint64_t target = blocks - (uint64_t)(blocks * (1 - fraction));
+	uint64_t seen = 0;
+	int bucket = 0;
+	while (bucket < FMICE_PROFILER_BUCKETS - 1 && (seen += counts[bucket]) < target)
+		bucket++;
+	return bucket;
+}
+
+void fmice_profiler::add(int stage, uint64_t start, int samples) {
+	uint64_t elapsed = fmice_now_ns() - start;
+	stage_t* s = &stages[stage];
+	s->ns.fetch_add(elapsed, std::memory_order_relaxed);
+	s->samples.fetch_add(samples, std::memory_order_relaxed);
+	s->buckets[bucket_of(elapsed)].fetch_add(1, std::memory_order_relaxed);
+}
+
+const char* fmice_profiler::get_name(int stage) {
+	assert(stage >= 0 && stage < stage_count);
+	return names[stage];
+}
+
+uint64_t fmice_profiler::get_total_ns(int stage) {
+	assert(stage >= 0 && stage < stage_count);
+	return stages[stage].ns.load(std::memory_order_relaxed);
+}
+
+uint64_t fmice_profiler::get_total_samples(int stage) {
+	assert(stage >= 0 && stage < stage_count);
+	return stages[stage].samples.load(std::memory_order_relaxed);
+}
+
+uint64_t fmice_profiler::get_percentile(int stage, double fraction) {
+	assert(stage >= 0 && stage < stage_count);
+	uint32_t counts[FMICE_PROFILER_BUCKETS];
+	uint64_t blocks = 0;
+	for (int b = 0; b < FMICE_PROFILER_BUCKETS; b++) {
+		counts[b] = stages[stage].buckets[b].load(std::memory_order_relaxed);
+		blocks += counts[b];
+	}
+	if (blocks == 0)
+		return 0;
+	return bucket_max(bucket_at(counts, blocks, fraction));
+}
+
+int fmice_profiler::format_status(char* output) {
+	int len = sprintf(output, "stages=[");
+	for (int i = 0; i < stage_count; i++) {
+		stage_t* stage = &stages[i];
+
+		//Get what was added since last time
+		uint64_t ns = stage->ns.load(std::memory_order_relaxed);
+		uint64_t samples = stage->samples.load(std::memory_order_relaxed);
+		uint64_t intervalNs = ns - stage->last_ns;
+		uint64_t intervalSamples = samples - stage->last_samples;
+		stage->last_ns = ns;
+		stage->last_samples = samples;
+		uint32_t counts[FMICE_PROFILER_BUCKETS];
+		uint64_t blocks = 0;
+		for (int b = 0; b < FMICE_PROFILER_BUCKETS; b++) {
+			uint32_t total = stage->buckets[b].load(std::memory_order_relaxed);
+			counts[b] = total - stage->last_buckets[b];
+			stage->last_buckets[b] = total;
+			blocks += counts[b];
+		}
+
+		//Skip stages that didn't run
+		if (blocks == 0 || intervalNs == 0 || stage->rate == 0)
+			continue;
+
+		//Find the 99th percentile from the histogram
+		int p99 = bucket_at(counts, blocks, 0.99);
+
+		//Format - The real-time factor is how many seconds of signal are processed per second spent
+		double rtf = ((double)intervalSamples / stage->rate) / (intervalNs / 1000000000.0);
+		len += sprintf(&output[len], "%s=%.1fx/%.2fms; ", names[i], rtf, bucket_max(p99) / 1000000.0);
+	}
+
+	//End the group, replacing the trailing separator, or leave it out if nothing ran
+	if (output[len - 1] != ' ') {
+		output[0] = 0;
+		return 0;
+	}
+	len -= 2;
+	len += sprintf(&output[len], "]; ");
+	return len;
+}
@@ -0,0 +1,123 @@
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+
+#define FMICE_PROFILER_STAGE_WAIT 0 // Waiting on the device for a block
+#define FMICE_PROFILER_STAGE_FILTER_BB 1
+#define FMICE_PROFILER_STAGE_DEMOD 2
+#define FMICE_PROFILER_STAGE_RDS_DECODE 3
+#define FMICE_PROFILER_STAGE_FILTER_MPX 4
+#define FMICE_PROFILER_STAGE_STEREO_DECODE 5
+#define FMICE_PROFILER_STAGE_STEREO_ENCODE 6
+#define FMICE_PROFILER_STAGE_RDS_ENCODE 7
+#define FMICE_PROFILER_STAGE_OUTPUT_AUD 8
+#define FMICE_PROFILER_STAGE_OUTPUT_MPX 9
+#define FMICE_PROFILER_STAGE_COUNT 10
+#define FMICE_PROFILER_MAX_STAGES 16 // Most stages a profiler given its own names can have
+
+#define FMICE_PROFILER_SUB_BUCKETS 4 // Histogram buckets per doubling of time, so percentiles are within 25%
+#define FMICE_PROFILER_BUCKETS (FMICE_PROFILER_SUB_BUCKETS * 40) // Covers up to about 18 minutes per block
+
+/// <summary>
+/// Per-stage timing of the radio, or of any other set of named stages. Each stage adds up its time and samples and keeps a log-bucketed histogram of its block times. Stages may be timed
+/// from any thread, as everything is a relaxed atomic add. The status reads the totals and compares them to the last time it did, so nothing is ever
+/// reset under a stage that's running.
+/// </summary>
+class fmice_profiler {
+
+public:
+	/// <summary>
+	/// Creates a profiler for the radio's FMICE_PROFILER_STAGE_* stages.
+	/// </summary>
+	fmice_profiler();
+
+	/// <summary>
+	/// Creates a profiler for stages of your own, numbered by their index into names.
+	/// </summary>
+	/// <param name="names">Name of each stage, as shown in the status. Must outlive the profiler.</param>
+	/// <param name="count">Number of stages, up to FMICE_PROFILER_MAX_STAGES.</param>
+	fmice_profiler(const char* const* names, int count);
+
+	/// <summary>
+	/// Sets the sample rate a stage counts its samples at, used to work out its real-time factor.
+	/// </summary>
+	void set_rate(int stage, int sampleRate);
+
+	/// <summary>
+	/// Adds a block's timing to a stage, from start up to now.
+	/// </summary>
+	/// <param name="stage">FMICE_PROFILER_STAGE_*</param>
+	/// <param name="start">When the block started, from fmice_now_ns.</param>
+	/// <param name="samples">Samples in the block, at the stage's rate.</param>
+	void add(int stage, uint64_t start, int samples);
+
+	/// <summary>
+	/// Gets the name of a stage.
+	/// </summary>
+	const char* get_name(int stage);
+
+	/// <summary>
+	/// Gets the total time a stage has spent since the profiler was created.
+	/// </summary>
+	uint64_t get_total_ns(int stage);
+
+	/// <summary>
+	/// Gets the total samples a stage has processed since the profiler was created.
+	/// </summary>
+	uint64_t get_total_samples(int stage);
+
+	/// <summary>
+	/// Gets the block time in nanoseconds that the given fraction of a stage's blocks since the profiler was created took no longer than.
+	/// Comes from the histogram, so is within 25%.
+	/// </summary>
+	uint64_t get_percentile(int stage, double fraction);
+
+	/// <summary>
+	/// Writes each stage that ran since the last call as its real-time factor and 99th percentile block time, ending with "; ".
+	/// Only call from one thread.
+	/// </summary>
+	/// <param name="output">Buffer to write to. Up to 1 kB is written.</param>
+	/// <returns>Number of characters written.</returns>
+	int format_status(char* output);
+
+private:
+	struct stage_t {
+
+		int rate;
+		std::atomic<uint64_t> ns;
+		std::atomic<uint64_t> samples;
+		std::atomic<uint32_t> buckets[FMICE_PROFILER_BUCKETS];
+
+		// Status thread only - Totals as of the last status
+		uint64_t last_ns;
+		uint64_t last_samples;
+		uint32_t last_buckets[FMICE_PROFILER_BUCKETS];
+
+	};
+
+	const char* const* names;
+	int stage_count;
+	stage_t stages[FMICE_PROFILER_MAX_STAGES];
+
+	/// <summary>
+	/// Zeroes every stage.
+	/// </summary>
+	void init(const char* const* names, int count);
+
+	/// <summary>
+	/// Gets the bucket a block time falls into.
+	/// </summary>
+	static int bucket_of(uint64_t ns);
+
+	/// <summary>
+	/// Gets the longest block time that falls into a bucket.
+	/// </summary>
+	static uint64_t bucket_max(int bucket);
+
+	/// <summary>
+	/// Gets the bucket the given fraction of blocks fall into or below.
+	/// </summary>
+	static int bucket_at(const uint32_t* counts, uint64_t blocks, double fraction);
+
+};
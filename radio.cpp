@@ -4,8 +4,10 @@
 #include <stdint.h>
 #include <string.h>
 #include <cassert>
+#include <sched.h>
 
 #include "radio.h"
+#include "util.h"
 
 #include <dsp/taps/low_pass.h>
 #include <dsp/taps/band_pass.h>
@@ -17,78 +19,123 @@
 #include <math.h>
 
 #define RADIO_BUFFER_SIZE 65536
+#define RADIO_PIPE_SIZE (RADIO_BUFFER_SIZE * 4) // Samples each stage queue can hold before the producer waits - A live device drops upstream of us instead
+
+static void pin_thread(pthread_t thread, int cpu) {
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	if (pthread_setaffinity_np(thread, sizeof(set), &set) != 0)
+		printf("WARN: Failed to pin thread to CPU %i.\n", cpu);
+}
 
 fmice_radio::fmice_radio(fmice_device* device, fmice_radio_settings_t settings) :
 	device(device),
-	output_mpx(0),
-	output_audio(0),
+	output_mpx_count(0),
+	output_audio_count(0),
 	rds(0),
 	samples_since_last_status(0),
+	filter_bb(RADIO_BUFFER_SIZE),
+	filter_bb_enabled(settings.input_samp_rate != settings.demod_samp_rate),
+	input_samp_rate(settings.input_samp_rate),
 	stereo_decoder(RADIO_BUFFER_SIZE),
 	stereo_encoder(RADIO_BUFFER_SIZE, powf(10, settings.stereo_generator_level / 20), MPX_SAMP_RATE, settings.aud_filter_cutoff, settings.aud_filter_trans),
+	pilot_nco(RADIO_BUFFER_SIZE, 19000, MPX_SAMP_RATE, 2),
 	enable_status(settings.enable_status),
-	enable_stereo_generator(settings.stereo_generator_enable)
+	enable_stereo_generator(settings.stereo_generator_enable),
+	demod_count(0),
+	pilot_frequency(0),
+	demod_block_size(0),
+	mpx_block_size(0),
+	pipelined(false),
+	pipe_rds(0),
+	pipe_stereo(0),
+	pipe_mpx(0),
+	pipe_lpr(0),
+	pipe_lmr(0),
+	worker_count(0)
 {
+	//Untagged until given a name
+	status_name[0] = 0;
+
 	//Allocate buffers
 	size_t alignment = volk_get_alignment();
-	filter_bb_buffer = (dsp::complex_t*)volk_malloc(sizeof(dsp::complex_t) * RADIO_BUFFER_SIZE, alignment);
 	interleaved_buffer = (dsp::stereo_t*)volk_malloc(sizeof(dsp::stereo_t) * RADIO_BUFFER_SIZE, alignment);
 	mpx_out_buffer = (float*)volk_malloc(sizeof(float) * RADIO_BUFFER_SIZE, alignment);
-	if (filter_bb_buffer == 0 || interleaved_buffer == 0 || mpx_out_buffer == 0)
+	if (interleaved_buffer == 0 || mpx_out_buffer == 0)
 		throw std::runtime_error("Failed to allocate buffers.");
 
-	//Create baseband filter
-	filter_bb_taps = dsp::taps::lowPass(settings.bb_filter_cutoff, settings.bb_filter_trans, SAMP_RATE);
-	printf("Baseband filter taps: %i\n", filter_bb_taps.size);
-	filter_bb.init(NULL, filter_bb_taps);
-	filter_bb.out.setBufferSize(RADIO_BUFFER_SIZE);
+	//Tell the profiler what rate each stage counts at
+	profiler.set_rate(FMICE_PROFILER_STAGE_WAIT, input_samp_rate);
+	profiler.set_rate(FMICE_PROFILER_STAGE_FILTER_BB, input_samp_rate);
+	profiler.set_rate(FMICE_PROFILER_STAGE_DEMOD, settings.demod_samp_rate);
+	profiler.set_rate(FMICE_PROFILER_STAGE_RDS_DECODE, settings.demod_samp_rate);
+	profiler.set_rate(FMICE_PROFILER_STAGE_FILTER_MPX, settings.demod_samp_rate);
+	profiler.set_rate(FMICE_PROFILER_STAGE_STEREO_DECODE, MPX_SAMP_RATE);
+	profiler.set_rate(FMICE_PROFILER_STAGE_STEREO_ENCODE, MPX_SAMP_RATE);
+	profiler.set_rate(FMICE_PROFILER_STAGE_RDS_ENCODE, MPX_SAMP_RATE);
+	profiler.set_rate(FMICE_PROFILER_STAGE_OUTPUT_AUD, MPX_SAMP_RATE);
+	profiler.set_rate(FMICE_PROFILER_STAGE_OUTPUT_MPX, MPX_SAMP_RATE);
+
+	//Work out the most each front-end block makes at each rate, rounding up
+	demod_block_size = (int)(((int64_t)RADIO_BUFFER_SIZE * settings.demod_samp_rate + input_samp_rate - 1) / input_samp_rate);
+	mpx_block_size = (int)(((int64_t)RADIO_BUFFER_SIZE * MPX_SAMP_RATE + input_samp_rate - 1) / input_samp_rate);
+
+	//Create baseband filter, decimating down to the demodulator rate - Unless the source, such as a wideband channel, already did
+	assert((settings.demod_samp_rate % MPX_SAMP_RATE) == 0 && settings.demod_samp_rate <= input_samp_rate);
+	if (filter_bb_enabled) {
+		filter_bb.init(input_samp_rate, settings.demod_samp_rate, settings.bb_filter_cutoff, settings.bb_filter_trans);
+		filter_bb.print_plan("Baseband filter");
+	}
 
 	//Configure FM demod
-	fm_demod.init(NULL, settings.fm_deviation, SAMP_RATE);
+	fm_demod.init(NULL, settings.fm_deviation, settings.demod_samp_rate);
 	fm_demod.out.setBufferSize(RADIO_BUFFER_SIZE);
 
 	//Create composite filter
-	filter_mpx_taps = dsp::taps::lowPass(settings.mpx_filter_cutoff, settings.mpx_filter_trans, SAMP_RATE);
+	filter_mpx_taps = dsp::taps::lowPass(settings.mpx_filter_cutoff, settings.mpx_filter_trans, settings.demod_samp_rate);
 	printf("MPX filter taps: %i\n", filter_mpx_taps.size);
-	filter_mpx.init(NULL, filter_mpx_taps, DECIM_RATE);
+	filter_mpx.init(NULL, filter_mpx_taps, settings.demod_samp_rate / MPX_SAMP_RATE);
 	filter_mpx.out.setBufferSize(RADIO_BUFFER_SIZE);
 
 	//Configure stereo decoder
-	stereo_decoder.init(MPX_SAMP_RATE, AUDIO_DECIM_RATE, settings.aud_filter_cutoff, settings.aud_filter_trans, settings.deemphasis_rate);
+	stereo_decoder.init(MPX_SAMP_RATE, AUDIO_DECIM_RATE, settings.aud_filter_cutoff, settings.aud_filter_trans, settings.deemphasis_rate, settings.stereo_engine);
 
 	//Set up RDS if enabled (convert level from dB too)
 	if (settings.rds_enable)
-		rds = new fmice_rds(SAMP_RATE, MPX_SAMP_RATE, RADIO_BUFFER_SIZE, settings.rds_max_skew, powf(10, settings.rds_level / 20));
+		rds = new fmice_rds(settings.demod_samp_rate, MPX_SAMP_RATE, RADIO_BUFFER_SIZE, (float)RADIO_BUFFER_SIZE / input_samp_rate, settings.rds_max_skew, powf(10, settings.rds_level / 20));
+
+	//Split the stages onto their own threads if requested
+	if (settings.threads > 1)
+		start_pipeline(&settings);
+	else if (settings.pin_cpu_count > 0)
+		pin_thread(pthread_self(), settings.pin_cpus[0]);
 }
 
 fmice_radio::~fmice_radio() {
 	//TODO
 }
 
-void fmice_radio::set_mpx_output(fmice_icecast* ice) {
-	output_mpx = ice;
+void fmice_radio::add_mpx_output(fmice_output* output) {
+	assert(output_mpx_count < FMICE_RADIO_MAX_OUTPUTS);
+	output_mpx[output_mpx_count++] = output;
 }
 
-void fmice_radio::set_audio_output(fmice_icecast* ice) {
-	output_audio = ice;
+void fmice_radio::add_audio_output(fmice_output* output) {
+	assert(output_audio_count < FMICE_RADIO_MAX_OUTPUTS);
+	output_audio[output_audio_count++] = output;
 }
 
-static const char* ICECAST_STATUS_NAMES[4] = {
-	"init",
-	"connecting",
-	"ok",
-	"lost"
-};
-
-static void print_output_status(char* output, const char* name, fmice_icecast* cast) {
-	//If icecast is NULL, don't print anything
-	if (cast == NULL) {
-		output[0] = 0;
-		return;
-	}
+void fmice_radio::set_name(const char* name) {
+	strncpy(status_name, name, sizeof(status_name) - 1);
+	status_name[sizeof(status_name) - 1] = 0;
+}
 
-	//Format
-	sprintf(output, "%s=[status=%s; retries=%i]; ", name, ICECAST_STATUS_NAMES[cast->get_status()], cast->get_retries());
+static void print_output_status(char* output, const char* name, fmice_output** outputs, int count) {
+	//Let each output format itself
+	output[0] = 0;
+	for (int i = 0; i < count; i++)
+		output += outputs[i]->format_status(output, name);
 }
 
 static void print_rds_status(char* output, fmice_rds* rds) {
@@ -103,77 +150,290 @@ static void print_rds_status(char* output, fmice_rds* rds) {
 	rds->get_stats(&stats);
 
 	//Format
-	sprintf(output, "rds=[sync=%s; overruns=%i; underruns=%i]; ", stats.has_sync ? "ok" : "none", stats.overruns, stats.underruns);
+	sprintf(output, "rds=[sync=%s; bler=%.0f%%; corrected=%lli; overruns=%i; underruns=%i; dropped_groups=%i; repeated_groups=%i]; ", stats.has_sync ? "ok" : "none", stats.bler, (long long)stats.corrected_blocks, stats.overruns, stats.underruns, stats.dropped_groups, stats.repeated_groups);
 }
 
 void fmice_radio::print_status() {
 	//Format status
-	char outputMpxStatus[256];
-	print_output_status(outputMpxStatus, "mpx_icecast", output_mpx);
-	char outputAudStatus[256];
-	print_output_status(outputAudStatus, "aud_icecast", output_audio);
+	char outputMpxStatus[1024 * FMICE_RADIO_MAX_OUTPUTS];
+	print_output_status(outputMpxStatus, "mpx", output_mpx, output_mpx_count);
+	char outputAudStatus[1024 * FMICE_RADIO_MAX_OUTPUTS];
+	print_output_status(outputAudStatus, "aud", output_audio, output_audio_count);
 	char rdsStatus[256];
 	print_rds_status(rdsStatus, rds);
-
-	//Write status
-	printf("[STATUS] dropped_samples=%i %s%s%s\n",
+	char profilerStatus[1024];
+	profiler.format_status(profilerStatus);
+	char pilotStatus[64] = "";
+	float pilot = pilot_frequency.load(std::memory_order_relaxed);
+	if (pilot != 0)
+		sprintf(pilotStatus, "pilot_offset=%+.2fHz; ", pilot - 19000);
+
+	//Write status, tagged with the station if there's more than one
+	char tag[40] = "";
+	if (status_name[0] != 0)
+		snprintf(tag, sizeof(tag), " %s", status_name);
+	printf("[STATUS%s] dropped_samples=%i %s%s%s%s%s\n",
+		tag,
 		device->get_dropped_samples(),
+		pilotStatus,
 		outputMpxStatus,
 		outputAudStatus,
-		rdsStatus
+		rdsStatus,
+		profilerStatus
 	);
 
 	//Reset counter
 	samples_since_last_status = 0;
 }
 
-void fmice_radio::work() {
-	//Read into buffer
-	int count = device->read(filter_bb_buffer, RADIO_BUFFER_SIZE);
+int fmice_radio::work_frontend() {
+	//Wait for a block of samples and filter baseband straight out of the device buffer
+	int count = RADIO_BUFFER_SIZE;
+	uint64_t start = fmice_now_ns();
+	dsp::complex_t* samples = device->acquire_read(count);
+	if (samples == 0)
+		return -1;
+	profiler.add(FMICE_PROFILER_STAGE_WAIT, start, count);
 	samples_since_last_status += count;
+	const dsp::complex_t* baseband = samples;
+	if (filter_bb_enabled) {
+		start = fmice_now_ns();
+		count = filter_bb.process(count, samples, filter_bb.out.writeBuf);
+		device->release_read(RADIO_BUFFER_SIZE);
+		profiler.add(FMICE_PROFILER_STAGE_FILTER_BB, start, RADIO_BUFFER_SIZE);
+		baseband = filter_bb.out.writeBuf;
+	}
 
-	//Filter baseband
-	count = filter_bb.process(count, filter_bb_buffer, filter_bb.out.writeBuf);
-
-	//Demodulate FM
-	count = fm_demod.process(count, filter_bb.out.writeBuf, fm_demod.out.writeBuf);
-
-	//Use composite to decode RDS -- Allows composite filter to be wider
-	if (rds != 0)
-		rds->push_in(fm_demod.out.writeBuf, count);
+	//Demodulate FM - Straight out of the device buffer if it's already baseband, giving it back after
+	start = fmice_now_ns();
+	demod_count = fm_demod.process(count, baseband, fm_demod.out.writeBuf);
+	if (!filter_bb_enabled)
+		device->release_read(RADIO_BUFFER_SIZE);
+	profiler.add(FMICE_PROFILER_STAGE_DEMOD, start, count);
 
 	//Filter composite
-	count = filter_mpx.process(count, fm_demod.out.writeBuf, filter_mpx.out.writeBuf);
-
-	//Copy into the output MPX buffer - This allows us to change it without clobering the original
+	start = fmice_now_ns();
+	count = filter_mpx.process(demod_count, fm_demod.out.writeBuf, filter_mpx.out.writeBuf);
 	assert(count <= RADIO_BUFFER_SIZE);
-	memcpy(mpx_out_buffer, filter_mpx.out.writeBuf, sizeof(float) * count);
+	profiler.add(FMICE_PROFILER_STAGE_FILTER_MPX, start, demod_count);
+
+	return count;
+}
+
+void fmice_radio::work_rds_decode(const float* demod, int count) {
+	//Use composite to decode RDS -- Allows composite filter to be wider
+	if (rds != 0) {
+		uint64_t start = fmice_now_ns();
+		rds->push_in(demod, count);
+		profiler.add(FMICE_PROFILER_STAGE_RDS_DECODE, start, count);
+	}
+}
 
+void fmice_radio::work_stereo(const float* mpx, int count) {
 	//Demodulate audio if there's an output for it or we're re-generating stereo
-	if (output_audio != 0 || enable_stereo_generator) {
+	if (output_audio_count > 0 || enable_stereo_generator) {
 		//Process stereo
-		int audCount = stereo_decoder.process(filter_mpx.out.writeBuf, interleaved_buffer, count);
-
-		//Send to output
-		if (output_audio != 0)
-			output_audio->push(interleaved_buffer, audCount);
+		uint64_t start = fmice_now_ns();
+		int audCount = stereo_decoder.process(mpx, interleaved_buffer, count);
+		profiler.add(FMICE_PROFILER_STAGE_STEREO_DECODE, start, count);
+		pilot_frequency.store(stereo_decoder.get_pilot_frequency(), std::memory_order_relaxed);
+
+		//Send to outputs
+		start = fmice_now_ns();
+		for (int i = 0; i < output_audio_count; i++)
+			output_audio[i]->push(interleaved_buffer, audCount);
+		if (output_audio_count > 0)
+			profiler.add(FMICE_PROFILER_STAGE_OUTPUT_AUD, start, count);
 	}
+}
 
+void fmice_radio::work_mpx(float* mpx, const float* lpr, const float* lmr, int count) {
 	//Encode stereo (this wipes out the MPX)
 	if (enable_stereo_generator) {
-		stereo_encoder.process(mpx_out_buffer, stereo_decoder.lpr, stereo_decoder.lmr, count);
-		volk_32f_s32f_multiply_32f(mpx_out_buffer, mpx_out_buffer, 0.5f, count);
+		uint64_t start = fmice_now_ns();
+		pilot_nco.process(count);
+		stereo_encoder.process(mpx, lpr, lmr, pilot_nco.get(1), pilot_nco.get(2), count);
+		volk_32f_s32f_multiply_32f(mpx, mpx, 0.5f, count);
+		profiler.add(FMICE_PROFILER_STAGE_STEREO_ENCODE, start, count);
 	}
 
-	//Process RDS reencoding
-	if (rds != 0)
-		rds->process(mpx_out_buffer, mpx_out_buffer, count, !enable_stereo_generator);
+	//Process RDS reencoding - Its carrier is generated with it, starting at the same sample as the pilot so they stay locked
+	if (rds != 0) {
+		uint64_t start = fmice_now_ns();
+		rds->process(mpx, mpx, count, !enable_stereo_generator);
+		profiler.add(FMICE_PROFILER_STAGE_RDS_ENCODE, start, count);
+	}
+
+	//Send composite to outputs
+	uint64_t start = fmice_now_ns();
+	for (int i = 0; i < output_mpx_count; i++)
+		output_mpx[i]->push(mpx, count);
+	if (output_mpx_count > 0)
+		profiler.add(FMICE_PROFILER_STAGE_OUTPUT_MPX, start, count);
+}
+
+bool fmice_radio::work() {
+	//Run the front-end
+	int count = work_frontend();
+	if (count < 0) {
+		//Let the stage threads finish what's queued before reporting the end
+		if (pipelined)
+			stop_pipeline();
+		return false;
+	}
 
-	//Send composite to icecast
-	if (output_mpx != 0)
-		output_mpx->push(mpx_out_buffer, count);
+	if (pipelined) {
+		//Hand off to the stage threads
+		if (rds != 0)
+			pipe_rds->write_all(fm_demod.out.writeBuf, demod_count);
+		pipe_stereo->write_all(filter_mpx.out.writeBuf, count);
+	}
+	else {
+		//Decode RDS
+		work_rds_decode(fm_demod.out.writeBuf, demod_count);
+
+		//Copy into the output MPX buffer - This allows us to change it without clobering the original
+		memcpy(mpx_out_buffer, filter_mpx.out.writeBuf, sizeof(float) * count);
+
+		//Decode stereo, then regenerate the composite
+		work_stereo(filter_mpx.out.writeBuf, count);
+		work_mpx(mpx_out_buffer, stereo_decoder.lpr, stereo_decoder.lmr, count);
+	}
 
 	//Write status once every second
-	if (enable_status && samples_since_last_status >= SAMP_RATE)
+	if (enable_status && samples_since_last_status >= input_samp_rate)
 		print_status();
-}
\ No newline at end of file
+
+	return true;
+}
+
+void fmice_radio::stop_outputs() {
+	for (int i = 0; i < output_mpx_count; i++)
+		output_mpx[i]->stop();
+	for (int i = 0; i < output_audio_count; i++)
+		output_audio[i]->stop();
+}
+
+void fmice_radio::start_pipeline(const fmice_radio_settings_t* settings) {
+	//Create queues
+	pipe_stereo = new fmice_spsc_buffer<float>(RADIO_PIPE_SIZE);
+	pipe_mpx = new fmice_spsc_buffer<float>(RADIO_PIPE_SIZE);
+	if (rds != 0)
+		pipe_rds = new fmice_spsc_buffer<float>(RADIO_PIPE_SIZE);
+	if (enable_stereo_generator) {
+		pipe_lpr = new fmice_spsc_buffer<float>(RADIO_PIPE_SIZE);
+		pipe_lmr = new fmice_spsc_buffer<float>(RADIO_PIPE_SIZE);
+	}
+
+	//List the stages that need a thread, in order of cost
+	int stages[FMICE_RADIO_STAGE_COUNT];
+	int stageCount = 0;
+	stages[stageCount++] = FMICE_RADIO_STAGE_STEREO;
+	stages[stageCount++] = FMICE_RADIO_STAGE_MPX;
+	if (rds != 0)
+		stages[stageCount++] = FMICE_RADIO_STAGE_RDS;
+
+	//Deal them out to the worker threads - The calling thread keeps the front-end
+	worker_count = std::min(settings->threads - 1, stageCount);
+	for (int i = 0; i < worker_count; i++) {
+		workers[i].radio = this;
+		workers[i].stage_count = 0;
+	}
+	for (int i = 0; i < stageCount; i++) {
+		fmice_radio_worker_t* worker = &workers[i % worker_count];
+		worker->stages[worker->stage_count++] = stages[i];
+	}
+
+	//Start threads, pinning as we go
+	printf("Pipelining radio across %i threads.\n", worker_count + 1);
+	if (settings->pin_cpu_count > 0)
+		pin_thread(pthread_self(), settings->pin_cpus[0]);
+	for (int i = 0; i < worker_count; i++) {
+		if (pthread_create(&workers[i].thread, NULL, worker_static, &workers[i]) != 0)
+			throw std::runtime_error("Failed to start radio worker thread.");
+		if (i + 1 < settings->pin_cpu_count)
+			pin_thread(workers[i].thread, settings->pin_cpus[i + 1]);
+	}
+
+	pipelined = true;
+}
+
+void fmice_radio::stop_pipeline() {
+	//Close the front-end queues - Each stage closes the ones after it once it has drained its own
+	if (pipe_rds != 0)
+		pipe_rds->close();
+	pipe_stereo->close();
+
+	//Wait for the workers to run dry
+	for (int i = 0; i < worker_count; i++)
+		pthread_join(workers[i].thread, NULL);
+	pipelined = false;
+}
+
+void* fmice_radio::worker_static(void* ctx) {
+	fmice_radio_worker_t* worker = (fmice_radio_worker_t*)ctx;
+	bool running = true;
+	while (running) {
+		//Wait on the first stage. The rest are drained completely each time round, so a producer never waits on a queue we're not watching.
+		running = worker->radio->work_stage(worker->stages[0], true) >= 0;
+		for (int i = 1; i < worker->stage_count; i++) {
+			while (worker->radio->work_stage(worker->stages[i], false) > 0);
+		}
+	}
+	return 0;
+}
+
+int fmice_radio::work_stage(int stage, bool block) {
+	//Get the queue this stage reads from
+	fmice_spsc_buffer<float>* input = stage == FMICE_RADIO_STAGE_RDS ? pipe_rds : (stage == FMICE_RADIO_STAGE_STEREO ? pipe_stereo : pipe_mpx);
+
+	//Wait for something, then take whatever is there, up to what one front-end block makes. The stages stream, so this needn't line up with
+	//what the producer wrote, but staying within a block keeps RDS from seeing longer bursts than it was sized for.
+	if (!block && input->get_use() == 0)
+		return 0;
+	if (input->acquire_read(1) == 0) {
+		//Closed and drained - Pass the end on to whoever reads from us
+		if (stage == FMICE_RADIO_STAGE_STEREO) {
+			if (enable_stereo_generator) {
+				pipe_lpr->close();
+				pipe_lmr->close();
+			}
+			pipe_mpx->close();
+		}
+		return -1;
+	}
+	int count = (int)std::min(input->get_use(), (size_t)(stage == FMICE_RADIO_STAGE_RDS ? demod_block_size : mpx_block_size));
+	float* samples = input->acquire_read(count);
+
+	switch (stage) {
+	case FMICE_RADIO_STAGE_RDS:
+		work_rds_decode(samples, count);
+		break;
+	case FMICE_RADIO_STAGE_STEREO:
+		//Decode, then forward the composite and L+R/L-R - L+R/L-R go first so they're ready once the composite is seen
+		work_stereo(samples, count);
+		if (enable_stereo_generator) {
+			pipe_lpr->write_all(stereo_decoder.lpr, count);
+			pipe_lmr->write_all(stereo_decoder.lmr, count);
+		}
+		pipe_mpx->write_all(samples, count);
+		break;
+	case FMICE_RADIO_STAGE_MPX:
+		//Regenerate in place on the queue's memory
+		if (enable_stereo_generator) {
+			float* lpr = pipe_lpr->acquire_read(count);
+			float* lmr = pipe_lmr->acquire_read(count);
+			work_mpx(samples, lpr, lmr, count);
+			pipe_lpr->release_read(count);
+			pipe_lmr->release_read(count);
+		}
+		else {
+			work_mpx(samples, 0, 0, count);
+		}
+		break;
+	}
+
+	//Done with the input
+	input->release_read(count);
+	return count;
+}
@@ -1,11 +1,16 @@
 #pragma once
 
 #include "cast.h"
+#include "output.h"
 #include "device.h"
 #include "circular_buffer.h"
+#include "spsc_buffer.h"
 #include "stereo_demod.h"
 #include "stereo_encode.h"
+#include "nco.h"
 #include "rds/rds.h"
+#include "decimator.h"
+#include "profiler.h"
 
 #include <dsp/filter/fir.h>
 #include <dsp/filter/decimating_fir.h>
@@ -14,13 +19,25 @@
 #include <dsp/convert/complex_to_real.h>
 #include <dsp/loop/pll.h>
 #include <dsp/math/delay.h>
+#include <pthread.h>
+
+#define FMICE_RADIO_MAX_THREADS 8
+#define FMICE_RADIO_MAX_OUTPUTS 4 // Per stream
+
+#define FMICE_RADIO_STAGE_RDS 0 // RDS decode
+#define FMICE_RADIO_STAGE_STEREO 1 // Stereo decode and audio output
+#define FMICE_RADIO_STAGE_MPX 2 // Stereo/RDS regeneration and composite output
+#define FMICE_RADIO_STAGE_COUNT 3
 
 struct fmice_radio_settings_t {
 
 	bool enable_status;
 
+	int input_samp_rate; // Rate the device delivers - If it's already the demod rate, the source has done the baseband filtering and it's skipped
+	int demod_samp_rate;
 	double fm_deviation;
 	double deemphasis_rate;
+	int stereo_engine; // FMICE_STEREO_ENGINE_*
 
 	double bb_filter_cutoff;
 	double bb_filter_trans;
@@ -38,6 +55,21 @@ struct fmice_radio_settings_t {
 	bool stereo_generator_enable;
 	float stereo_generator_level;
 
+	int threads; // 1 runs everything in work(), more splits the stages onto their own threads
+	int pin_cpus[FMICE_RADIO_MAX_THREADS]; // CPU for each thread, starting with the one calling work()
+	int pin_cpu_count;
+
+};
+
+class fmice_radio;
+
+struct fmice_radio_worker_t {
+
+	fmice_radio* radio;
+	int stages[FMICE_RADIO_STAGE_COUNT]; // The first one blocks for input, the rest are drained of whatever is ready
+	int stage_count;
+	pthread_t thread;
+
 };
 
 class fmice_radio {
@@ -47,32 +79,45 @@ public:
 	~fmice_radio();
 
 	/// <summary>
-	/// Sets an output for MPX to stream.
+	/// Adds an output for MPX to stream. Up to FMICE_RADIO_MAX_OUTPUTS.
+	/// </summary>
+	/// <param name="output"></param>
+	void add_mpx_output(fmice_output* output);
+
+	/// <summary>
+	/// Adds an output for audio to stream. Up to FMICE_RADIO_MAX_OUTPUTS.
+	/// </summary>
+	/// <param name="output"></param>
+	void add_audio_output(fmice_output* output);
+
+	/// <summary>
+	/// Sets a name to tag this radio's status lines with, such as the station frequency when several share a device.
 	/// </summary>
-	/// <param name="ice"></param>
-	void set_mpx_output(fmice_icecast* ice);
+	void set_name(const char* name);
 
 	/// <summary>
-	/// Sets an output for audio to stream.
+	/// Processes a block of smaples. Call this over and over. When pipelined, this only runs the front-end and hands the block to the stage threads.
+	/// Returns false once the device has run out of samples.
 	/// </summary>
-	/// <param name="ice"></param>
-	void set_audio_output(fmice_icecast* ice);
+	bool work();
 
 	/// <summary>
-	/// Processes a block of smaples. Call this over and over.
+	/// Flushes and stops every output. Call once work has returned false.
 	/// </summary>
-	void work();
+	void stop_outputs();
 
 private:
 	fmice_device* device;
 
-	dsp::tap<float> filter_bb_taps;
-	dsp::filter::FIR<dsp::complex_t, float> filter_bb;
-	dsp::complex_t* filter_bb_buffer;
+	fmice_decimator filter_bb;
+	bool filter_bb_enabled; // Off when the source already delivers filtered baseband at the demod rate
+	int input_samp_rate;
 
 	dsp::demod::Quadrature fm_demod;
 	fmice_stereo_demod stereo_decoder;
+	std::atomic<float> pilot_frequency; // Copied out after each stereo decode for the status line, 0 if not tracked
 	fmice_stereo_encode stereo_encoder;
+	fmice_nco_bank pilot_nco; // 19 and 38 kHz carriers for the stereo generator - RDS generates its own 57 kHz in step with it
 
 	dsp::tap<float> filter_mpx_taps;
 	dsp::filter::DecimatingFIR<float, float> filter_mpx;
@@ -80,14 +125,67 @@ private:
 	float* mpx_out_buffer;
 	dsp::stereo_t* interleaved_buffer;
 
-	fmice_icecast* output_mpx; // May be null
-	fmice_icecast* output_audio; // May be null
+	fmice_output* output_mpx[FMICE_RADIO_MAX_OUTPUTS];
+	int output_mpx_count;
+	fmice_output* output_audio[FMICE_RADIO_MAX_OUTPUTS];
+	int output_audio_count;
 	fmice_rds* rds; // May be null
 
 	bool enable_status;
+	char status_name[32]; // Empty if untagged
 	int samples_since_last_status;
+	fmice_profiler profiler;
 	bool enable_stereo_generator;
 
+	bool pipelined;
+	int demod_block_size; // Most demodulated samples one front-end block makes
+	int mpx_block_size; // Most MPX samples one front-end block makes
+	fmice_spsc_buffer<float>* pipe_rds; // Front-end -> RDS decode, at the demod rate
+	fmice_spsc_buffer<float>* pipe_stereo; // Front-end -> stereo decode, MPX
+	fmice_spsc_buffer<float>* pipe_mpx; // Stereo decode -> MPX regeneration, MPX
+	fmice_spsc_buffer<float>* pipe_lpr; // Stereo decode -> MPX regeneration, L+R (only with the stereo generator)
+	fmice_spsc_buffer<float>* pipe_lmr; // Stereo decode -> MPX regeneration, L-R (only with the stereo generator)
+
+	fmice_radio_worker_t workers[FMICE_RADIO_MAX_THREADS];
+	int worker_count;
+
 	void print_status();
 
+	/// <summary>
+	/// Reads a block from the device, demodulates it and filters the composite. Returns the number of MPX samples in filter_mpx.out.writeBuf, or -1 if the device has run out.
+	/// The demodulated samples are left in fm_demod.out.writeBuf, their count in demod_count.
+	/// </summary>
+	int work_frontend();
+	int demod_count;
+
+	void work_rds_decode(const float* demod, int count);
+
+	/// <summary>
+	/// Decodes stereo and sends the audio output. Leaves L+R/L-R in the stereo decoder.
+	/// </summary>
+	void work_stereo(const float* mpx, int count);
+
+	/// <summary>
+	/// Regenerates stereo/RDS into mpx in place and sends the composite output.
+	/// </summary>
+	void work_mpx(float* mpx, const float* lpr, const float* lmr, int count);
+
+	/// <summary>
+	/// Creates the stage queues and threads.
+	/// </summary>
+	void start_pipeline(const fmice_radio_settings_t* settings);
+
+	/// <summary>
+	/// Closes the front-end queues and waits for the stage threads to process everything left in them.
+	/// </summary>
+	void stop_pipeline();
+
+	/// <summary>
+	/// Runs one pipelined stage on whatever its queue holds. If block is set, waits for input; otherwise returns 0 when there is none.
+	/// Returns the number of samples processed, or -1 once the queue is closed and drained.
+	/// </summary>
+	int work_stage(int stage, bool block);
+
+	static void* worker_static(void* ctx);
+
 };
\ No newline at end of file
@@ -1,89 +1,89 @@
 #include "rds.h"
 
 #include <stdio.h>
+#include <string.h>
+#include <math.h>
 #include <cassert>
+#include <algorithm>
+#include <volk/volk.h>
 #include <dsp/taps/low_pass.h>
 
-#define RDS_SAMPLE_RATE 190000 // Must be a multiple of the baud rate and greater than the mpx sample rate
-
-fmice_rds::fmice_rds(int inputSampleRate, int outputSampleRate, int bufferSize, float maxSkewSeconds, float scale) :
+fmice_rds::fmice_rds(int inputSampleRate, int outputSampleRate, int bufferSize, float blockSeconds, float maxSkewSeconds, float scale) :
 	dec(bufferSize),
-	enc(RDS_SAMPLE_RATE),
-	scale(scale),
-	bit_buffer(0),
-	bit_buffer_len(0),
-	bit_buffer_use(0),
-	bit_buffer_write(0),
-	bit_buffer_read(0),
+	enc(outputSampleRate, scale),
 	decoder_buffer(0),
-	encoder_buffer(0),
-	encoder_buffer_len(0),
+	decoder_groups(0),
+	group_buffer(0),
+	group_buffer_len(0),
+	group_buffer_use(0),
+	group_buffer_write(0),
+	group_buffer_read(0),
+	group_target(0),
+	group_burst(0),
+	is_priming(true),
+	fill_avg(0),
+	held_groups(0),
+	tx_pos(FMICE_RDS_GROUP_BITS),
+	tx_last(0),
 	rds_buffer(0),
 	rds_buffer_len(0),
 	rds_buffer_read(0),
-	rds_buffer_aval(0),
-	is_underflow(true),
-	is_overflow(false),
-	osc_phase(0),
-	osc_phase_inc(0)
+	rds_buffer_aval(0)
 {
 	//Configure decoder
 	dec.configure(inputSampleRate);
 
-	//Calculate bit buffer size from the skew and baud rate
-	bit_buffer_len = (int)(1187.5 * maxSkewSeconds);
+	//Groups come in and go out in bursts of up to a block each (plus one straddling the edge), so size the buffer from that - Hold a burst
+	//(or half the skew, if more) and leave room for two more above it before anything is lost
+	group_burst = (int)ceil(1187.5 * blockSeconds / FMICE_RDS_GROUP_BITS) + 1;
+	int skewGroups = (int)((1187.5 * maxSkewSeconds / FMICE_RDS_GROUP_BITS) + 0.5f);
+	group_target = std::max(group_burst, skewGroups / 2);
+	group_buffer_len = std::max(group_target + (group_burst * 2), skewGroups);
 
-	//Allocate bit buffer
-	bit_buffer = (uint8_t*)calloc(sizeof(uint8_t), bit_buffer_len);
-	assert(bit_buffer != 0);
+	//Allocate group buffer
+	group_buffer = (fmice_rds_group*)calloc(sizeof(fmice_rds_group), group_buffer_len);
+	assert(group_buffer != 0);
 
-	//Allocate output buffer for decoder
+	//Allocate output buffers for decoder
 	decoder_buffer = (uint8_t*)malloc(sizeof(uint8_t) * bufferSize);
 	assert(decoder_buffer != 0);
+	decoder_groups = (fmice_rds_group*)malloc(sizeof(fmice_rds_group) * ((bufferSize / FMICE_RDS_GROUP_BITS) + 1));
+	assert(decoder_groups != 0);
 	
-	//Allocate output buffer for encoder
-	encoder_buffer_len = enc.get_samples_per_bit();
-	encoder_buffer = (float*)malloc(sizeof(float) * encoder_buffer_len);
-	assert(encoder_buffer != 0);
-
-	//Init MPX filter...this is a very tight filter so prepare for a lot of taps!
-	mpx_filter_taps = dsp::taps::lowPass(38000 + 17200, 500, outputSampleRate);
-	printf("rds re-encode mpx taps: %i\n", mpx_filter_taps.size);
-	mpx_filter.init(NULL, mpx_filter_taps);
-
-	//Init resampler that takes it from the RDS rate to the output rate
-	assert(RDS_SAMPLE_RATE >= outputSampleRate);
-	rds_resamp.init(NULL, RDS_SAMPLE_RATE, outputSampleRate);
-	rds_resamp.out.setBufferSize(bufferSize);
-
-	//Allocate RDS buffer
-	rds_buffer_len = encoder_buffer_len;
+	//Allocate RDS buffer to hold the longest bit from the encoder
+	rds_buffer_len = enc.get_max_samples_per_bit();
 	rds_buffer = (float*)malloc(sizeof(float) * rds_buffer_len);
 	assert(rds_buffer != 0);
 
-	//Calculate parameters for 57 kHz oscilator
-	osc_phase = 0;
-	osc_phase_inc = 2 * M_PI * 57000 / outputSampleRate;
+	//Init MPX filter...this is a very tight filter so there are a lot of taps, which is why it's run as an FFT convolution
+	mpx_filter_taps = dsp::taps::lowPass(38000 + 17200, 500, outputSampleRate);
+	mpx_filter.init(mpx_filter_taps, bufferSize);
+	mpx_filter.print_plan("rds re-encode mpx filter");
 
-	//Init mutex for stats
-	bool mutexOk = pthread_mutex_init(&stat_lock, NULL) == 0;
+	//Init mutexes for stats and the group buffer
+	bool mutexOk = pthread_mutex_init(&stat_lock, NULL) == 0 && pthread_mutex_init(&group_lock, NULL) == 0;
 	assert(mutexOk);
 
 	//Initialize stats
-	stats.overruns = 0;
 	stats.underruns = 0;
+	stats.overruns = 0;
+	stats.dropped_groups = 0;
+	stats.repeated_groups = 0;
+	stats.corrected_blocks = 0;
+	stats.bler = 100;
 	stats.has_sync = false;
 }
 
 fmice_rds::~fmice_rds() {
 	//Free buffers
-	free(bit_buffer);
+	free(group_buffer);
 	free(decoder_buffer);
-	free(encoder_buffer);
+	free(decoder_groups);
 	free(rds_buffer);
 
-	//Free mutex
+	//Free mutexes
 	pthread_mutex_destroy(&stat_lock);
+	pthread_mutex_destroy(&group_lock);
 }
 
 void fmice_rds::get_stats(fmice_rds_stats* output) {
@@ -97,14 +97,14 @@ void fmice_rds::get_stats(fmice_rds_stats* output) {
 	pthread_mutex_unlock(&stat_lock);
 }
 
-void fmice_rds::update_stats(int addUnderrun, int addOverrun) {
+void fmice_rds::update_stats(int addUnderrun, int addDropped, int addRepeated) {
 	//Lock
 	pthread_mutex_lock(&stat_lock);
 
 	//Update
 	stats.underruns += addUnderrun;
-	stats.overruns += addOverrun;
-	stats.has_sync = !is_overflow && !is_underflow;
+	stats.dropped_groups += addDropped;
+	stats.repeated_groups += addRepeated;
 
 	//Unlock
 	pthread_mutex_unlock(&stat_lock);
@@ -114,8 +114,30 @@ void fmice_rds::push_in(const float* mpxIn, int count) {
 	//Push into decoder
 	int decodedBits = dec.process(mpxIn, decoder_buffer, count);
 
-	//Push decoded bits into the bit buffer
-	bit_buffer_push(decoder_buffer, decodedBits);
+	//Find groups
+	int groups = sync.process(decoder_buffer, decodedBits, decoder_groups);
+
+	//Push them into the group buffer, dropping them if it's full
+	int overruns = 0;
+	pthread_mutex_lock(&group_lock);
+	for (int i = 0; i < groups; i++) {
+		if (group_buffer_use == group_buffer_len) {
+			overruns++;
+			continue;
+		}
+		group_buffer[group_buffer_write] = decoder_groups[i];
+		group_buffer_write = (group_buffer_write + 1) % group_buffer_len;
+		group_buffer_use++;
+	}
+	pthread_mutex_unlock(&group_lock);
+
+	//Update stats
+	pthread_mutex_lock(&stat_lock);
+	stats.overruns += overruns;
+	stats.corrected_blocks = sync.get_corrected_blocks();
+	stats.bler = sync.get_bler();
+	stats.has_sync = sync.has_sync();
+	pthread_mutex_unlock(&stat_lock);
 }
 
 void fmice_rds::process(const float* mpxIn, float* mpxOut, int count, bool filter) {
@@ -127,118 +149,107 @@ void fmice_rds::process(const float* mpxIn, float* mpxOut, int count, bool filte
 	int encCount = 0;
 	int writable;
 	while (encCount < count) {
-		//Read out of the rds buffer and add it to the output until we run out of samples in the output or the RDS buffer
-		while (rds_buffer_read < rds_buffer_aval && encCount < count) {
-			mpxOut[encCount++] += rds_buffer[rds_buffer_read++];
+		//Add the rds buffer to the output until we run out of samples in the output or the RDS buffer
+		writable = std::min(rds_buffer_aval - rds_buffer_read, count - encCount);
+		if (writable > 0) {
+			volk_32f_x2_add_32f(&mpxOut[encCount], &mpxOut[encCount], &rds_buffer[rds_buffer_read], writable);
+			rds_buffer_read += writable;
+			encCount += writable;
 		}
 
 		//If the RDS buffer is empty, encode a new bit
 		if (rds_buffer_read == rds_buffer_aval) {
-			//Encode a sample
-			enc.push(bit_buffer_pop(), encoder_buffer, encoder_buffer_len);
-
-			//Resample
-			rds_buffer_aval = rds_resamp.process(encoder_buffer_len, encoder_buffer, rds_buffer);
-			assert(rds_buffer_aval <= rds_buffer_len);
+			rds_buffer_aval = enc.push(next_bit(), rds_buffer);
 			rds_buffer_read = 0;
-
-			//Mix with 57 kHz
-			for (int i = 0; i < rds_buffer_aval; i++) {
-				//Multiply
-				rds_buffer[i] *= sinf(osc_phase) * scale;
-
-				//Step
-				osc_phase += osc_phase_inc;
-				if (fabs(osc_phase) > M_PI) {
-					while (osc_phase > M_PI)
-						osc_phase -= 2 * M_PI;
-					while (osc_phase < -M_PI)
-						osc_phase += 2 * M_PI;
-				}
-			}
 		}
 	}
 }
 
-void fmice_rds::bit_buffer_push(const uint8_t* buffer, int count) {
-	//If already overflowing, allow buffer to drain significantly instead of writing
-	if (is_overflow) {
-		//Determine if we are still in overflow state
-		is_overflow = bit_buffer_use > (bit_buffer_len / 2);
-
-		//If still overflowing abort, otherwise update stats (to update sync flag)
-		if (is_overflow)
-			return;
-		else
-			update_stats(0, 0);
+uint8_t fmice_rds::next_bit() {
+	//Load the next group once this one is sent
+	if (tx_pos == FMICE_RDS_GROUP_BITS)
+		next_group();
+
+	//Differentially encode
+	tx_last ^= tx_bits[tx_pos++];
+	return tx_last;
+}
+
+int fmice_rds::track_fill() {
+	//Smooth the fill so bursty decoding doesn't trigger a slip
+	fill_avg += (group_buffer_use - fill_avg) * FMICE_RDS_FILL_ALPHA;
+
+	//Drop a group if the decoder is running ahead - Past the target by a burst, leaving a burst of room before the buffer overruns
+	if (fill_avg > group_buffer_len - group_burst && group_buffer_use > 1) {
+		group_buffer_read = (group_buffer_read + 1) % group_buffer_len;
+		group_buffer_use--;
+		fill_avg -= 1;
+		return 1;
 	}
 
-	//Copy into the buffer
-	int readOffset = 0;
-	int writable;
-	while (count > 0) {
-		//Calculate how much we can copy
-		writable = std::min(std::min(count, bit_buffer_len - bit_buffer_use), bit_buffer_len - bit_buffer_write);
-
-		//Copy
-		if (writable > 0)
-			memcpy(&bit_buffer[bit_buffer_write], &buffer[readOffset], sizeof(uint8_t) * writable);
-		bit_buffer_write = (bit_buffer_write + writable) % bit_buffer_len;
-		bit_buffer_use += writable;
-		readOffset += writable;
-		count -= writable;
-
-		//Check if we are out of room in the bit buffer
-		if (bit_buffer_use == bit_buffer_len) {
-			//Handle overrun
-			handle_overrun();
-
-			//Abort
-			return;
-		}
+	//Repeat a group if the encoder is running ahead - A group under the target, so it happens before the buffer runs dry. Once it has, the
+	//decoder has likely stopped, so leave that to the hold logic.
+	if (fill_avg < group_target - 1 && group_buffer_use > 0) {
+		fill_avg += 1;
+		return -1;
 	}
+
+	return 0;
 }
 
-uint8_t fmice_rds::bit_buffer_pop() {
-	//If already underflowing, allow buffer to fill significantly instead of reading
-	if (is_underflow) {
-		//Determine if we are still in underflow state
-		is_underflow = bit_buffer_use < (bit_buffer_len / 2);
-
-		//If still underflowing abort, otherwise update stats (to update sync flag)
-		if (is_underflow)
-			return 0;
-		else
-			update_stats(0, 0);
+void fmice_rds::next_group() {
+	int underruns = 0;
+	int dropped = 0;
+	int repeated = 0;
+	bool sending = true;
+	pthread_mutex_lock(&group_lock);
+
+	//Let the buffer fill to the target before starting, so there is slack for jitter either way
+	if (is_priming && group_buffer_use >= std::max(group_target, 1)) {
+		is_priming = false;
+		fill_avg = group_buffer_use;
 	}
 
-	//If a sample is available for reading, pop it
-	uint8_t samp = 0;
-	if (bit_buffer_use > 0) {
-		samp = bit_buffer[bit_buffer_read];
-		bit_buffer_read = (bit_buffer_read + 1) % bit_buffer_len;
-		bit_buffer_use--;
+	if (is_priming) {
+		sending = false;
 	}
 	else {
-		//Handle underrun
-		handle_underrun();
+		//Correct for drift
+		int slip = track_fill();
+		if (slip > 0)
+			dropped++;
+
+		//Take the next group, or send the last one again if the encoder is running ahead or there isn't one - Give up once nothing new has come in for a while
+		if (slip < 0) {
+			repeated++;
+		}
+		else if (group_buffer_use > 0) {
+			tx_group = group_buffer[group_buffer_read];
+			group_buffer_read = (group_buffer_read + 1) % group_buffer_len;
+			group_buffer_use--;
+			held_groups = 0;
+		}
+		else if (++held_groups <= FMICE_RDS_HOLD_GROUPS) {
+			underruns++;
+			repeated++;
+		}
+		else {
+			underruns++;
+			is_priming = true;
+			sending = false;
+		}
 	}
 
-	return samp;
-}
-
-void fmice_rds::handle_overrun() {
-	//Set flag for processing
-	is_overflow = true;
+	pthread_mutex_unlock(&group_lock);
 
 	//Update stats
-	update_stats(0, 1);
+	if (underruns > 0 || dropped > 0 || repeated > 0)
+		update_stats(underruns, dropped, repeated);
+
+	//Load the bits, or zeros if there's nothing to send
+	if (sending)
+		fmice_rds_sync::encode(&tx_group, tx_bits);
+	else
+		memset(tx_bits, 0, sizeof(tx_bits));
+	tx_pos = 0;
 }
-
-void fmice_rds::handle_underrun() {
-	//Set flag for processing
-	is_underflow = true;
-
-	//Update stats
-	update_stats(1, 0);
-}
\ No newline at end of file
@@ -2,33 +2,50 @@
 
 #include "rds_enc.h"
 #include "rds_dec.h"
+#include "rds_sync.h"
 
-#include <dsp/multirate/rational_resampler.h>
 #include <dsp/taps/tap.h>
 #include <dsp/filter/fir.h>
+#include "../fft_filter.h"
 #include <pthread.h>
 
+#define FMICE_RDS_HOLD_GROUPS 12 // Groups the last one is repeated for when nothing new comes in, about a second, before going quiet
+#define FMICE_RDS_FILL_ALPHA (1 / 12.0f) // Smoothing per group of the measured fill, about a second
+
 struct fmice_rds_stats {
 
-	int underruns;
-	int overruns;
-	bool has_sync;
+	int underruns; // Groups needed while the buffer was empty
+	int overruns; // Groups decoded while the buffer was full
+	int dropped_groups; // Skipped to bring the fill back down
+	int repeated_groups; // Sent again because nothing new was ready
+	int64_t corrected_blocks;
+	float bler; // Percent of recent blocks that couldn't be corrected
+	bool has_sync; // Block sync on the input
 
 };
 
+/// <summary>
+/// RDS re-encoder. Decoded bits are block synchronized and error corrected, and only whole good groups are passed to the encoder through a short
+/// group buffer. The buffer is held near its target by dropping a group when the decoder runs ahead and repeating one when it falls behind, so the
+/// output is always made of whole, valid groups.
+/// </summary>
 class fmice_rds {
 
 public:
-	fmice_rds(int inputSampleRate, int outputSampleRate, int bufferSize, float maxSkewSeconds, float scale);
+	/// <summary>
+	/// Creates the re-encoder. blockSeconds is the longest stretch of signal push_in or process is handed at once, which sets how bursty the group buffer is.
+	/// </summary>
+	fmice_rds(int inputSampleRate, int outputSampleRate, int bufferSize, float blockSeconds, float maxSkewSeconds, float scale);
 	~fmice_rds();
 
 	/// <summary>
-	/// Reads RDS from the input.
+	/// Reads RDS from the input. May be called from a different thread than process.
 	/// </summary>
 	void push_in(const float* mpxIn, int count);
 
 	/// <summary>
-	/// Processes mpxIn into mpxOut, reencoding RDS.
+	/// Processes mpxIn into mpxOut, reencoding RDS. The encoder's carrier counts from the first sample processed, so it stays locked to the
+	/// radio's fmice_nco_bank pilot as long as both are started together and see every sample.
 	/// </summary>
 	void process(const float* mpxIn, float* mpxOut, int count, bool filter);
 
@@ -39,61 +56,60 @@ public:
 
 private:
 	fmice_rds_dec dec;
+	fmice_rds_sync sync;
 	fmice_rds_enc enc;
 
-	float scale;
-
-	uint8_t* bit_buffer; // Buffer that holds decoded bits waiting for the encoder
-	int bit_buffer_len;
-	int bit_buffer_use;
-	int bit_buffer_write;
-	int bit_buffer_read;
-
 	uint8_t* decoder_buffer; // Buffer of RDS bits after being decoded
-	float* encoder_buffer; // Buffer of an RDS sample after being encoded
-	int encoder_buffer_len;
-
-	float* rds_buffer; // Buffer of RDS samples waiting to be written to output - These are all already shifted up to 57 kHz
+	fmice_rds_group* decoder_groups; // Groups found in the decoded bits
+
+	pthread_mutex_t group_lock; // Protects the group buffer so decoding and encoding can run on different threads
+	fmice_rds_group* group_buffer; // Buffer that holds synced groups waiting for the encoder
+	int group_buffer_len;
+	int group_buffer_use;
+	int group_buffer_write;
+	int group_buffer_read;
+	int group_target; // Groups the buffer is held at
+	int group_burst; // Most groups one call to push_in or process can add or take at once
+
+	// Encoder thread access ONLY
+	bool is_priming; // Waiting for the buffer to reach the target before sending
+	float fill_avg; // Smoothed group buffer use
+	int held_groups; // Repeats since the last new group
+	fmice_rds_group tx_group; // Group being sent
+	uint8_t tx_bits[FMICE_RDS_GROUP_BITS]; // Its bits, before differential encoding
+	int tx_pos;
+	uint8_t tx_last; // Last bit sent, after differential encoding
+
+	float* rds_buffer; // Buffer of the last bit's modulated RDS samples waiting to be written to output
 	int rds_buffer_len;
 	int rds_buffer_read;
 	int rds_buffer_aval;
 
-	bool is_overflow;
-	bool is_underflow;
-
-	double osc_phase;
-	double osc_phase_inc;
-	
 	dsp::tap<float> mpx_filter_taps;
-	dsp::filter::FIR<float, float> mpx_filter;
-	dsp::multirate::RationalResampler<float> rds_resamp;
+	fmice_fft_filter mpx_filter;
 
 	pthread_mutex_t stat_lock; // the following stats are accessible cross-thread so must be protected by the mutex
 	fmice_rds_stats stats;
 
 	/// <summary>
-	/// Pushes into the bit buffer. Handles overflows.
+	/// Gets the next bit to encode, differentially encoded.
 	/// </summary>
-	void bit_buffer_push(const uint8_t* buffer, int count);
+	uint8_t next_bit();
 
 	/// <summary>
-	/// Pops a sample off of the bit buffer. Even if it's empty, this will return a valid result.
+	/// Updates the smoothed fill and decides on a slip. Returns 1 if a group was dropped from the buffer, -1 if the last group should be sent
+	/// again, otherwise 0. Only ever slips whole groups, so the output stays block aligned. Call with the group lock held.
 	/// </summary>
-	uint8_t bit_buffer_pop();
+	int track_fill();
 
 	/// <summary>
-	/// Locks the mutex and updates statistics. Thread safe (when called on work thread).
+	/// Picks the next group to send, dropping or repeating one to hold the buffer at the target, and loads its bits.
 	/// </summary>
-	void update_stats(int addUnderrun, int addOverrun);
+	void next_group();
 
 	/// <summary>
-	/// Called when there is a bit buffer overrun (too many RDS samples decoded vs encoded).
+	/// Locks the mutex and updates the encoder's statistics. Thread safe (when called on work thread).
 	/// </summary>
-	void handle_overrun();
+	void update_stats(int addUnderrun, int addDropped, int addRepeated);
 
-	/// <summary>
-	/// Called when there is a bit buffer underrun (too many RDS samples encoded vs decoded).
-	/// </summary>
-	void handle_underrun();
-
-};
\ No newline at end of file
+};
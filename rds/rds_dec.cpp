@@ -1,31 +1,56 @@
 #include "rds_dec.h"
-
+#include "../util.h"
+
+#include <string.h>
+#include <math.h>
+#include <cassert>
+#include <stdexcept>
+#include <algorithm>
+#include <volk/volk.h>
 #include <dsp/taps/band_pass.h>
 #include <dsp/convert/complex_to_real.h>
 #include <dsp/digital/binary_slicer.h>
 
 fmice_rds_dec::fmice_rds_dec(int bufferSize) :
-    buffer_size(bufferSize)
+    buffer_size(bufferSize),
+    mixer_table(0),
+    mixer_period(0),
+    mixer_pos(0),
+    mixer_buffer(0),
+    decim(bufferSize)
 {
-
+    //Allocate mixer output
+    mixer_buffer = (dsp::complex_t*)volk_malloc(sizeof(dsp::complex_t) * bufferSize, volk_get_alignment());
+    if (mixer_buffer == 0)
+        throw std::runtime_error("Failed to allocate RDS decoder buffers.");
 }
 
 fmice_rds_dec::~fmice_rds_dec() {
-
+    //Free buffers
+    volk_free(mixer_buffer);
+    if (mixer_table != 0)
+        volk_free(mixer_table);
 }
 
 void fmice_rds_dec::configure(int sampleRate) {
-    //Init RTOC
-    rtoc.init(NULL);
-    rtoc.out.setBufferSize(buffer_size);
-
-    //Init xlator
-    xlator.init(NULL, -57000.0, sampleRate);
-    xlator.out.setBufferSize(buffer_size);
-
-    //Init resampler
-    rds_resamp.init(NULL, sampleRate, 5000.0);
-    rds_resamp.out.setBufferSize(buffer_size);
+    //Build the mixer table - 57 kHz repeats every sampleRate / gcd samples, which is short for any rate this is run at
+    mixer_period = sampleRate / fmice_gcd(sampleRate, 57000);
+    if (mixer_period > FMICE_RDS_DEC_MAX_MIXER)
+        throw std::runtime_error("RDS decoder can't mix down at this sample rate.");
+    if (mixer_table != 0)
+        volk_free(mixer_table);
+    mixer_table = (dsp::complex_t*)volk_malloc(sizeof(dsp::complex_t) * mixer_period, volk_get_alignment());
+    if (mixer_table == 0)
+        throw std::runtime_error("Failed to allocate RDS decoder mixer.");
+    for (int i = 0; i < mixer_period; i++) {
+        double phase = -2 * M_PI * 57000.0 * i / sampleRate;
+        mixer_table[i] = { (float)cos(phase), (float)sin(phase) };
+    }
+    mixer_pos = 0;
+
+    //Init decimator, which also removes everything but the RDS band
+    decim.init(sampleRate, FMICE_RDS_DEC_SAMP_RATE, 2400, 200);
+    decim.print_plan("rds decoder");
 
     //Init AGC
     agc.init(NULL, 1.0, 1e6, 0.1);
@@ -36,31 +61,42 @@ void fmice_rds_dec::configure(int sampleRate) {
     costas.out.setBufferSize(buffer_size);
 
     //Init filter
-    taps = dsp::taps::bandPass<dsp::complex_t>(0, 2375, 100, 5000);
+    taps = dsp::taps::bandPass<dsp::complex_t>(0, 2375, 100, FMICE_RDS_DEC_SAMP_RATE);
     fir.init(NULL, taps);
     fir.out.setBufferSize(buffer_size);
 
     //Init second costas loop
-    double baudfreq = dsp::math::hzToRads(2375.0 / 2.0, 5000);
+    double baudfreq = dsp::math::hzToRads(2375.0 / 2.0, FMICE_RDS_DEC_SAMP_RATE);
     costas2.init(NULL, 0.01, 0.0, baudfreq, baudfreq - (baudfreq * 0.1), baudfreq + (baudfreq * 0.1));
     costas2.out.setBufferSize(buffer_size);
 
     //Init clock recovery
-    recov.init(NULL, 5000.0 / (2375.0 / 2.0), 1e-6, 0.01, 0.01);
+    recov.init(NULL, FMICE_RDS_DEC_SAMP_RATE / (2375.0 / 2.0), 1e-6, 0.01, 0.01);
     recov.out.setBufferSize(buffer_size);
 }
 
+void fmice_rds_dec::mix(const float* mpx, int count) {
+    //Multiply by the table, a period at a time
+    int offset = 0;
+    while (offset < count) {
+        int n = std::min(count - offset, mixer_period - mixer_pos);
+        volk_32fc_32f_multiply_32fc((lv_32fc_t*)&mixer_buffer[offset], (const lv_32fc_t*)&mixer_table[mixer_pos], &mpx[offset], n);
+        offset += n;
+        mixer_pos = (mixer_pos + n) % mixer_period;
+    }
+}
+
 int fmice_rds_dec::process(const float* mpx, uint8_t* bitsOut, int count) {
-    //Convert MPX to complex
-    rtoc.process(count, mpx, rtoc.out.writeBuf);
+    //Sanity check
+    assert(count <= buffer_size);
 
     //Translate to 0Hz
-    xlator.process(count, rtoc.out.writeBuf, rtoc.out.writeBuf);
+    mix(mpx, count);
 
-    //Resample to the output samplerate
-    count = rds_resamp.process(count, rtoc.out.writeBuf, rds_resamp.out.writeBuf);
+    //Decimate to the decoder rate
+    count = decim.process(count, mixer_buffer, decim.out.writeBuf);
 
-    count = agc.process(count, rds_resamp.out.writeBuf, costas.out.readBuf);
+    count = agc.process(count, decim.out.writeBuf, costas.out.readBuf);
     count = costas.process(count, costas.out.readBuf, costas.out.writeBuf);
     count = fir.process(count, costas.out.writeBuf, costas.out.writeBuf);
     count = costas2.process(count, costas.out.writeBuf, costas.out.readBuf);
@@ -69,4 +105,4 @@ int fmice_rds_dec::process(const float* mpx, uint8_t* bitsOut, int count) {
     count = dsp::digital::BinarySlicer::process(count, recov.out.writeBuf, bitsOut);
 
     return count;
-}
\ No newline at end of file
+}
@@ -1,15 +1,20 @@
 #pragma once
 
-#include <dsp/convert/real_to_complex.h>
-#include <dsp/channel/frequency_xlator.h>
-#include <dsp/multirate/rational_resampler.h>
 #include <dsp/loop/fast_agc.h>
 #include <dsp/loop/costas.h>
 #include <dsp/taps/tap.h>
 #include <dsp/filter/fir.h>
 #include <dsp/clock_recovery/mm.h>
 #include <dsp/digital/differential_decoder.h>
+#include "../decimator.h"
 
+#define FMICE_RDS_DEC_SAMP_RATE 5000 // Rate the AGC, Costas loops and clock recovery run at
+#define FMICE_RDS_DEC_MAX_MIXER 65536 // Longest 57 kHz period the mixer table may take, in samples
+
+/// <summary>
+/// RDS decoder. The real composite is mixed down by 57 kHz from a table and then decimated straight down to 5 kHz by a
+/// fmice_decimator, so only the mixer and the first cheap half-band stage see the full input rate. Everything else runs at 5 kHz.
+/// </summary>
 class fmice_rds_dec {
 
 public:
@@ -22,9 +27,12 @@ public:
 private:
 	int buffer_size;
 
-	dsp::convert::RealToComplex rtoc;
-	dsp::channel::FrequencyXlator xlator;
-	dsp::multirate::RationalResampler<dsp::complex_t> rds_resamp;
+	dsp::complex_t* mixer_table; // One period of e^(-j * 2 * pi * 57000 * n / sampleRate)
+	int mixer_period;
+	int mixer_pos;
+	dsp::complex_t* mixer_buffer;
+
+	fmice_decimator decim;
 	dsp::loop::FastAGC<dsp::complex_t> agc;
 	dsp::loop::Costas<2> costas;
 	dsp::tap<dsp::complex_t> taps;
@@ -32,4 +40,9 @@ private:
 	dsp::loop::Costas<2> costas2;
 	dsp::clock_recovery::MM<float> recov;
 
-};
\ No newline at end of file
+	/// <summary>
+	/// Mixes the real input down by 57 kHz into the mixer buffer.
+	/// </summary>
+	void mix(const float* mpx, int count);
+
+};
@@ -1,4 +1,5 @@
 #include "rds_enc.h"
+#include "../util.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -7,126 +8,75 @@
 #include <cassert>
 #include <stdexcept>
 
+#define RDS_BIT_TIME (2.0 / FMICE_RDS_BAUD_X2)
+
 // adapted version of https://github.com/ChristopheJacquet/Pydemod/blob/master/src/pydemod/filters/shaping.py
 // which is itself a version of https://github.com/veeresht/CommPy/blob/master/commpy/filters.py
-static float* rrcos_filter(int n, double alpha, double Ts, double Fs) {
-	float* h_rrc = (float*)malloc(sizeof(float) * n);
-	assert(h_rrc != 0);
-	double T_delta = 1.0f / Fs;
-	double t;
-	for (int x = 0; x < n; x++) {
-		t = ((double)x - (double)n / 2.0) * T_delta;
-		if (t == 0.0)
-			h_rrc[x] = 1.0 - alpha + (4 * alpha / M_PI);
-		else if (alpha != 0 && t == Ts / (4 * alpha))
-			h_rrc[x] = (alpha / sqrt(2.0)) * (((1.0 + 2.0 / M_PI) * (sin(M_PI / (4.0 * alpha)))) + ((1.0 - 2.0 / M_PI) * (cos(M_PI / (4.0 * alpha)))));
-		else if (alpha != 0 && t == -Ts / (4 * alpha))
-			h_rrc[x] = (alpha / sqrt(2.0)) * (((1.0 + 2.0 / M_PI) * (sin(M_PI / (4.0 * alpha)))) + ((1.0 - 2.0 / M_PI) * (cos(M_PI / (4.0 * alpha)))));
-		else
-			h_rrc[x] = (sin(M_PI * t * (1.0 - alpha) / Ts) + 4.0 * alpha * (t / Ts) * cos(M_PI * t * (1 + alpha) / Ts)) / (M_PI * t * (1 - (4.0 * alpha * t / Ts) * (4.0 * alpha * t / Ts)) / Ts);
-	}
-	return h_rrc;
-}
-
-#define MIN(X, Y) (((X) < (Y)) ? (X) : (Y))
-#define MAX(X, Y) (((X) < (Y)) ? (Y) : (X))
-
-// copied from https://lloydrochester.com/post/c/convolution/ because I am not a math major
-static float* convolve(float h[], float x[], int lenH, int lenX, int* lenY)
-{
-	int nconv = lenH + lenX - 1;
-	(*lenY) = nconv;
-	int i, j, h_start, x_start, x_end;
-
-	float* y = (float*)calloc(nconv, sizeof(float));
-
-	for (i = 0; i < nconv; i++)
-	{
-		x_start = MAX(0, i - lenH + 1);
-		x_end = MIN(i + 1, lenX);
-		h_start = MIN(i, lenH - 1);
-		for (j = x_start; j < x_end; j++)
-		{
-			assert(h_start >= 0 && h_start < lenH);
-			assert(j >= 0 && j < lenX);
-			y[i] += h[h_start--] * x[j];
-		}
-	}
-	return y;
+// Evaluated at any time rather than sampled into a filter, so the waveform can be built at any rate
+static double rrcos(double t, double alpha, double Ts) {
+	//The special cases are exact points, but t is computed in floating point here
+	double eps = Ts * 1e-9;
+	if (fabs(t) < eps)
+		return 1.0 - alpha + (4 * alpha / M_PI);
+	else if (alpha != 0 && fabs(fabs(t) - (Ts / (4 * alpha))) < eps)
+		return (alpha / sqrt(2.0)) * (((1.0 + 2.0 / M_PI) * (sin(M_PI / (4.0 * alpha)))) + ((1.0 - 2.0 / M_PI) * (cos(M_PI / (4.0 * alpha)))));
+	else
+		return (sin(M_PI * t * (1.0 - alpha) / Ts) + 4.0 * alpha * (t / Ts) * cos(M_PI * t * (1 + alpha) / Ts)) / (M_PI * t * (1 - (4.0 * alpha * t / Ts) * (4.0 * alpha * t / Ts)) / Ts);
 }
 
 // derived from https://github.com/Anthony96922/mpxgen/blob/pthread/src/generate_waveforms.py
-static float* generate_waveform(int sample_rate, int* lenOut) {
-	//Check if the sample rate is a multiple of the baud rate
-	//Otherwise, we get clock drift. I'm sure there are ways around it but for now this is an easier fix
-	if ((sample_rate * 2) % 2375 != 0)
-		throw std::runtime_error("Sample rate must be a multiple of RDS baud rate.");
-
-	int count = 7;
-	int l = (int)(sample_rate / 1187.5) / 2;
-
-	//Set up sample - Really inefficent...
-	float* sample = (float*)calloc(sizeof(float), count * l);
-	assert(sample != 0);
-	sample[l] = 1;
-	sample[2 * l] = -1;
-
-	//Set up root raised cosine filter - same as pulse_shaping_filter line
-	int cosFilterLen = l * 16;
-	float* sf = rrcos_filter(cosFilterLen, 1, 1.0 / (2.0 * 1187.5), sample_rate);
-
-	//Convolve
-	int shapedSamplesLen = 0;
-	float* shapedSamples = convolve(sample, sf, count * l, cosFilterLen, &shapedSamplesLen);
-
-	//Derive offset from the length of the shaped samples. This is a modification made to the original code
-	//I honestly don't know where it comes from. I'm just going to use the same fraction of the original offset (760) divided by the original length of the shaped samples (1839)
-	int offset = (int)(shapedSamplesLen * 0.41326808) + 1;
-
-	//Extract what is needed
-	int start = offset - l * count;
-	int end = offset + l * count;
-	int len = end - start;
-	assert(start > 0 && start < shapedSamplesLen);
-	assert(end > 0 && end < shapedSamplesLen);
-
-	//Copy + Scale as to not clip
-	float* out = (float*)malloc(sizeof(float) * len);
-	assert(out != 0);
-	for (int i = 0; i < len; i++)
-		out[i] = shapedSamples[start + i] / 2.5f;
-
-	//Free buffers
-	free(sample);
-	free(sf);
-	free(shapedSamples);
-
-	*lenOut = len;
-	return out;
+// The biphase symbol (+1 then -1 half a bit later) shaped by a root raised cosine, spanning FMICE_RDS_WAVEFORM_BITS bits and centered in them.
+// This is the same waveform the encoder used to convolve at 190 kHz, where it came out at 3.25 and 3.75 bits in, scaled down so it doesn't clip.
+static double biphase_waveform(double t) {
+	if (t < 0 || t >= FMICE_RDS_WAVEFORM_BITS * RDS_BIT_TIME)
+		return 0;
+	double Ts = RDS_BIT_TIME / 2;
+	return (rrcos(t - (3.25 * RDS_BIT_TIME), 1, Ts) - rrcos(t - (3.75 * RDS_BIT_TIME), 1, Ts)) / 2.5;
 }
 
-fmice_rds_enc::fmice_rds_enc(int sampleRate) {
-	//Generate the waveform
-	filter_size = 0;
-	waveform[0] = generate_waveform(sampleRate, &filter_size);
-
-	//Calculate sizes
-	samples_per_bit = filter_size / 7;
-	bits_per_filter = filter_size / samples_per_bit;
-
-	//Allocate and generate an inverted form of the generated waveform
-	waveform[1] = (float*)malloc(sizeof(float) * filter_size);
-	assert(waveform[1] != 0);
-	for (int i = 0; i < filter_size; i++)
-		waveform[1][i] = -waveform[0][i];
-
-	//Calculate sizes of buffer
-	working_buffer_bits = bits_per_filter + 1;
-	working_buffer_size = working_buffer_bits * samples_per_bit;
+fmice_rds_enc::fmice_rds_enc(int sampleRate, float scale) {
+	//The bit period is sampleRate * 2 / 2375 samples - Reduced, that's period samples for every phases bits
+	int div = fmice_gcd(sampleRate * 2, FMICE_RDS_BAUD_X2);
+	period = (sampleRate * 2) / div;
+	phases = FMICE_RDS_BAUD_X2 / div;
+	if (period > FMICE_RDS_MAX_PERIOD)
+		throw std::runtime_error("RDS bit timing doesn't repeat often enough at this sample rate.");
+
+	//Find where each bit starts - Each gets the samples at or after its start time, up to the next one
+	phase_start = (int*)malloc(sizeof(int) * (phases + 1));
+	phase_len = (int*)malloc(sizeof(int) * phases);
+	assert(phase_start != 0 && phase_len != 0);
+	for (int i = 0; i <= phases; i++)
+		phase_start[i] = (int)(((int64_t)i * period + phases - 1) / phases);
+	max_samples_per_bit = 0;
+	for (int i = 0; i < phases; i++) {
+		phase_len[i] = phase_start[i + 1] - phase_start[i];
+		if (phase_len[i] > max_samples_per_bit)
+			max_samples_per_bit = phase_len[i];
+	}
 
-	//Allocate working buffer and clear
-	working_buffer = (float*)malloc(sizeof(float) * working_buffer_size);
-	assert(working_buffer != 0);
+	//Build the table - Only histories with the newest bit as 0 are kept, as the others are the same negated
+	table = (float*)malloc(sizeof(float) * FMICE_RDS_HISTORIES * period);
+	assert(table != 0);
+	for (int h = 0; h < FMICE_RDS_HISTORIES; h++) {
+		int bits = h << 1;
+		for (int p = 0; p < phases; p++) {
+			for (int i = 0; i < phase_len[p]; i++) {
+				//Time since the start of this bit
+				int n = phase_start[p] + i;
+				double t = (((double)n * phases) - ((double)p * period)) / ((double)phases * sampleRate);
+
+				//Add up the tails of the bits before it, a 0 being the waveform and a 1 being it inverted
+				double value = 0;
+				for (int b = 0; b < FMICE_RDS_WAVEFORM_BITS; b++)
+					value += (((bits >> b) & 1) ? -1 : 1) * biphase_waveform(t + (b * RDS_BIT_TIME));
+
+				//Mix onto the carrier, which is at the same phase at the start of every bit
+				table[(h * period) + n] = (float)(value * sin(2 * M_PI * FMICE_RDS_CARRIER * t) * scale);
+			}
+		}
+	}
+	printf("RDS modulator table: %i samples per %i bits, %i kB\n", period, phases, (int)((sizeof(float) * FMICE_RDS_HISTORIES * period) / 1024));
 
 	//Reset to re-initialize
 	reset();
@@ -134,44 +84,40 @@ fmice_rds_enc::fmice_rds_enc(int sampleRate) {
 
 fmice_rds_enc::~fmice_rds_enc() {
 	//Free buffers
-	for (int i = 0; i < 2; i++)
-		free(waveform[i]);
-	free(working_buffer);
+	free(table);
+	free(phase_start);
+	free(phase_len);
 }
 
 void fmice_rds_enc::reset() {
-	//Clear working buffer
-	for (int i = 0; i < working_buffer_size; i++)
-		working_buffer[i] = 0;
-
-	//Reset state
-	current_bit = 0;
+	history = 0;
+	phase = 0;
 }
 
-int fmice_rds_enc::get_samples_per_bit() {
-	return samples_per_bit;
+int fmice_rds_enc::get_max_samples_per_bit() {
+	return max_samples_per_bit;
 }
 
-void fmice_rds_enc::push(uint8_t bit, float* output, int outputSize) {
-	//Sanity check
-	assert(outputSize == samples_per_bit);
-
-	//Calculate the block to write within the working buffer
-	int writeOffset = current_bit * samples_per_bit;
-	for (int i = 0; i < filter_size; i++)
-		working_buffer[(writeOffset + i) % working_buffer_size] += waveform[bit][i];
+int fmice_rds_enc::push(uint8_t bit, float* output) {
+	//Add to the history
+	history = ((history << 1) | (bit & 1)) & ((1 << FMICE_RDS_WAVEFORM_BITS) - 1);
 
-	//Determine block to read - It is the one right before the one we just wrote
-	int readBit = (current_bit + (working_buffer_bits - 1)) % working_buffer_bits;
-	int readOffset = readBit * samples_per_bit;
+	//Look up the block, flipping it if the newest bit is a 1
+	float sign = 1;
+	int row = history >> 1;
+	if (history & 1) {
+		sign = -1;
+		row = (~history & ((1 << FMICE_RDS_WAVEFORM_BITS) - 1)) >> 1;
+	}
+	const float* block = &table[(row * period) + phase_start[phase]];
 
-	//Copy this block to the output
-	memcpy(output, &working_buffer[readOffset], sizeof(float) * samples_per_bit);
+	//Copy out
+	int count = phase_len[phase];
+	for (int i = 0; i < count; i++)
+		output[i] = block[i] * sign;
 
-	//Zero it out for next cycle - We don't need to check for overflows because the working buffer is always a multiple of the block size
-	for (int i = 0; i < samples_per_bit; i++)
-		working_buffer[readOffset + i] = 0;
+	//Advance
+	phase = (phase + 1) % phases;
 
-	//Update offset
-	current_bit = (current_bit + 1) % working_buffer_bits;
-}
\ No newline at end of file
+	return count;
+}
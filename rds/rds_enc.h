@@ -2,10 +2,28 @@
 
 #include <stdint.h>
 
+#define FMICE_RDS_BAUD_X2 2375 // Twice the 1187.5 baud rate, so the bit timing can be worked out in integers
+#define FMICE_RDS_CARRIER 57000 // Exactly 48 cycles per bit, so every bit starts at the same carrier phase
+#define FMICE_RDS_WAVEFORM_BITS 7 // Each bit's shaped waveform spans this many bit periods
+#define FMICE_RDS_HISTORIES (1 << (FMICE_RDS_WAVEFORM_BITS - 1)) // Bit histories in the table - The other half are the same with the sign flipped
+#define FMICE_RDS_MAX_PERIOD 16384 // Longest run of output samples before the bit timing repeats, which sets the table size
+
+/// <summary>
+/// RDS modulator. Each output sample only depends on the last 7 bits and on where it falls within its bit period, and since the bit rate and
+/// sample rate are both fixed, there are only so many of those. All of them are worked out up front at the output rate, with the scale and the
+/// 57 kHz carrier applied, so modulating a bit is just copying a block out of the table.
+/// The carrier is sin(2 * pi * 57000 * n / sampleRate) counting from the first sample ever pushed, the same as the third harmonic of a
+/// fmice_nco_bank at 19 kHz started at the same time, so the two stay locked as long as both see every sample.
+/// </summary>
 class fmice_rds_enc {
 
 public:
-	fmice_rds_enc(int sampleRate);
+	/// <summary>
+	/// Builds the table.
+	/// </summary>
+	/// <param name="sampleRate">Output sample rate. The bit timing must repeat within FMICE_RDS_MAX_PERIOD samples.</param>
+	/// <param name="scale">Level to generate at.</param>
+	fmice_rds_enc(int sampleRate, float scale);
 	~fmice_rds_enc();
 
 	/// <summary>
@@ -14,29 +32,27 @@ public:
 	void reset();
 
 	/// <summary>
-	/// Gets the number of bits output by each sample. This will never change once this class is created.
+	/// Gets the most samples a single bit can produce. Bits alternate between this and one less when the sample rate isn't a multiple of the baud rate.
 	/// </summary>
-	/// <returns></returns>
-	int get_samples_per_bit();
+	int get_max_samples_per_bit();
 
 	/// <summary>
-	/// Processes a bit and outputs the resulting waveform. Output size MUST equal the constant returned by get_samples_per_bit. OutputSize is only checked for sanity.
+	/// Processes a bit and outputs the modulated waveform for its bit period.
 	/// </summary>
 	/// <param name="bit">The bit to push.</param>
-	/// <param name="output">The output to set to the waveform.</param>
-	/// <param name="outputSize">The length of the output array. Just checked for sanity.</param>
-	void push(uint8_t bit, float* output, int outputSize);
+	/// <param name="output">The output to set to the waveform. Must hold get_max_samples_per_bit samples.</param>
+	/// <returns>Number of samples written.</returns>
+	int push(uint8_t bit, float* output);
 
 private:
-	int filter_size;
-	int samples_per_bit;
-	int bits_per_filter;
-	float* waveform[2];
-
-	float* working_buffer;
-	int working_buffer_bits; // bits_per_filter + 1
-	int working_buffer_size; // working_buffer_bits * samples_per_bit
+	int phases; // Bits before the timing repeats
+	int period; // Samples before the timing repeats
+	int* phase_start; // Where each bit of the repeat starts within the period
+	int* phase_len;
+	int max_samples_per_bit;
+	float* table; // FMICE_RDS_HISTORIES rows of period samples each
 
-	int current_bit; // Current bit about to be written in the working buffer
+	int history; // Last FMICE_RDS_WAVEFORM_BITS bits, newest in the lowest bit
+	int phase; // Bit of the repeat being output
 
-};
\ No newline at end of file
+};
@@ -0,0 +1,204 @@
+#include "rds_sync.h"
+
+#include <string.h>
+
+#define RDS_POLY 0x5B9 // x^10 + x^8 + x^7 + x^5 + x^4 + x^3 + 1
+#define RDS_BLOCK_MASK ((1 << FMICE_RDS_BLOCK_BITS) - 1)
+
+// Offset words added to each block's checkword, which is what marks where blocks are and which is which
+static const uint16_t RDS_OFFSETS[FMICE_RDS_OFFSET_COUNT] = { 0x0FC, 0x198, 0x168, 0x350, 0x1B4 };
+static const int RDS_OFFSET_POS[FMICE_RDS_OFFSET_COUNT] = { 0, 1, 2, 2, 3 };
+
+// Remainder of a block divided by the generator polynomial. A good block leaves exactly its offset word.
+static uint16_t syndrome(uint32_t block) {
+	for (int i = FMICE_RDS_BLOCK_BITS - 1; i >= 10; i--) {
+		if (block & (1u << i))
+			block ^= (uint32_t)RDS_POLY << (i - 10);
+	}
+	return (uint16_t)block;
+}
+
+fmice_rds_sync::fmice_rds_sync() {
+	//Build the correction table from every burst up to the max length at every position - The first and last bits of a burst are always set
+	memset(corrections, 0, sizeof(corrections));
+	for (uint32_t burst = 1; burst < (1u << FMICE_RDS_MAX_BURST); burst += 2) {
+		for (int shift = 0; (burst << shift) <= RDS_BLOCK_MASK; shift++) {
+			uint32_t error = burst << shift;
+			uint16_t s = syndrome(error);
+			if (corrections[s] == 0)
+				corrections[s] = error;
+		}
+	}
+
+	//Reset to initialize
+	reset();
+}
+
+void fmice_rds_sync::reset() {
+	last_bit = 0;
+	shift = 0;
+	bit_count = 0;
+	for (int i = 0; i < 4; i++)
+		found_at[i] = -1;
+	unsynced_bits = 0;
+	synced = false;
+	expected = 0;
+	block_bits = 0;
+	bad_in_row = 0;
+	group_good = 0;
+	group_corrected = 0;
+	memset(&group, 0, sizeof(group));
+	memset(bler_history, 0, sizeof(bler_history));
+	bler_pos = 0;
+	bler_count = 0;
+	corrected_blocks = 0;
+}
+
+bool fmice_rds_sync::has_sync() {
+	return synced;
+}
+
+float fmice_rds_sync::get_bler() {
+	return (bler_count * 100.0f) / FMICE_RDS_BLER_WINDOW;
+}
+
+int64_t fmice_rds_sync::get_corrected_blocks() {
+	return corrected_blocks;
+}
+
+void fmice_rds_sync::count_block(bool error) {
+	bler_count += (error ? 1 : 0) - bler_history[bler_pos];
+	bler_history[bler_pos] = error ? 1 : 0;
+	bler_pos = (bler_pos + 1) % FMICE_RDS_BLER_WINDOW;
+}
+
+int fmice_rds_sync::process(const uint8_t* bits, int count, fmice_rds_group* groupsOut) {
+	int groups = 0;
+	for (int i = 0; i < count; i++) {
+		//Differentially decode, which also takes care of the decoder locking upside down
+		uint8_t bit = bits[i] & 1;
+		shift = ((shift << 1) | (bit ^ last_bit)) & RDS_BLOCK_MASK;
+		last_bit = bit;
+		bit_count++;
+
+		if (synced) {
+			//Check each block as it completes
+			if (++block_bits == FMICE_RDS_BLOCK_BITS) {
+				block_bits = 0;
+				if (process_block(shift, &groupsOut[groups]))
+					groups++;
+			}
+		}
+		else {
+			//Count time out of sync as errors
+			if (++unsynced_bits == FMICE_RDS_BLOCK_BITS) {
+				unsynced_bits = 0;
+				count_block(true);
+			}
+
+			//Look for sync, handling the block it was found on like any other
+			if (bit_count >= FMICE_RDS_BLOCK_BITS) {
+				search();
+				if (synced && process_block(shift, &groupsOut[groups]))
+					groups++;
+			}
+		}
+	}
+	return groups;
+}
+
+void fmice_rds_sync::search() {
+	//Check if this is the end of a block
+	uint16_t s = syndrome(shift);
+	int pos = -1;
+	for (int i = 0; i < FMICE_RDS_OFFSET_COUNT; i++) {
+		if (s == RDS_OFFSETS[i])
+			pos = RDS_OFFSET_POS[i];
+	}
+	if (pos == -1)
+		return;
+
+	//Sync if another was found a whole number of blocks ago that's in the right place in the sequence
+	for (int i = 0; i < 4; i++) {
+		int64_t distance = bit_count - found_at[i];
+		if (found_at[i] == -1 || distance % FMICE_RDS_BLOCK_BITS != 0 || distance > FMICE_RDS_SYNC_SEARCH * FMICE_RDS_BLOCK_BITS)
+			continue;
+		if ((i + (distance / FMICE_RDS_BLOCK_BITS)) % 4 == pos) {
+			synced = true;
+			expected = pos;
+			block_bits = 0;
+			bad_in_row = 0;
+			group_good = 0;
+			group_corrected = 0;
+			return;
+		}
+	}
+	found_at[pos] = bit_count;
+}
+
+bool fmice_rds_sync::process_block(uint32_t block, fmice_rds_group* output) {
+	//Check against the offsets that can be here, then try correcting against them
+	uint16_t s = syndrome(block);
+	int offset = -1;
+	bool corrected = false;
+	for (int i = 0; i < FMICE_RDS_OFFSET_COUNT && offset == -1; i++) {
+		if (RDS_OFFSET_POS[i] == expected && s == RDS_OFFSETS[i])
+			offset = i;
+	}
+	for (int i = 0; i < FMICE_RDS_OFFSET_COUNT && offset == -1; i++) {
+		uint32_t error = corrections[s ^ RDS_OFFSETS[i]];
+		if (RDS_OFFSET_POS[i] == expected && error != 0) {
+			block ^= error;
+			offset = i;
+			corrected = true;
+			corrected_blocks++;
+		}
+	}
+	count_block(offset == -1);
+
+	//Store into the group
+	int pos = expected;
+	if (pos == 0) {
+		group_good = 0;
+		group_corrected = 0;
+	}
+	if (offset != -1) {
+		group.blocks[pos] = (uint16_t)(block >> 10);
+		if (pos == 2)
+			group.c_prime = offset == FMICE_RDS_OFFSET_CP;
+		group_good |= 1 << pos;
+		group_corrected += corrected ? 1 : 0;
+	}
+
+	//Corrections don't count towards keeping sync - After a slip, random blocks look like correctable bursts surprisingly often
+	bad_in_row = (offset != -1 && !corrected) ? 0 : bad_in_row + 1;
+	if (bad_in_row >= FMICE_RDS_SYNC_LOSS) {
+		//Lost it, most likely to a bit slip in the decoder - Start searching again
+		synced = false;
+		unsynced_bits = 0;
+		for (int i = 0; i < 4; i++)
+			found_at[i] = -1;
+		return false;
+	}
+
+	//Move on, outputting the group if it's complete and not too much of it was guessed at
+	expected = (pos + 1) % 4;
+	if (pos == 3 && group_good == 0xF && group_corrected <= FMICE_RDS_MAX_CORRECTED) {
+		*output = group;
+		return true;
+	}
+	return false;
+}
+
+void fmice_rds_sync::encode(const fmice_rds_group* group, uint8_t* bitsOut) {
+	for (int b = 0; b < 4; b++) {
+		//Make the block with its checkword
+		int offset = b == 2 ? (group->c_prime ? FMICE_RDS_OFFSET_CP : FMICE_RDS_OFFSET_C) : (b == 3 ? FMICE_RDS_OFFSET_D : b);
+		uint32_t block = (uint32_t)group->blocks[b] << 10;
+		block |= syndrome(block) ^ RDS_OFFSETS[offset];
+
+		//Write out, most significant bit first
+		for (int i = 0; i < FMICE_RDS_BLOCK_BITS; i++)
+			bitsOut[(b * FMICE_RDS_BLOCK_BITS) + i] = (block >> (FMICE_RDS_BLOCK_BITS - 1 - i)) & 1;
+	}
+}
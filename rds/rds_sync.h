@@ -0,0 +1,115 @@
+#pragma once
+
+#include <stdint.h>
+
+#define FMICE_RDS_BLOCK_BITS 26 // 16 information bits followed by a 10 bit checkword
+#define FMICE_RDS_GROUP_BITS 104 // Four blocks
+#define FMICE_RDS_MAX_BURST 5 // Longest burst of errors a block can be corrected for
+#define FMICE_RDS_MAX_CORRECTED 1 // Corrected blocks a group can have and still be output, as miscorrections aren't rare
+#define FMICE_RDS_SYNC_SEARCH 6 // Blocks apart two offset words can be found and still be used to sync
+#define FMICE_RDS_SYNC_LOSS 8 // Blocks in a row that needed correcting or couldn't be before sync is dropped, as happens on a bit slip
+#define FMICE_RDS_BLER_WINDOW 100 // Blocks the block error rate is measured over, about 2 seconds
+
+#define FMICE_RDS_OFFSET_A 0
+#define FMICE_RDS_OFFSET_B 1
+#define FMICE_RDS_OFFSET_C 2
+#define FMICE_RDS_OFFSET_CP 3
+#define FMICE_RDS_OFFSET_D 4
+#define FMICE_RDS_OFFSET_COUNT 5
+
+/// <summary>
+/// A group's information words, after checking and correction.
+/// </summary>
+struct fmice_rds_group {
+
+	uint16_t blocks[4];
+	bool c_prime; // The third block was sent with offset C' (a version B group)
+
+};
+
+/// <summary>
+/// RDS block synchronizer. Takes the sliced bits from the decoder, which are still differentially encoded and may be inverted, and finds block
+/// boundaries by the offset words in their checkwords. Two offset words a whole number of blocks apart and in the right order give sync. Once synced,
+/// each block is checked against the offset expected next and bursts of up to FMICE_RDS_MAX_BURST errors are corrected. Only groups with all four
+/// blocks good and no more than FMICE_RDS_MAX_CORRECTED of them corrected are output.
+/// </summary>
+class fmice_rds_sync {
+
+public:
+	fmice_rds_sync();
+
+	/// <summary>
+	/// Drops sync and clears the state.
+	/// </summary>
+	void reset();
+
+	/// <summary>
+	/// Processes bits from the decoder.
+	/// </summary>
+	/// <param name="bits">Sliced bits, one per byte.</param>
+	/// <param name="count">Number of bits.</param>
+	/// <param name="groupsOut">Groups completed. Must hold (count / FMICE_RDS_GROUP_BITS) + 1.</param>
+	/// <returns>Number of groups completed.</returns>
+	int process(const uint8_t* bits, int count, fmice_rds_group* groupsOut);
+
+	bool has_sync();
+
+	/// <summary>
+	/// Gets the percentage of the last FMICE_RDS_BLER_WINDOW blocks that couldn't be corrected. Block periods spent out of sync count as errors.
+	/// </summary>
+	float get_bler();
+
+	/// <summary>
+	/// Gets the total blocks that had errors corrected.
+	/// </summary>
+	int64_t get_corrected_blocks();
+
+	/// <summary>
+	/// Builds the 104 bits of a group with checkwords, before differential encoding.
+	/// </summary>
+	/// <param name="group">The group to encode.</param>
+	/// <param name="bitsOut">Output bits, one per byte.</param>
+	static void encode(const fmice_rds_group* group, uint8_t* bitsOut);
+
+private:
+	uint32_t corrections[1 << 10]; // Error pattern for each syndrome, or 0 if it isn't a correctable burst
+
+	uint8_t last_bit; // For differential decoding
+	uint32_t shift; // Last FMICE_RDS_BLOCK_BITS bits
+	int64_t bit_count;
+
+	// Searching
+	int64_t found_at[4]; // Bit count each block position's offset word was last seen at, or -1
+	int unsynced_bits; // Bits since the last block period was counted against the error rate
+
+	// Synced
+	bool synced;
+	int expected; // Block position expected next
+	int block_bits; // Bits into the current block
+	int bad_in_row;
+	fmice_rds_group group; // Being assembled
+	int group_good; // Bitmask of good blocks in the group being assembled
+	int group_corrected; // Blocks in the group being assembled that were corrected
+
+	// Stats
+	uint8_t bler_history[FMICE_RDS_BLER_WINDOW];
+	int bler_pos;
+	int bler_count; // Errors in the history
+	int64_t corrected_blocks;
+
+	/// <summary>
+	/// Handles a block at the expected position once synced. Returns true if a group was completed into output.
+	/// </summary>
+	bool process_block(uint32_t block, fmice_rds_group* output);
+
+	/// <summary>
+	/// Adds a block to the error rate history.
+	/// </summary>
+	void count_block(bool error);
+
+	/// <summary>
+	/// Looks for sync at the current bit.
+	/// </summary>
+	void search();
+
+};
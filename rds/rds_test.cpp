@@ -20,12 +20,24 @@
 
 
 
-int main() {
+int main(int argc, char* argv[]) {
+	//Check args
+	if (argc != 3) {
+		printf("Usage: %s [input 32-bit float MPX file] [output 32-bit float file]\n", argv[0]);
+		return -1;
+	}
+
 	//Open input and output files
-	FILE* fileInput = fopen("/media/sf_VMShare/composite_in_2.bin", "rb");
-	assert(fileInput != nullptr);
-	FILE* fileOutput = fopen("/media/sf_VMShare/rds_out.bin", "wb");
-	assert(fileOutput != nullptr);
+	FILE* fileInput = fopen(argv[1], "rb");
+	if (fileInput == nullptr) {
+		printf("Failed to open input file \"%s\".\n", argv[1]);
+		return -1;
+	}
+	FILE* fileOutput = fopen(argv[2], "wb");
+	if (fileOutput == nullptr) {
+		printf("Failed to open output file \"%s\".\n", argv[2]);
+		return -1;
+	}
 
 	//Allocate buffers
 	float* inputBuffer = (float*)volk_malloc(sizeof(float) * RADIO_BUFFER_SIZE, volk_get_alignment());
@@ -0,0 +1,399 @@
+#include "recorder.h"
+#include "defines.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdexcept>
+#include <cassert>
+#include <algorithm>
+
+static const char* RECORDER_IO_NAMES[4] = {
+    "idle",
+    "direct",
+    "buffered",
+    "error"
+};
+
+fmice_recorder::fmice_recorder(int channels, int sampleRate, fmice_codec* codec, const char* extension) :
+    channels(channels),
+    sample_rate(sampleRate),
+    codec(codec),
+    rotate_interval(FMICE_RECORDER_DEFAULT_ROTATE),
+    rotate_size(0),
+    realtime(true),
+    stat_bytes_written(0),
+    stat_dropped_samples(0),
+    stat_dropped_bytes(0),
+    stat_io(FMICE_RECORDER_IO_IDLE),
+    input_buffer(FMICE_BLOCK_SIZE * FMICE_BLOCK_COUNT),
+    free_chunks(FMICE_RECORDER_CHUNK_COUNT),
+    full_chunks(FMICE_RECORDER_CHUNK_COUNT),
+    current(NULL),
+    codec_error(false),
+    pending_new_file(false),
+    file_bytes(0),
+    next_rotate(0),
+    last_rotate(0),
+    rotate_index(0),
+    fd(-1),
+    direct(false)
+{
+    //Set
+    strncpy(this->extension, extension, sizeof(this->extension) - 1);
+    this->extension[sizeof(this->extension) - 1] = 0;
+    memset(path_prefix, 0, sizeof(path_prefix));
+    memset(pending_path, 0, sizeof(pending_path));
+
+    //Allocate chunks, aligned for O_DIRECT
+    for (int i = 0; i < FMICE_RECORDER_CHUNK_COUNT; i++) {
+        void* data = NULL;
+        if (posix_memalign(&data, FMICE_RECORDER_ALIGNMENT, FMICE_RECORDER_CHUNK_SIZE) != 0)
+            throw new std::runtime_error("Failed to allocate recorder chunk.");
+        chunks[i].data = (uint8_t*)data;
+        chunks[i].use = 0;
+        chunks[i].new_file = false;
+        chunks[i].path[0] = 0;
+    }
+}
+
+fmice_recorder::~fmice_recorder() {
+    //Close file
+    file_close();
+
+    //Free chunks
+    for (int i = 0; i < FMICE_RECORDER_CHUNK_COUNT; i++)
+        free(chunks[i].data);
+
+    //Destroy codec
+    if (codec != NULL)
+        delete codec;
+}
+
+void fmice_recorder::set_path(const char* prefix) {
+    strncpy(path_prefix, prefix, sizeof(path_prefix) - 1);
+    path_prefix[sizeof(path_prefix) - 1] = 0;
+}
+
+void fmice_recorder::set_rotate_interval(int seconds) {
+    rotate_interval = seconds;
+}
+
+void fmice_recorder::set_rotate_size(int64_t bytes) {
+    rotate_size = bytes;
+}
+
+void fmice_recorder::set_realtime(bool realtime) {
+    this->realtime = realtime;
+}
+
+bool fmice_recorder::is_configured() {
+    return strlen(path_prefix) > 0;
+}
+
+void fmice_recorder::init() {
+    //Sanity check
+    if (!is_configured())
+        throw new std::runtime_error("Recorder is not configured.");
+
+    //Every chunk starts out free
+    for (int i = 0; i < FMICE_RECORDER_CHUNK_COUNT; i++) {
+        fmice_recorder_chunk* chunk = &chunks[i];
+        free_chunks.write(&chunk, 1);
+    }
+
+    //Set up the first file - This also resets the codec so its headers lead the file
+    if (codec != NULL)
+        codec->set_callback(encoder_callback_static, this);
+    rotate(false);
+
+    //Start threads
+    pthread_create(&io_thread, NULL, io_work_static, this);
+    pthread_create(&encode_thread, NULL, encode_work_static, this);
+}
+
+void fmice_recorder::push(float* samples, int count) {
+    //Wait for room if nothing is lost by holding up the radio
+    if (!realtime) {
+        input_buffer.write_all(samples, count);
+        return;
+    }
+
+    //Send to buffer, counting what doesn't fit
+    size_t written = input_buffer.write(samples, count);
+    if (written < count)
+        stat_dropped_samples.fetch_add(count - written, std::memory_order_relaxed);
+}
+
+int fmice_recorder::format_status(char* output, const char* name) {
+    return sprintf(output, "%s_recorder=[io=%s; written_mb=%lli; dropped_samples=%lli; dropped_bytes=%lli]; ",
+        name,
+        RECORDER_IO_NAMES[stat_io.load(std::memory_order_relaxed)],
+        (long long)(stat_bytes_written.load(std::memory_order_relaxed) / (1024 * 1024)),
+        (long long)stat_dropped_samples.load(std::memory_order_relaxed),
+        (long long)stat_dropped_bytes.load(std::memory_order_relaxed)
+    );
+}
+
+void fmice_recorder::stop() {
+    //Mark the end of the input, then wait for the encoder to finish the file and the I/O thread to write it
+    input_buffer.close();
+    pthread_join(encode_thread, NULL);
+    pthread_join(io_thread, NULL);
+}
+
+/* ENCODER */
+
+void* fmice_recorder::encode_work_static(void* ctx) {
+    ((fmice_recorder*)ctx)->encode_work();
+    return 0;
+}
+
+void fmice_recorder::encode_work() {
+    while (1) {
+        //Wait for a block in the input buffer - The codec works on it in place. None comes once stopped and drained.
+        float* block = input_buffer.acquire_read(FMICE_BLOCK_SIZE);
+        if (block == NULL)
+            break;
+        encode_block(block, FMICE_BLOCK_SIZE);
+    }
+
+    //Stopped - Encode the partial block left behind and end the file
+    size_t left = input_buffer.get_use();
+    if (left > 0)
+        encode_block(input_buffer.acquire_read(left), left);
+    if (codec != NULL)
+        codec->finish();
+
+    //Send off the last chunk and let the I/O thread finish up
+    if (current != NULL && current->use > 0)
+        submit();
+    full_chunks.close();
+}
+
+void fmice_recorder::encode_block(float* block, size_t count) {
+    //Start a new file if it's time
+    bool rotating = (next_rotate != 0 && time(NULL) >= next_rotate) || (rotate_size > 0 && file_bytes >= rotate_size);
+
+    //If the disk has every chunk, drop the whole block now rather than part of what it encodes to, which would leave a broken file behind
+    if (realtime && free_chunks.get_use() == 0) {
+        size_t room = (current != NULL && !rotating) ? FMICE_RECORDER_CHUNK_SIZE - current->use : 0;
+        if (room < sizeof(float) * count + FMICE_RECORDER_BLOCK_HEADROOM) {
+            stat_dropped_samples.fetch_add(count, std::memory_order_relaxed);
+            input_buffer.release_read(count);
+            return;
+        }
+    }
+    if (rotating)
+        rotate(true);
+
+    //Encode, or write as-is
+    if (codec != NULL)
+        codec->process(block, count / channels);
+    else
+        append((const uint8_t*)block, sizeof(float) * count);
+
+    //Give the block back
+    input_buffer.release_read(count);
+
+    //On error, start over in a new file so it begins with good headers
+    if (codec_error) {
+        printf("[RECORDER] Codec encountered an error. Starting a new file...\n");
+        rotate(false);
+    }
+}
+
+void fmice_recorder::rotate(bool finish) {
+    //End the current stream so what the codec is still holding, and its last frame, land in the old file
+    if (finish && codec != NULL)
+        codec->finish();
+
+    //Send off the rest of the current file - The I/O thread writes a partial chunk at the end of a file
+    if (current != NULL && current->use > 0)
+        submit();
+
+    //Name the next file after when it starts
+    time_t now = time(NULL);
+    struct tm local;
+    localtime_r(&now, &local);
+    char stamp[32];
+    strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", &local);
+    rotate_index = (now == last_rotate) ? rotate_index + 1 : 0; // Size rotations can come faster than once a second
+    last_rotate = now;
+    if (rotate_index > 0)
+        snprintf(pending_path, sizeof(pending_path), "%s-%s-%i.%s", path_prefix, stamp, rotate_index, extension);
+    else
+        snprintf(pending_path, sizeof(pending_path), "%s-%s.%s", path_prefix, stamp, extension);
+    pending_new_file = true;
+    file_bytes = 0;
+
+    //Rotate on multiples of the interval so hourly files start on the hour
+    next_rotate = rotate_interval > 0 ? (((int64_t)now / rotate_interval) + 1) * rotate_interval : 0;
+
+    //Restart the codec so the new file stands on its own
+    if (codec != NULL) {
+        codec_error = false;
+        codec->reset();
+    }
+}
+
+void fmice_recorder::append(const uint8_t* data, size_t count) {
+    file_bytes += count;
+    while (count > 0) {
+        //Get a chunk to fill - encode_block already made sure one is free in real time, so this only waits when the input can
+        if (current == NULL) {
+            current = *free_chunks.acquire_read(1);
+            free_chunks.release_read(1);
+            current->use = 0;
+            current->new_file = false;
+        }
+
+        //Mark the start of a new file
+        if (pending_new_file) {
+            assert(current->use == 0);
+            current->new_file = true;
+            memcpy(current->path, pending_path, sizeof(current->path));
+            pending_new_file = false;
+        }
+
+        //Fill
+        size_t n = std::min(count, (size_t)FMICE_RECORDER_CHUNK_SIZE - current->use);
+        memcpy(&current->data[current->use], data, n);
+        current->use += n;
+        data += n;
+        count -= n;
+
+        //Hand it off once full
+        if (current->use == FMICE_RECORDER_CHUNK_SIZE)
+            submit();
+    }
+}
+
+void fmice_recorder::submit() {
+    //There are only as many chunks as the queue holds, so this always fits
+    full_chunks.write(&current, 1);
+    current = NULL;
+}
+
+void fmice_recorder::encoder_callback_static(const uint8_t* data, int count, void* context) {
+    fmice_recorder* ctx = (fmice_recorder*)context;
+    if (count < 0)
+        ctx->codec_error = true;
+    else
+        ctx->append(data, count);
+}
+
+/* I/O */
+
+static bool write_all(int fd, const uint8_t* data, size_t count) {
+    while (count > 0) {
+        ssize_t written = write(fd, data, count);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        data += written;
+        count -= written;
+    }
+    return true;
+}
+
+void* fmice_recorder::io_work_static(void* ctx) {
+    ((fmice_recorder*)ctx)->io_work();
+    return 0;
+}
+
+void fmice_recorder::io_work() {
+    while (1) {
+        //Wait for a chunk - None comes once the encoder has stopped and everything has been written
+        fmice_recorder_chunk** slot = full_chunks.acquire_read(1);
+        if (slot == NULL)
+            break;
+        fmice_recorder_chunk* chunk = *slot;
+        full_chunks.release_read(1);
+
+        //Switch files if this one starts a new one
+        if (chunk->new_file) {
+            file_close();
+            file_open(chunk->path);
+        }
+
+        //Write and give it back
+        file_write(chunk);
+        free_chunks.write(&chunk, 1);
+    }
+
+    //Stopped
+    file_close();
+}
+
+void fmice_recorder::file_open(const char* path) {
+    //Try to bypass the page cache, falling back on filesystems that don't support it (like tmpfs)
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC | O_DIRECT, 0644);
+    direct = fd >= 0;
+    if (fd < 0 && errno == EINVAL)
+        fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+    //Check
+    if (fd < 0) {
+        printf("[RECORDER] Failed to open \"%s\": %s\n", path, strerror(errno));
+        stat_io.store(FMICE_RECORDER_IO_ERROR, std::memory_order_relaxed);
+        return;
+    }
+    printf("[RECORDER] Recording to \"%s\".\n", path);
+    stat_io.store(direct ? FMICE_RECORDER_IO_DIRECT : FMICE_RECORDER_IO_BUFFERED, std::memory_order_relaxed);
+}
+
+void fmice_recorder::file_set_buffered() {
+    int flags = fcntl(fd, F_GETFL);
+    fcntl(fd, F_SETFL, flags & ~O_DIRECT);
+    direct = false;
+}
+
+void fmice_recorder::file_write(fmice_recorder_chunk* chunk) {
+    //Drop it if there's no file to write to
+    if (fd < 0) {
+        stat_dropped_bytes.fetch_add(chunk->use, std::memory_order_relaxed);
+        return;
+    }
+
+    //O_DIRECT only takes whole aligned blocks - Every chunk is full except the last of a file, so the offset stays aligned until then
+    size_t aligned = direct ? chunk->use - (chunk->use % FMICE_RECORDER_ALIGNMENT) : 0;
+    bool ok = write_all(fd, chunk->data, aligned);
+    if (!ok && errno == EINVAL) {
+        //Some filesystems accept O_DIRECT when opening but refuse the writes
+        file_set_buffered();
+        stat_io.store(FMICE_RECORDER_IO_BUFFERED, std::memory_order_relaxed);
+        aligned = 0;
+        ok = true;
+    }
+
+    //Write the unaligned end of the file through the page cache
+    if (ok && chunk->use > aligned) {
+        if (direct)
+            file_set_buffered();
+        ok = write_all(fd, &chunk->data[aligned], chunk->use - aligned);
+    }
+
+    //Give up on this file on error - The next one will try again
+    if (!ok) {
+        printf("[RECORDER] Failed to write: %s\n", strerror(errno));
+        stat_io.store(FMICE_RECORDER_IO_ERROR, std::memory_order_relaxed);
+        stat_dropped_bytes.fetch_add(chunk->use, std::memory_order_relaxed);
+        file_close();
+        return;
+    }
+    stat_bytes_written.fetch_add(chunk->use, std::memory_order_relaxed);
+}
+
+void fmice_recorder::file_close() {
+    if (fd >= 0) {
+        close(fd);
+        fd = -1;
+    }
+}
@@ -0,0 +1,176 @@
+#pragma once
+
+#include "codec.h"
+#include "output.h"
+#include "spsc_buffer.h"
+#include <stdint.h>
+#include <atomic>
+#include <pthread.h>
+
+#define FMICE_RECORDER_ALIGNMENT 4096 // O_DIRECT buffer, length and offset alignment
+#define FMICE_RECORDER_CHUNK_SIZE (1024 * 1024) // Bytes per write - Must be a multiple of the alignment
+#define FMICE_RECORDER_CHUNK_COUNT 8 // Chunks waiting on the disk before new data is dropped
+#define FMICE_RECORDER_DEFAULT_ROTATE 3600 // Seconds per file
+#define FMICE_RECORDER_BLOCK_HEADROOM (64 * 1024) // Bytes a block may encode to beyond its raw size, such as headers and the end of a file
+
+#define FMICE_RECORDER_IO_IDLE 0
+#define FMICE_RECORDER_IO_DIRECT 1
+#define FMICE_RECORDER_IO_BUFFERED 2
+#define FMICE_RECORDER_IO_ERROR 3
+
+/// <summary>
+/// A chunk of file data handed from the encoder thread to the I/O thread.
+/// </summary>
+struct fmice_recorder_chunk {
+
+	uint8_t* data; // FMICE_RECORDER_CHUNK_SIZE bytes, aligned
+	size_t use;
+	bool new_file; // Close the current file and start path before writing this
+	char path[512];
+
+};
+
+/// <summary>
+/// Records a stream to local files, either through a codec or as raw interleaved 32-bit float PCM. A new file is started every rotation
+/// interval (aligned to the wall clock, so 3600 starts one on the hour) or once a file reaches a size. Encoding and disk writes each have
+/// their own thread, with large aligned chunks written with O_DIRECT where the filesystem allows, so a slow disk only ever drops recording
+/// data and never holds up the radio.
+/// </summary>
+class fmice_recorder : public fmice_output {
+
+public:
+	/// <summary>
+	/// Creates the recorder.
+	/// </summary>
+	/// <param name="channels">Interleaved channels pushed in.</param>
+	/// <param name="sampleRate">Sample rate pushed in.</param>
+	/// <param name="codec">Encoder to write files with, or NULL to write raw PCM. Taken over by the recorder.</param>
+	/// <param name="extension">File extension, without the dot.</param>
+	fmice_recorder(int channels, int sampleRate, fmice_codec* codec, const char* extension);
+	~fmice_recorder();
+
+	/// <summary>
+	/// Sets the path files are named from. The start time and extension are added to it.
+	/// </summary>
+	void set_path(const char* prefix);
+
+	/// <summary>
+	/// Sets the seconds between new files, or 0 to not rotate on time.
+	/// </summary>
+	void set_rotate_interval(int seconds);
+
+	/// <summary>
+	/// Sets the size a file can reach before a new one is started, or 0 to not rotate on size.
+	/// </summary>
+	void set_rotate_size(int64_t bytes);
+
+	/// <summary>
+	/// Sets if the input arrives in real time. If not, such as a file read as fast as possible, pushing waits for room instead of dropping data.
+	/// </summary>
+	void set_realtime(bool realtime);
+
+	bool is_configured();
+	void init() override;
+
+	/// <summary>
+	/// Pushes data into the queue. Thread safe to be called from the radio thread.
+	/// </summary>
+	void push(float* samples, int count) override;
+
+	int format_status(char* output, const char* name) override;
+
+	/// <summary>
+	/// Encodes the rest of the input, finishes the file and waits for it to be written.
+	/// </summary>
+	void stop() override;
+
+private:
+	int channels;
+	int sample_rate;
+	fmice_codec* codec;
+	char extension[16];
+
+	// Set before init
+	char path_prefix[448];
+	int rotate_interval;
+	int64_t rotate_size;
+	bool realtime;
+
+	// Stats
+	std::atomic<int64_t> stat_bytes_written;
+	std::atomic<int64_t> stat_dropped_samples; // Pushed while the input was full, or while every chunk was waiting on the disk
+	std::atomic<int64_t> stat_dropped_bytes; // Lost to a file that couldn't be opened or written
+	std::atomic<int> stat_io; // FMICE_RECORDER_IO_*
+
+	fmice_spsc_buffer<float> input_buffer; // Written only by the radio thread, read only by the encoder
+	fmice_spsc_buffer<fmice_recorder_chunk*> free_chunks; // Written only by the I/O thread, read only by the encoder
+	fmice_spsc_buffer<fmice_recorder_chunk*> full_chunks; // Written only by the encoder, read only by the I/O thread
+	fmice_recorder_chunk chunks[FMICE_RECORDER_CHUNK_COUNT];
+	pthread_t encode_thread;
+	pthread_t io_thread;
+
+	// Encoder thread access ONLY
+	fmice_recorder_chunk* current; // Being filled, or NULL
+	bool codec_error;
+	bool pending_new_file; // Set if the next chunk needs to start pending_path
+	char pending_path[512];
+	int64_t file_bytes;
+	int64_t next_rotate; // Wall clock time, or 0
+	int64_t last_rotate; // Wall clock time the current file was named at
+	int rotate_index; // Files started within the same second so far
+
+	// I/O thread access ONLY
+	int fd;
+	bool direct;
+
+	static void* encode_work_static(void* ctx);
+	void encode_work();
+
+	/// <summary>
+	/// Encodes or appends count samples from the input buffer and gives them back, rotating files as needed. In real time, drops the whole
+	/// block instead if there might not be room for what it encodes to. CALLED ONLY BY ENCODER.
+	/// </summary>
+	void encode_block(float* block, size_t count);
+
+	static void* io_work_static(void* ctx);
+	void io_work();
+
+	/// <summary>
+	/// Starts a new file, sending the rest of the current one off first. If finish is set, the codec ends its stream in the current file
+	/// first; leave it unset for the first file or after a codec error. CALLED ONLY BY ENCODER.
+	/// </summary>
+	void rotate(bool finish);
+
+	/// <summary>
+	/// Adds bytes to the current chunk, handing chunks to the I/O thread as they fill, and waits for a free chunk if needed. CALLED ONLY BY ENCODER.
+	/// </summary>
+	void append(const uint8_t* data, size_t count);
+
+	/// <summary>
+	/// Hands the current chunk to the I/O thread. CALLED ONLY BY ENCODER.
+	/// </summary>
+	void submit();
+
+	static void encoder_callback_static(const uint8_t* data, int count, void* context);
+
+	/// <summary>
+	/// Opens a file for writing, trying O_DIRECT first. CALLED ONLY BY I/O.
+	/// </summary>
+	void file_open(const char* path);
+
+	/// <summary>
+	/// Writes a chunk to the open file. CALLED ONLY BY I/O.
+	/// </summary>
+	void file_write(fmice_recorder_chunk* chunk);
+
+	/// <summary>
+	/// Closes the open file, if any. CALLED ONLY BY I/O.
+	/// </summary>
+	void file_close();
+
+	/// <summary>
+	/// Switches the open file from O_DIRECT to regular writes. CALLED ONLY BY I/O.
+	/// </summary>
+	void file_set_buffered();
+
+};
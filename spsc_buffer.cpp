@@ -0,0 +1,289 @@
+#include "spsc_buffer.h"
+#include "util.h"
+
+#include <stdexcept>
+#include <string.h>
+#include <cassert>
+#include <algorithm>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include "libairspyhf/airspyhf.h"
+#include <dsp/types.h>
+
+struct fmice_icecast_packet;
+struct fmice_recorder_chunk;
+
+static void futex_wait(std::atomic<uint32_t>* word, uint32_t expected, const struct timespec* timeout) {
+    syscall(SYS_futex, (uint32_t*)word, FUTEX_WAIT_PRIVATE, expected, timeout, NULL, 0);
+}
+
+static void futex_wake(std::atomic<uint32_t>* word) {
+    syscall(SYS_futex, (uint32_t*)word, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+template <typename T>
+fmice_spsc_buffer<T>::fmice_spsc_buffer(size_t requested) :
+    head(0),
+    cached_tail(0),
+    tail(0),
+    cached_head(0),
+    wake_seq(0),
+    waiting(0),
+    closed(false),
+    space_seq(0),
+    space_waiting(0)
+{
+    //Round up to a power of two so positions can be masked instead of wrapped, and to whole pages so it can be mirrored
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size = 1;
+    while (size < requested || ((size * sizeof(T)) % page) != 0)
+        size <<= 1;
+    mask = size - 1;
+    mapped_bytes = size * sizeof(T);
+
+    //Create the backing memory
+    int fd = memfd_create("fmice_spsc_buffer", MFD_CLOEXEC);
+    if (fd < 0)
+        throw new std::runtime_error("Failed to create buffer memory.");
+    if (ftruncate(fd, mapped_bytes) != 0) {
+        ::close(fd);
+        throw new std::runtime_error("Failed to size buffer memory.");
+    }
+
+    //Reserve twice the space, then map the same memory into both halves
+    uint8_t* base = (uint8_t*)mmap(NULL, mapped_bytes * 2, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    bool ok = base != MAP_FAILED &&
+        mmap(base, mapped_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) != MAP_FAILED &&
+        mmap(base + mapped_bytes, mapped_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) != MAP_FAILED;
+    ::close(fd);
+    if (!ok) {
+        //Drop the reservation along with whatever half did get mapped
+        if (base != MAP_FAILED)
+            munmap(base, mapped_bytes * 2);
+        throw new std::runtime_error("Failed to map buffer memory.");
+    }
+    buffer = (T*)base;
+}
+
+template <typename T>
+fmice_spsc_buffer<T>::~fmice_spsc_buffer() {
+    //Unmap both halves
+    munmap(buffer, mapped_bytes * 2);
+}
+
+template <typename T>
+size_t fmice_spsc_buffer<T>::acquire_write(T** span, size_t count) {
+    //Only refresh our view of the reader if the cached one says we're out of room
+    size_t pos = head.load(std::memory_order_relaxed);
+    if (size - (pos - cached_tail) < count)
+        cached_tail = tail.load(std::memory_order_acquire);
+
+    //Hand out the span - The mirror keeps it contiguous past the end
+    *span = &buffer[pos & mask];
+    return std::min(count, size - (pos - cached_tail));
+}
+
+template <typename T>
+void fmice_spsc_buffer<T>::commit_write(size_t count) {
+    //Publish
+    size_t pos = head.load(std::memory_order_relaxed) + count;
+    head.store(pos, std::memory_order_release);
+
+    //Wake the reader only if it is parked and now has enough
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    size_t needed = waiting.load(std::memory_order_relaxed);
+    if (needed != 0 && pos - tail.load(std::memory_order_relaxed) >= needed) {
+        wake_seq.fetch_add(1, std::memory_order_release);
+        futex_wake(&wake_seq);
+    }
+}
+
+template <typename T>
+size_t fmice_spsc_buffer<T>::write(const T* input, size_t count) {
+    //Get space
+    T* span;
+    size_t writable = acquire_write(&span, count);
+
+    //Copy and publish
+    memcpy(span, input, sizeof(T) * writable);
+    commit_write(writable);
+
+    return writable;
+}
+
+template <typename T>
+void fmice_spsc_buffer<T>::write_all(const T* input, size_t count) {
+    while (count > 0) {
+        //Write what fits, then wait for room for the rest
+        size_t written = write(input, count);
+        input += written;
+        count -= written;
+        if (count > 0)
+            wait_for_space(std::min(count, size));
+    }
+}
+
+template <typename T>
+void fmice_spsc_buffer<T>::wait_for_space(size_t count) {
+    size_t pos = head.load(std::memory_order_relaxed);
+    while (size - (pos - tail.load(std::memory_order_acquire)) < count) {
+        //Announce that we're parking, then check once more before sleeping so a release can't slip between
+        uint32_t seq = space_seq.load(std::memory_order_acquire);
+        space_waiting.store(count, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (size - (pos - tail.load(std::memory_order_acquire)) >= count)
+            break;
+        futex_wait(&space_seq, seq, NULL);
+    }
+    space_waiting.store(0, std::memory_order_relaxed);
+}
+
+template <typename T>
+void fmice_spsc_buffer<T>::wake_producer(size_t pos) {
+    //Wake the writer only if it is parked and now has enough room
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    size_t needed = space_waiting.load(std::memory_order_relaxed);
+    if (needed != 0 && size - (head.load(std::memory_order_relaxed) - pos) >= needed) {
+        space_seq.fetch_add(1, std::memory_order_release);
+        futex_wake(&space_seq);
+    }
+}
+
+template <typename T>
+void fmice_spsc_buffer<T>::close() {
+    //Flag, then wake the reader whatever it's waiting for
+    closed.store(true, std::memory_order_release);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (waiting.load(std::memory_order_relaxed) != 0) {
+        wake_seq.fetch_add(1, std::memory_order_release);
+        futex_wake(&wake_seq);
+    }
+}
+
+template <typename T>
+size_t fmice_spsc_buffer<T>::wait_for(size_t count, int timeoutMs) {
+    int64_t deadline = timeoutMs >= 0 ? fmice_now_ns() + ((int64_t)timeoutMs * 1000000LL) : 0;
+    size_t pos = tail.load(std::memory_order_relaxed);
+    size_t available = head.load(std::memory_order_acquire);
+    while (available - pos < count) {
+        //Announce that we're parking, then check once more before sleeping so a write can't slip between
+        uint32_t seq = wake_seq.load(std::memory_order_acquire);
+        waiting.store(count, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        available = head.load(std::memory_order_acquire);
+        if (available - pos >= count)
+            break;
+
+        //Nothing more is coming once closed - Head is read again after the flag, as everything before the close is published by then
+        if (closed.load(std::memory_order_acquire)) {
+            available = head.load(std::memory_order_acquire);
+            break;
+        }
+
+        //Sleep until the writer bumps the sequence or we run out of time
+        if (timeoutMs >= 0) {
+            int64_t remaining = deadline - fmice_now_ns();
+            if (remaining <= 0)
+                break;
+            struct timespec timeout;
+            timeout.tv_sec = remaining / 1000000000LL;
+            timeout.tv_nsec = remaining % 1000000000LL;
+            futex_wait(&wake_seq, seq, &timeout);
+        }
+        else {
+            futex_wait(&wake_seq, seq, NULL);
+        }
+        available = head.load(std::memory_order_acquire);
+    }
+    waiting.store(0, std::memory_order_relaxed);
+    return available;
+}
+
+template <typename T>
+T* fmice_spsc_buffer<T>::acquire_read(size_t count) {
+    //Sanity check
+    assert(count <= size);
+
+    //Wait for enough samples to be available, or give up if the buffer is closed first
+    size_t pos = tail.load(std::memory_order_relaxed);
+    if (cached_head - pos < count) {
+        cached_head = wait_for(count, -1);
+        if (cached_head - pos < count)
+            return NULL;
+    }
+
+    //Hand out the span - The mirror keeps it contiguous past the end
+    return &buffer[pos & mask];
+}
+
+template <typename T>
+T* fmice_spsc_buffer<T>::acquire_read(size_t count, int timeoutMs) {
+    //Sanity check
+    assert(count <= size);
+
+    //Wait for enough samples to be available, giving up after the timeout
+    size_t pos = tail.load(std::memory_order_relaxed);
+    if (cached_head - pos < count) {
+        cached_head = wait_for(count, timeoutMs);
+        if (cached_head - pos < count)
+            return NULL;
+    }
+
+    //Hand out the span - The mirror keeps it contiguous past the end
+    return &buffer[pos & mask];
+}
+
+template <typename T>
+void fmice_spsc_buffer<T>::release_read(size_t count) {
+    //Release the space to the writer
+    size_t pos = tail.load(std::memory_order_relaxed) + count;
+    tail.store(pos, std::memory_order_release);
+    wake_producer(pos);
+}
+
+template <typename T>
+size_t fmice_spsc_buffer<T>::read(T* output, size_t count) {
+    //Copy out and release
+    T* span = acquire_read(count);
+    if (span == NULL)
+        return 0;
+    memcpy(output, span, sizeof(T) * count);
+    release_read(count);
+
+    return count;
+}
+
+template <typename T>
+void fmice_spsc_buffer<T>::reset() {
+    //Catch up to the writer
+    cached_head = head.load(std::memory_order_acquire);
+    tail.store(cached_head, std::memory_order_release);
+    wake_producer(cached_head);
+}
+
+template <typename T>
+size_t fmice_spsc_buffer<T>::get_size() {
+    return size;
+}
+
+template <typename T>
+size_t fmice_spsc_buffer<T>::get_use() {
+    size_t pos = tail.load(std::memory_order_acquire);
+    return head.load(std::memory_order_acquire) - pos;
+}
+
+template <typename T>
+size_t fmice_spsc_buffer<T>::get_free() {
+    return get_size() - get_use();
+}
+
+template class fmice_spsc_buffer<float>;
+template class fmice_spsc_buffer<int32_t>;
+template class fmice_spsc_buffer<airspyhf_complex_float_t>;
+template class fmice_spsc_buffer<dsp::complex_t>;
+template class fmice_spsc_buffer<uint8_t>;
+template class fmice_spsc_buffer<fmice_icecast_packet*>;
+template class fmice_spsc_buffer<fmice_recorder_chunk*>;
@@ -0,0 +1,128 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+
+#define FMICE_CACHE_LINE 64
+
+/// <summary>
+/// Lock-free single-producer/single-consumer ring. Writes never block or take a lock, so this is safe to feed
+/// from device callbacks. The reader only makes a syscall when it has to sleep. Use fmice_circular_buffer if
+/// there is more than one writer. Producers that would rather wait than drop (where nothing real-time feeds them)
+/// can use write_all, and close marks the end of the stream for the reader.
+/// The backing memory is mapped twice back to back, so any span handed out is contiguous even across the wrap.
+/// </summary>
+template <typename T>
+class fmice_spsc_buffer {
+
+public:
+	/// <summary>
+	/// Creates the buffer. The size is rounded up to a power of two that fills whole pages.
+	/// </summary>
+	/// <param name="size"></param>
+	fmice_spsc_buffer(size_t size);
+	~fmice_spsc_buffer();
+
+	/// <summary>
+	/// Writes to the buffer. Producer thread only. Never blocks; returns the number of samples that fit.
+	/// </summary>
+	/// <param name="input"></param>
+	/// <param name="count"></param>
+	size_t write(const T* input, size_t count);
+
+	/// <summary>
+	/// Writes everything to the buffer, sleeping until the reader makes room if it has to. Producer thread only.
+	/// </summary>
+	void write_all(const T* input, size_t count);
+
+	/// <summary>
+	/// Marks the end of the stream. Once the reader has drained what's left, acquire_read returns NULL instead of waiting. Producer thread only.
+	/// </summary>
+	void close();
+
+	/// <summary>
+	/// Reads from the buffer. Consumer thread only. Hangs until count samples are recieved.
+	/// </summary>
+	/// <param name="output"></param>
+	/// <param name="count"></param>
+	/// <returns>Count, or 0 if the buffer was closed first.</returns>
+	size_t read(T* output, size_t count);
+
+	/// <summary>
+	/// Gets a contiguous span to write into without copying. Producer thread only. Never blocks; returns how many samples fit (up to count).
+	/// Nothing is visible to the reader until commit_write is called.
+	/// </summary>
+	/// <param name="span">Set to the start of the writable span.</param>
+	/// <param name="count">Number of samples wanted.</param>
+	size_t acquire_write(T** span, size_t count);
+
+	/// <summary>
+	/// Publishes count samples written into the span from acquire_write. Producer thread only.
+	/// </summary>
+	void commit_write(size_t count);
+
+	/// <summary>
+	/// Hangs until count samples are available and returns a contiguous span of them without copying. Consumer thread only.
+	/// The span stays valid (and may be modified) until release_read is called. Returns NULL if the buffer is closed before count samples show up.
+	/// </summary>
+	T* acquire_read(size_t count);
+
+	/// <summary>
+	/// Same as acquire_read, but gives up and returns NULL if count samples don't show up within timeoutMs milliseconds.
+	/// </summary>
+	T* acquire_read(size_t count, int timeoutMs);
+
+	/// <summary>
+	/// Gives count samples from the span returned by acquire_read back to the writer. Consumer thread only.
+	/// </summary>
+	void release_read(size_t count);
+
+	size_t get_size();
+	size_t get_use();
+	size_t get_free();
+
+	/// <summary>
+	/// Drops all samples currently in the buffer. Consumer thread only.
+	/// </summary>
+	void reset();
+
+private:
+	T* buffer; // Mapped twice, so buffer[size + i] aliases buffer[i]
+	size_t size;
+	size_t mask;
+	size_t mapped_bytes;
+
+	// Producer side
+	alignas(FMICE_CACHE_LINE) std::atomic<size_t> head; // Total samples ever written
+	size_t cached_tail; // Producer's last view of tail
+
+	// Consumer side
+	alignas(FMICE_CACHE_LINE) std::atomic<size_t> tail; // Total samples ever read
+	size_t cached_head; // Consumer's last view of head
+
+	// Wakeup - Only touched by the producer when the consumer is parked
+	alignas(FMICE_CACHE_LINE) std::atomic<uint32_t> wake_seq; // Futex word
+	std::atomic<size_t> waiting; // Number of samples the parked consumer needs, or 0
+	std::atomic<bool> closed;
+
+	// Wakeup - Only touched by the consumer when the producer is parked in write_all
+	alignas(FMICE_CACHE_LINE) std::atomic<uint32_t> space_seq; // Futex word
+	std::atomic<size_t> space_waiting; // Number of free samples the parked producer needs, or 0
+
+	/// <summary>
+	/// Parks the consumer until at least count samples are readable, the buffer is closed, or until timeoutMs passes if it isn't negative. Returns the new head.
+	/// </summary>
+	size_t wait_for(size_t count, int timeoutMs);
+
+	/// <summary>
+	/// Parks the producer until at least count samples are free.
+	/// </summary>
+	void wait_for_space(size_t count);
+
+	/// <summary>
+	/// Wakes the producer if it is parked and now has the room it needs. Consumer thread only.
+	/// </summary>
+	void wake_producer(size_t pos);
+
+};
@@ -0,0 +1,76 @@
+#include "stereo_decimator.h"
+
+#include <string.h>
+#include <cassert>
+#include <volk/volk.h>
+
+fmice_stereo_decimator::fmice_stereo_decimator(int bufferSize) :
+	buffer_size(bufferSize),
+	decim(1),
+	offset(0),
+	taps(0),
+	tap_count(0),
+	history(0)
+{
+}
+
+fmice_stereo_decimator::~fmice_stereo_decimator() {
+	//Free buffers
+	volk_free(taps);
+	volk_free(history);
+}
+
+void fmice_stereo_decimator::init(const dsp::tap<float>& taps, int decim) {
+	//Sanity check
+	assert(taps.size > 0);
+	assert(decim > 0);
+
+	//Free old buffers if re-initialized
+	volk_free(this->taps);
+	volk_free(history);
+
+	//Copy the taps
+	tap_count = taps.size;
+	this->taps = (float*)volk_malloc(sizeof(float) * tap_count, volk_get_alignment());
+	assert(this->taps != NULL);
+	memcpy(this->taps, taps.taps, sizeof(float) * tap_count);
+	this->decim = decim;
+
+	//Allocate the history
+	history = (dsp::stereo_t*)volk_malloc(sizeof(dsp::stereo_t) * (tap_count - 1 + buffer_size), volk_get_alignment());
+	assert(history != NULL);
+	reset();
+}
+
+void fmice_stereo_decimator::reset() {
+	memset(history, 0, sizeof(dsp::stereo_t) * (tap_count - 1));
+	offset = 0;
+}
+
+int fmice_stereo_decimator::process(int count, const float* lpr, const float* lmr, dsp::stereo_t* out) {
+	//Sanity check
+	assert(count <= buffer_size);
+
+	//Interleave the new block in after the history - This takes the place of the copy a regular FIR does anyway
+	dsp::stereo_t* block = &history[tap_count - 1];
+	for (int i = 0; i < count; i++) {
+		block[i].l = lpr[i];
+		block[i].r = lmr[i];
+	}
+
+	//Filter both signals at once for each kept output, treating the pair like a complex sample, then matrix into L and R
+	int outCount = 0;
+	for (; offset < count; offset += decim) {
+		dsp::stereo_t sum;
+		volk_32fc_32f_dot_prod_32fc((lv_32fc_t*)&sum, (lv_32fc_t*)&history[offset], taps, tap_count);
+		out[outCount].l = sum.l + sum.r;
+		out[outCount].r = sum.l - sum.r;
+		outCount++;
+	}
+	offset -= count;
+
+	//Keep the end for the next block
+	memmove(history, &history[count], sizeof(dsp::stereo_t) * (tap_count - 1));
+
+	return outCount;
+}
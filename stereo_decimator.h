@@ -0,0 +1,42 @@
+#pragma once
+
+#include <dsp/types.h>
+#include <dsp/taps/tap.h>
+
+/// <summary>
+/// Decimating low-pass filter for the stereo decoder. Takes L+R and L-R as two planar real signals and filters them together as the
+/// lanes of interleaved stereo samples, computing only the outputs that are kept. The L/R matrix is done on each output as it's produced,
+/// so L and R never exist at the input rate.
+/// </summary>
+class fmice_stereo_decimator {
+
+public:
+	fmice_stereo_decimator(int bufferSize);
+	~fmice_stereo_decimator();
+
+	/// <summary>
+	/// Sets the filter and decimation. The taps are copied.
+	/// </summary>
+	void init(const dsp::tap<float>& taps, int decim);
+
+	/// <summary>
+	/// Clears the filter history.
+	/// </summary>
+	void reset();
+
+	/// <summary>
+	/// Filters and decimates count samples of L+R and L-R, writing L and R out interleaved. Returns the number of output samples.
+	/// </summary>
+	int process(int count, const float* lpr, const float* lmr, dsp::stereo_t* out);
+
+private:
+	int buffer_size;
+	int decim;
+	int offset; // Input index of the next output, carried across blocks
+
+	float* taps;
+	int tap_count;
+
+	dsp::stereo_t* history; // Last tap_count - 1 samples followed by the current block, L+R in l and L-R in r
+
+};
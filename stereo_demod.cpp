@@ -4,70 +4,87 @@
 #include <dsp/taps/band_pass.h>
 #include <dsp/math/conjugate.h>
 #include <dsp/math/multiply.h>
-#include <dsp/math/add.h>
-#include <dsp/math/subtract.h>
-#include <dsp/convert/l_r_to_stereo.h>
+#include <string.h>
 #include <cassert>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define STEREO_DEMOD_SSE2
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define STEREO_DEMOD_NEON
+#endif
+
 // Very inspired by SDR++ FM demodulator
 
 fmice_stereo_demod::fmice_stereo_demod(int bufferSize) :
     buffer_size(bufferSize),
-    l(0),
-    r(0),
+    engine(FMICE_STEREO_ENGINE_COMPLEX),
     lmr(0),
     lpr(0),
-    delay_samples(0)
+    delay_samples(0),
+    real_pll(bufferSize),
+    audio_filter(bufferSize)
 {
     //Allocate buffers
-    l = (float*)volk_malloc(sizeof(float) * bufferSize, volk_get_alignment());
-    r = (float*)volk_malloc(sizeof(float) * bufferSize, volk_get_alignment());
     lpr = (float*)volk_malloc(sizeof(float) * bufferSize, volk_get_alignment());
     lmr = (float*)volk_malloc(sizeof(float) * bufferSize, volk_get_alignment());
 
     //Validate
-    assert(l != NULL);
-    assert(r != NULL);
     assert(lpr != NULL);
     assert(lmr != NULL);
 }
 
 fmice_stereo_demod::~fmice_stereo_demod() {
     //Free buffers
-    volk_free(l);
-    volk_free(r);
+    volk_free(lpr);
     volk_free(lmr);
 }
 
-void fmice_stereo_demod::init(int sampleRate, int audioDecimRate, double audioFilterCutoff, double audioFilterTrans, double deemphasisRate) {
-    //Init pilot filter
-    pilot_filter_taps = dsp::taps::bandPass<dsp::complex_t>(18750.0, 19250.0, 3000.0, sampleRate, true);
-    printf("Stereo Pilot taps: %i\n", pilot_filter_taps.size);
-    pilotFir.init(NULL, pilot_filter_taps);
-    pilotFir.out.setBufferSize(buffer_size);
-
-    //Init real to complex for converting mpx to complex
-    rtoc.init(NULL);
-    rtoc.out.setBufferSize(buffer_size);
-
-    //Init pilot PLL
-    pilot_pll.init(NULL, 25000.0 / sampleRate, 0.0, dsp::math::hzToRads(19000.0, sampleRate), dsp::math::hzToRads(18750.0, sampleRate), dsp::math::hzToRads(19250.0, sampleRate));
-    pilot_pll.out.setBufferSize(buffer_size);
+bool fmice_stereo_demod::parse_engine(const char* name, int* engine) {
+    if (strcmp(name, "complex") == 0)
+        *engine = FMICE_STEREO_ENGINE_COMPLEX;
+    else if (strcmp(name, "real") == 0)
+        *engine = FMICE_STEREO_ENGINE_REAL;
+    else
+        return false;
+    return true;
+}
 
-    //Init delays for the pilot filter
-    delay_samples = ((pilot_filter_taps.size - 1) / 2) + 1;
-    lpr_delay.init(NULL, delay_samples);
-    lpr_delay.out.setBufferSize(buffer_size);
-    lmr_delay.init(NULL, delay_samples);
-    lmr_delay.out.setBufferSize(buffer_size);
+void fmice_stereo_demod::init(int sampleRate, int audioDecimRate, double audioFilterCutoff, double audioFilterTrans, double deemphasisRate, int engine) {
+    this->engine = engine;
+    if (engine == FMICE_STEREO_ENGINE_REAL) {
+        //Init real PLL - It tracks the current sample, so nothing needs to be delayed
+        real_pll.init(sampleRate);
+        delay_samples = 0;
+    }
+    else {
+        //Init pilot filter
+        pilot_filter_taps = dsp::taps::bandPass<dsp::complex_t>(18750.0, 19250.0, 3000.0, sampleRate, true);
+        printf("Stereo Pilot taps: %i\n", pilot_filter_taps.size);
+        pilotFir.init(NULL, pilot_filter_taps);
+        pilotFir.out.setBufferSize(buffer_size);
+
+        //Init real to complex for converting mpx to complex
+        rtoc.init(NULL);
+        rtoc.out.setBufferSize(buffer_size);
+
+        //Init pilot PLL
+        pilot_pll.init(NULL, 25000.0 / sampleRate, 0.0, dsp::math::hzToRads(19000.0, sampleRate), dsp::math::hzToRads(18750.0, sampleRate), dsp::math::hzToRads(19250.0, sampleRate));
+        pilot_pll.out.setBufferSize(buffer_size);
+
+        //Init delays for the pilot filter
+        delay_samples = ((pilot_filter_taps.size - 1) / 2) + 1;
+        lpr_delay.init(NULL, delay_samples);
+        lpr_delay.out.setBufferSize(buffer_size);
+        lmr_delay.init(NULL, delay_samples);
+        lmr_delay.out.setBufferSize(buffer_size);
+    }
 
     //Init audio filters
     audio_filter_taps = dsp::taps::lowPass(audioFilterCutoff, audioFilterTrans, sampleRate);
     printf("Stereo Audio taps: %i\n", audio_filter_taps.size);
-    audio_filter_l.init(NULL, audio_filter_taps, audioDecimRate);
-    audio_filter_l.out.setBufferSize(buffer_size);
-    audio_filter_r.init(NULL, audio_filter_taps, audioDecimRate);
-    audio_filter_r.out.setBufferSize(buffer_size);
+    audio_filter.init(audio_filter_taps, audioDecimRate);
 
     //Reset and calculate deemphesis alpha
     deemphasis_alpha = 0;
@@ -77,7 +94,7 @@ void fmice_stereo_demod::init(int sampleRate, int audioDecimRate, double audioFi
         deemphasis_alpha = 1.0f - exp(-1.0f / ((sampleRate / audioDecimRate) * (deemphasisRate * 1e-6f)));
 }
 
-void process_deemphasis(float alpha, float* state, float* buffer, int count) {
+void fmice_stereo_demod::deemphasis_reference(float alpha, float* state, float* buffer, int count) {
     for (int i = 0; i < count; i++)
     {
         *state += alpha * (buffer[i] - *state);
@@ -85,7 +102,90 @@ void process_deemphasis(float alpha, float* state, float* buffer, int count) {
     }
 }
 
-int fmice_stereo_demod::process(float* mpxIn, dsp::stereo_t* audioOut, int count) {
+const char* fmice_stereo_demod::get_deemphasis_impl() {
+#if defined(STEREO_DEMOD_SSE2)
+    return "sse2";
+#elif defined(STEREO_DEMOD_NEON)
+    return "neon";
+#else
+    return "generic";
+#endif
+}
+
+void fmice_stereo_demod::deemphasis_stereo(float alpha, float* stateL, float* stateR, dsp::stereo_t* buffer, int count) {
+    //Each step is the same subtract, multiply, add as the reference, never fused, so the result is identical. The filter can't be vectorized
+    //along time, but running L and R in the lanes of one register halves the length of the dependency chain.
+    int i = 0;
+#if defined(STEREO_DEMOD_SSE2)
+    __m128 a = _mm_set1_ps(alpha);
+    __m128 s = _mm_setr_ps(*stateL, *stateR, 0, 0);
+    for (; i + 2 <= count; i += 2) {
+        //Step through both samples - Only the low two lanes of the state are kept
+        __m128 x = _mm_loadu_ps((float*)&buffer[i]);
+        s = _mm_add_ps(s, _mm_mul_ps(a, _mm_sub_ps(x, s)));
+        __m128 s0 = s;
+        s = _mm_add_ps(s, _mm_mul_ps(a, _mm_sub_ps(_mm_movehl_ps(x, x), s)));
+        _mm_storeu_ps((float*)&buffer[i], _mm_movelh_ps(s0, s));
+    }
+    *stateL = _mm_cvtss_f32(s);
+    *stateR = _mm_cvtss_f32(_mm_shuffle_ps(s, s, _MM_SHUFFLE(1, 1, 1, 1)));
+#elif defined(STEREO_DEMOD_NEON)
+    float32x2_t a = vdup_n_f32(alpha);
+    float32x2_t s = { *stateL, *stateR };
+    for (; i < count; i++) {
+        s = vadd_f32(s, vmul_f32(a, vsub_f32(vld1_f32((float*)&buffer[i]), s)));
+        vst1_f32((float*)&buffer[i], s);
+    }
+    *stateL = vget_lane_f32(s, 0);
+    *stateR = vget_lane_f32(s, 1);
+#endif
+
+    //Finish up, or do it all if there's no SIMD
+    float sl = *stateL;
+    float sr = *stateR;
+    for (; i < count; i++) {
+        sl += alpha * (buffer[i].l - sl);
+        sr += alpha * (buffer[i].r - sr);
+        buffer[i].l = sl;
+        buffer[i].r = sr;
+    }
+    *stateL = sl;
+    *stateR = sr;
+}
+
+float fmice_stereo_demod::get_pilot_frequency() {
+    return engine == FMICE_STEREO_ENGINE_REAL ? real_pll.get_frequency() : 0;
+}
+
+int fmice_stereo_demod::process(const float* mpxIn, dsp::stereo_t* audioOut, int count) {
+    //Recover L+R and L-R with whichever engine
+    if (engine == FMICE_STEREO_ENGINE_REAL)
+        process_real(mpxIn, count);
+    else
+        process_complex(mpxIn, count);
+
+    //Do the rest only if there is an output
+    if (audioOut != 0) {
+        //Filter L+R and L-R down to the audio rate, doing L = (L+R) + (L-R), R = (L+R) - (L-R) on the way out
+        count = audio_filter.process(count, lpr, lmr, audioOut);
+
+        //Apply deemphesis
+        if (deemphasis_alpha != 0)
+            deemphasis_stereo(deemphasis_alpha, &deemphasis_state_l, &deemphasis_state_r, audioOut, count);
+    }
+
+    return count;
+}
+
+void fmice_stereo_demod::process_real(const float* mpxIn, int count) {
+    //Track the pilot and mix L-R down with it
+    real_pll.process(mpxIn, lmr, count);
+
+    //L+R is the composite itself - The audio filter removes everything above it
+    memcpy(lpr, mpxIn, sizeof(float) * count);
+}
+
+void fmice_stereo_demod::process_complex(const float* mpxIn, int count) {
     //Convert to complex
     rtoc.process(count, mpxIn, rtoc.out.writeBuf);
 
@@ -110,27 +210,4 @@ int fmice_stereo_demod::process(float* mpxIn, dsp::stereo_t* audioOut, int count
 
     //Copy L+R for external use
     memcpy(lpr, lpr_delay.out.writeBuf, sizeof(float) * count);
-
-    //Do the rest only if there is an output
-    if (audioOut != 0) {
-        //Do L = (L+R) + (L-R), R = (L+R) - (L-R)
-        dsp::math::Add<float>::process(count, lpr_delay.out.writeBuf, lmr, l);
-        dsp::math::Subtract<float>::process(count, lpr_delay.out.writeBuf, lmr, r);
-
-        //Filter audio
-        int countL = audio_filter_l.process(count, l, l);
-        count = audio_filter_r.process(count, r, r);
-        assert(countL == count);
-
-        //Apply deemphesis
-        if (deemphasis_alpha != 0) {
-            process_deemphasis(deemphasis_alpha, &deemphasis_state_l, l, count);
-            process_deemphasis(deemphasis_alpha, &deemphasis_state_r, r, count);
-        }
-
-        //Interleave into stereo
-        dsp::convert::LRToStereo::process(count, l, r, audioOut);
-    }
-
-    return count;
 }
\ No newline at end of file
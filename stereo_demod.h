@@ -6,6 +6,11 @@
 #include <dsp/convert/complex_to_real.h>
 #include <dsp/loop/pll.h>
 #include <dsp/math/delay.h>
+#include "stereo_decimator.h"
+#include "pilot_pll.h"
+
+#define FMICE_STEREO_ENGINE_COMPLEX 0 // Complex band-pass and PLL over the whole composite
+#define FMICE_STEREO_ENGINE_REAL 1 // fmice_pilot_pll on the real composite
 
 class fmice_stereo_demod {
 
@@ -13,19 +18,42 @@ public:
 	fmice_stereo_demod(int bufferSize);
 	~fmice_stereo_demod();
 
-	void init(int sampleRate, int audioDecimRate, double audioFilterCutoff, double audioFilterTrans, double deemphasisRate);
-    int process(float* mpxIn, dsp::stereo_t* audioOut, int count);
+	void init(int sampleRate, int audioDecimRate, double audioFilterCutoff, double audioFilterTrans, double deemphasisRate, int engine = FMICE_STEREO_ENGINE_COMPLEX);
+    int process(const float* mpxIn, dsp::stereo_t* audioOut, int count);
 
     float* lmr; // L-R buffer at input sample rate, used for re-encoding stereo
     float* lpr; // L+R buffer at input sample rate, used for re-encoding stereo
 
     int delay_samples;
 
+    /// <summary>
+    /// Gets the pilot frequency in Hz the PLL is tracking. Only tracked by the real engine, 0 otherwise.
+    /// </summary>
+    float get_pilot_frequency();
+
+    /// <summary>
+    /// Parses an engine name, "complex" or "real". Returns false if it isn't one.
+    /// </summary>
+    static bool parse_engine(const char* name, int* engine);
+
+    /// <summary>
+    /// The original one-pole deemphasis over one channel, kept as the reference the two-lane version must match bit for bit.
+    /// </summary>
+    static void deemphasis_reference(float alpha, float* state, float* buffer, int count);
+
+    /// <summary>
+    /// Deemphasizes interleaved L and R in place as two lanes of one filter. Bit-exact with deemphasis_reference run on each channel.
+    /// </summary>
+    static void deemphasis_stereo(float alpha, float* stateL, float* stateR, dsp::stereo_t* buffer, int count);
+
+    /// <summary>
+    /// Gets the name of the implementation deemphasis_stereo was built with.
+    /// </summary>
+    static const char* get_deemphasis_impl();
+
 private:
     int buffer_size;
-
-    float* l;
-    float* r;
+    int engine;
 
     dsp::tap<dsp::complex_t> pilot_filter_taps;
     dsp::filter::FIR<dsp::complex_t, dsp::complex_t> pilotFir;
@@ -33,12 +61,22 @@ private:
     dsp::loop::PLL pilot_pll;
     dsp::math::Delay<float> lpr_delay;
     dsp::math::Delay<dsp::complex_t> lmr_delay;
+    fmice_pilot_pll real_pll;
     dsp::tap<float> audio_filter_taps;
-    dsp::filter::DecimatingFIR<float, float> audio_filter_l;
-    dsp::filter::DecimatingFIR<float, float> audio_filter_r;
+    fmice_stereo_decimator audio_filter;
 
     float deemphasis_alpha;
     float deemphasis_state_l;
     float deemphasis_state_r;
 
+    /// <summary>
+    /// Fills lpr and lmr using the complex band-pass and PLL.
+    /// </summary>
+    void process_complex(const float* mpxIn, int count);
+
+    /// <summary>
+    /// Fills lpr and lmr using the real PLL.
+    /// </summary>
+    void process_real(const float* mpxIn, int count);
+
 };
\ No newline at end of file
@@ -15,46 +15,22 @@ fmice_stereo_encode::fmice_stereo_encode(int bufferSize, float pilotLevel, float
 	audio_filter_lpr.out.setBufferSize(bufferSize);
 	audio_filter_lmr.init(NULL, audio_filter_taps);
 	audio_filter_lmr.out.setBufferSize(bufferSize);
-
-	//Set up pilot generator
-	pilot_osc_phase = 0;
-	pilot_osc_inc = 2 * M_PI * 19000 / sampleRate;
 }
 
 fmice_stereo_encode::~fmice_stereo_encode() {
 
 }
 
-void fmice_stereo_encode::process(float* mpxOut, const float* lprIn, const float* lmrIn, int count) {
+void fmice_stereo_encode::process(float* mpxOut, const float* lprIn, const float* lmrIn, const float* pilot, const float* subcarrier, int count) {
 	//Filter L+R and L-R
 	audio_filter_lpr.process(count, lprIn, audio_filter_lpr.out.writeBuf);
 	audio_filter_lmr.process(count, lmrIn, audio_filter_lmr.out.writeBuf);
 
-	//Add L+R into buffer
-	//volk_32f_x2_add_32f(mpxOut, mpxOut, audio_filter_lpr.out.writeBuf, count);
-	memcpy(mpxOut, audio_filter_lpr.out.writeBuf, sizeof(float) * count);
-
-	//Generate
-	float pilotx1;
-	float pilotx2;
-	for (int i = 0; i < count; i++) {
-		//Get pilot
-		pilotx1 = sinf(pilot_osc_phase);
-		pilotx2 = sinf(pilot_osc_phase * 2);
-
-		//Step
-		pilot_osc_phase += pilot_osc_inc;
-		if (abs(pilot_osc_phase) > M_PI) {
-			while (pilot_osc_phase > M_PI)
-				pilot_osc_phase -= 2 * M_PI;
-			while (pilot_osc_phase < -M_PI)
-				pilot_osc_phase += 2 * M_PI;
-		}
+	//Mix L-R up onto 38 kHz and add L+R
+	volk_32f_x2_multiply_32f(audio_filter_lmr.out.writeBuf, audio_filter_lmr.out.writeBuf, subcarrier, count);
+	volk_32f_x2_add_32f(mpxOut, audio_filter_lpr.out.writeBuf, audio_filter_lmr.out.writeBuf, count);
 
-		//Add 19 kHz pilot
-		mpxOut[i] += pilotx1 * pilot_level;
-
-		//Add mix + L-R
-		mpxOut[i] += pilotx2 * audio_filter_lmr.out.writeBuf[i];
-	}
-}
\ No newline at end of file
+	//Add 19 kHz pilot
+	volk_32f_s32f_multiply_32f(audio_filter_lmr.out.writeBuf, pilot, pilot_level, count);
+	volk_32f_x2_add_32f(mpxOut, mpxOut, audio_filter_lmr.out.writeBuf, count);
+}
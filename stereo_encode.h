@@ -9,16 +9,16 @@ public:
 	fmice_stereo_encode(int bufferSize, float pilotLevel, float sampleRate, float audioFilterCutoff, float audioFilterTrans);
 	~fmice_stereo_encode();
 
-	void process(float* mpxOut, const float* lprIn, const float* lmrIn, int count);
+	/// <summary>
+	/// Builds a stereo composite from L+R and L-R. The 19 kHz pilot and 38 kHz subcarrier come from a shared fmice_nco_bank so they stay locked to anything else using it.
+	/// </summary>
+	void process(float* mpxOut, const float* lprIn, const float* lmrIn, const float* pilot, const float* subcarrier, int count);
 
 private:
 	dsp::tap<float> audio_filter_taps;
 	dsp::filter::FIR<float, float> audio_filter_lmr;
 	dsp::filter::FIR<float, float> audio_filter_lpr;
 
-	double pilot_osc_phase;
-	double pilot_osc_inc;
-
 	float pilot_level;
 
 };
\ No newline at end of file
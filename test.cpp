@@ -18,10 +18,24 @@ unsigned char wavHeader[44] = {
 	0x64, 0x61, 0x74, 0x61, 0x00, 0x60, 0x2D, 0x09
 };
 
-int main() {
+int main(int argc, char* argv[]) {
+	//Check args
+	if (argc != 3) {
+		printf("Usage: %s [input cf32 IQ file] [output WAV file]\n", argv[0]);
+		return -1;
+	}
+
 	//Open input and output files
-	FILE* fileInput = fopen("/media/sf_VMShare/kqlx stereo test.bin", "rb");
-	FILE* fileOutput = fopen("/media/sf_VMShare/stereo demod.wav", "wb");
+	FILE* fileInput = fopen(argv[1], "rb");
+	if (fileInput == 0) {
+		printf("Failed to open input file \"%s\".\n", argv[1]);
+		return -1;
+	}
+	FILE* fileOutput = fopen(argv[2], "wb");
+	if (fileOutput == 0) {
+		printf("Failed to open output file \"%s\".\n", argv[2]);
+		return -1;
+	}
 
 	//Set up and write WAV buffer
 	*((int*)&wavHeader[24]) = SAMP_RATE / 4;
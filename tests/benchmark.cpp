@@ -0,0 +1,391 @@
+#include "stdio.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <getopt.h>
+#include <vector>
+
+#include <volk/volk.h>
+#include <dsp/demod/quadrature.h>
+#include <dsp/filter/decimating_fir.h>
+#include <dsp/taps/low_pass.h>
+#include "../defines.h"
+#include "../decimator.h"
+#include "../stereo_demod.h"
+#include "../stereo_encode.h"
+#include "../nco.h"
+#include "../rds/rds.h"
+#include "../codecs/codec_flac.h"
+#include "../codecs/codec_mp3.h"
+#include "../codecs/codec_opus.h"
+#include "../devices/device_file.h"
+#include "../profiler.h"
+#include "../util.h"
+
+#define BENCH_BLOCK_SIZE 65536 // Same as the radio
+#define BENCH_DEFAULT_SECONDS 10
+#define BENCH_DEFAULT_DEMOD_SAMP_RATE (MPX_SAMP_RATE * 2)
+#define BENCH_TONE_L 1000 // Synthetic left channel tone in Hz
+#define BENCH_TONE_R 2500 // Synthetic right channel tone in Hz
+#define BENCH_SETTLE_SECONDS 1 // Audio skipped before measuring separation, while the pilot locks
+
+#define BENCH_STAGE_FILTER_BB 0
+#define BENCH_STAGE_DEMOD 1
+#define BENCH_STAGE_FILTER_MPX 2
+#define BENCH_STAGE_STEREO_DEMOD 3
+#define BENCH_STAGE_NCO 4
+#define BENCH_STAGE_STEREO_ENCODE 5
+#define BENCH_STAGE_RDS_PUSH_IN 6
+#define BENCH_STAGE_RDS_PROCESS 7
+#define BENCH_STAGE_FLAC 8
+#define BENCH_STAGE_MP3 9
+#define BENCH_STAGE_OPUS 10
+#define BENCH_STAGE_COUNT 11
+
+static const char* BENCH_STAGE_NAMES[BENCH_STAGE_COUNT] = {
+	"filter_bb",
+	"demod",
+	"filter_mpx",
+	"stereo_demod",
+	"nco_bank",
+	"stereo_encode",
+	"rds_push_in",
+	"rds_process",
+	"flac_process",
+	"mp3_process",
+	"opus_process"
+};
+
+//Each stage counts the samples passed in, at its own rate
+static fmice_profiler profiler(BENCH_STAGE_NAMES, BENCH_STAGE_COUNT);
+
+/// <summary>
+/// Gets the power of one frequency in a signal with the Goertzel algorithm.
+/// </summary>
+static double tone_power(const std::vector<float>& signal, double frequency, double sampleRate) {
+	double coeff = 2 * cos(2 * M_PI * frequency / sampleRate);
+	double s1 = 0;
+	double s2 = 0;
+	for (size_t i = 0; i < signal.size(); i++) {
+		double s = signal[i] + (coeff * s1) - s2;
+		s2 = s1;
+		s1 = s;
+	}
+	return ((s1 * s1) + (s2 * s2) - (coeff * s1 * s2)) / ((double)signal.size() * signal.size());
+}
+
+/// <summary>
+/// Gets the total harmonic distortion of a tone in percent, counting harmonics up to the audio bandwidth.
+/// </summary>
+static double tone_thd(const std::vector<float>& signal, double frequency, double sampleRate) {
+	double harmonics = 0;
+	for (int h = 2; h * frequency < 15000; h++)
+		harmonics += tone_power(signal, h * frequency, sampleRate);
+	return 100 * sqrt(harmonics / tone_power(signal, frequency, sampleRate));
+}
+
+static void codec_sink(const uint8_t* data, int count, void* ctx) {
+	if (count > 0)
+		*((uint64_t*)ctx) += count;
+}
+
+/// <summary>
+/// Generates an FM stereo station with a pilot, two tones and an RDS-like subcarrier, modulated to IQ at SAMP_RATE.
+/// </summary>
+static void generate_iq(dsp::complex_t* out, int count) {
+	static double t = 0;
+	static double phase = 0;
+	static float bit = 1;
+	for (int i = 0; i < count; i++) {
+		//Flip the RDS bit at random every bit period
+		if (fmod(t * 1187.5, 1.0) < 1187.5 / SAMP_RATE)
+			bit = (rand() & 1) ? 1.0f : -1.0f;
+
+		//Build composite
+		double pilot = 2 * M_PI * 19000 * t;
+		double l = sin(2 * M_PI * BENCH_TONE_L * t);
+		double r = 0.5 * sin(2 * M_PI * BENCH_TONE_R * t);
+		double mpx = (0.45 * (l + r) / 2) + (0.45 * (l - r) / 2 * sin(2 * pilot)) + (0.09 * sin(pilot)) + (0.04 * bit * sin(3 * pilot));
+
+		//Modulate
+		phase = fmod(phase + (2 * M_PI * 75000 * mpx / SAMP_RATE), 2 * M_PI);
+		out[i].re = cos(phase) + ((rand() / (float)RAND_MAX) - 0.5f) * 0.01f;
+		out[i].im = sin(phase) + ((rand() / (float)RAND_MAX) - 0.5f) * 0.01f;
+		t += 1.0 / SAMP_RATE;
+	}
+}
+
+/// <summary>
+/// Checks the deemphasis against its scalar reference on noise, in odd-sized blocks so the tails and carried state get exercised. Returns mismatches.
+/// </summary>
+static int verify_deemphasis() {
+	float alpha = 1.0f - exp(-1.0f / (AUDIO_SAMP_RATE * (75 * 1e-6f)));
+	float stateL = 0, stateR = 0, refL = 0, refR = 0;
+	std::vector<float> expectL(BENCH_BLOCK_SIZE), expectR(BENCH_BLOCK_SIZE);
+	std::vector<dsp::stereo_t> out(BENCH_BLOCK_SIZE);
+	int mismatches = 0;
+	int total = 0;
+	for (int block = 0; block < 64; block++) {
+		int count = BENCH_BLOCK_SIZE - (rand() % 64);
+		for (int i = 0; i < count; i++) {
+			out[i].l = expectL[i] = (rand() / (float)RAND_MAX) - 0.5f;
+			out[i].r = expectR[i] = (rand() / (float)RAND_MAX) - 0.5f;
+		}
+		fmice_stereo_demod::deemphasis_stereo(alpha, &stateL, &stateR, out.data(), count);
+		fmice_stereo_demod::deemphasis_reference(alpha, &refL, expectL.data(), count);
+		fmice_stereo_demod::deemphasis_reference(alpha, &refR, expectR.data(), count);
+		for (int i = 0; i < count; i++) {
+			if (memcmp(&out[i].l, &expectL[i], sizeof(float)) != 0 || memcmp(&out[i].r, &expectR[i], sizeof(float)) != 0)
+				mismatches++;
+		}
+		total += count;
+	}
+	printf("deemphasis: %i of %i samples differ from the reference\n", mismatches, total);
+	return mismatches;
+}
+
+static void help(char* pgm) {
+	printf("Usage: %s\n", pgm);
+	printf("    [--seconds Seconds of signal to process (default is %i)]\n", BENCH_DEFAULT_SECONDS);
+	printf("    [--input IQ file at %i Hz to use instead of a synthetic signal (looped if short)]\n", SAMP_RATE);
+	printf("    [--input-format File format <cf32|cs16|cu8|wav> (default is cf32)]\n");
+	printf("    [--demod-rate FM demodulator sample rate (default is %i)]\n", BENCH_DEFAULT_DEMOD_SAMP_RATE);
+	printf("    [--stereo-engine Stereo decoder <complex|real> (default is complex)]\n");
+	printf("    [--json Print results as JSON]\n");
+	printf("    [--verify Check optimized kernels against their references instead of benchmarking]\n");
+}
+
+int main(int argc, char* argv[]) {
+	static const struct option long_opts[] = {
+		{ "seconds", required_argument, NULL, 1 },
+		{ "input", required_argument, NULL, 2 },
+		{ "input-format", required_argument, NULL, 3 },
+		{ "demod-rate", required_argument, NULL, 4 },
+		{ "json", no_argument, NULL, 5 },
+		{ "verify", no_argument, NULL, 6 },
+		{ "stereo-engine", required_argument, NULL, 7 },
+		{ 0 }
+	};
+
+	//Parse args
+	int seconds = BENCH_DEFAULT_SECONDS;
+	const char* inputPath = 0;
+	fmice_device_file_format inputFormat = FMICE_FILE_FORMAT_CF32;
+	int demodRate = BENCH_DEFAULT_DEMOD_SAMP_RATE;
+	bool json = false;
+	bool verify = false;
+	int stereoEngine = FMICE_STEREO_ENGINE_COMPLEX;
+	int opt;
+	while ((opt = getopt_long(argc, argv, "", long_opts, NULL)) != -1) {
+		switch (opt) {
+		case 1: seconds = atoi(optarg); break;
+		case 2: inputPath = optarg; break;
+		case 3:
+			if (!fmice_device_file::parse_format(optarg, &inputFormat)) {
+				printf("Unknown input format \"%s\".\n", optarg);
+				return -1;
+			}
+			break;
+		case 4: demodRate = atoi(optarg); break;
+		case 5: json = true; break;
+		case 6: verify = true; break;
+		case 7:
+			if (!fmice_stereo_demod::parse_engine(optarg, &stereoEngine)) {
+				printf("Unknown stereo engine \"%s\".\n", optarg);
+				return -1;
+			}
+			break;
+		default:
+			help(argv[0]);
+			return -1;
+		}
+	}
+	if (seconds <= 0 || demodRate <= 0 || (demodRate % MPX_SAMP_RATE) != 0 || demodRate > SAMP_RATE) {
+		help(argv[0]);
+		return -1;
+	}
+
+	//Verify only if asked to
+	if (verify) {
+		int failures = 0;
+		failures += verify_deemphasis();
+		return failures == 0 ? 0 : 1;
+	}
+
+	//Open input file if set
+	fmice_device_file* file = 0;
+	if (inputPath != 0) {
+		file = new fmice_device_file(SAMP_RATE);
+		file->open(inputPath, inputFormat, true, false);
+		file->start();
+	}
+
+	//Allocate buffers
+	size_t alignment = volk_get_alignment();
+	dsp::complex_t* iq = (dsp::complex_t*)volk_malloc(sizeof(dsp::complex_t) * BENCH_BLOCK_SIZE, alignment);
+	dsp::complex_t* bb = (dsp::complex_t*)volk_malloc(sizeof(dsp::complex_t) * BENCH_BLOCK_SIZE, alignment);
+	float* demodOut = (float*)volk_malloc(sizeof(float) * BENCH_BLOCK_SIZE, alignment);
+	float* mpx = (float*)volk_malloc(sizeof(float) * BENCH_BLOCK_SIZE, alignment);
+	float* mpxOut = (float*)volk_malloc(sizeof(float) * BENCH_BLOCK_SIZE, alignment);
+	dsp::stereo_t* aud = (dsp::stereo_t*)volk_malloc(sizeof(dsp::stereo_t) * BENCH_BLOCK_SIZE, alignment);
+
+	//Set up the same chain as the radio
+	fmice_decimator filterBb(BENCH_BLOCK_SIZE);
+	filterBb.init(SAMP_RATE, demodRate, 125000, 15000);
+	dsp::demod::Quadrature demod;
+	demod.init(NULL, 85000, demodRate);
+	dsp::tap<float> filterMpxTaps = dsp::taps::lowPass(61500, 2000, demodRate);
+	dsp::filter::DecimatingFIR<float, float> filterMpx;
+	filterMpx.init(NULL, filterMpxTaps, demodRate / MPX_SAMP_RATE);
+	fmice_stereo_demod stereoDemod(BENCH_BLOCK_SIZE);
+	stereoDemod.init(MPX_SAMP_RATE, AUDIO_DECIM_RATE, 15000, 4000, 75, stereoEngine);
+	fmice_stereo_encode stereoEncode(BENCH_BLOCK_SIZE, powf(10, -30 / 20.0f), MPX_SAMP_RATE, 15000, 4000);
+	fmice_nco_bank pilotNco(BENCH_BLOCK_SIZE, 19000, MPX_SAMP_RATE, 2);
+	fmice_rds rds(demodRate, MPX_SAMP_RATE, BENCH_BLOCK_SIZE, (float)BENCH_BLOCK_SIZE / SAMP_RATE, 1, powf(10, -10 / 20.0f));
+
+	//Set up codecs, counting their output
+	uint64_t flacBytes = 0;
+	uint64_t mp3Bytes = 0;
+	uint64_t opusBytes = 0;
+	fmice_codec_flac_settings_t flacSettings;
+	flacSettings.bits = FMICE_FLAC_DEFAULT_BITS;
+	flacSettings.level = FMICE_FLAC_DEFAULT_LEVEL;
+	flacSettings.blocksize = FMICE_FLAC_DEFAULT_BLOCKSIZE;
+	flacSettings.threads = FMICE_FLAC_DEFAULT_THREADS;
+	fmice_codec_flac flac(MPX_SAMP_RATE, 1, &flacSettings);
+	flac.set_callback(codec_sink, &flacBytes);
+	flac.reset();
+	fmice_codec_mp3 mp3(AUDIO_SAMP_RATE, 2);
+	mp3.set_callback(codec_sink, &mp3Bytes);
+	mp3.reset();
+	fmice_codec_opus_settings_t opusSettings;
+	opusSettings.bitrate = FMICE_OPUS_DEFAULT_BITRATE;
+	opusSettings.complexity = FMICE_OPUS_DEFAULT_COMPLEXITY;
+	opusSettings.frame_size = FMICE_OPUS_DEFAULT_FRAME_SIZE;
+	fmice_codec_opus opus(AUDIO_SAMP_RATE, 2, &opusSettings);
+	opus.set_callback(codec_sink, &opusBytes);
+	opus.reset();
+
+	//Keep the decoded audio to measure separation and distortion with
+	std::vector<float> audL;
+	std::vector<float> audR;
+
+	//Run
+	int blocks = (int)(((int64_t)seconds * SAMP_RATE) / BENCH_BLOCK_SIZE);
+	uint64_t start;
+	for (int i = 0; i < blocks; i++) {
+		//Get input
+		if (file != 0)
+			file->read(iq, BENCH_BLOCK_SIZE);
+		else
+			generate_iq(iq, BENCH_BLOCK_SIZE);
+
+		//Front-end
+		start = fmice_now_ns();
+		int bbCount = filterBb.process(BENCH_BLOCK_SIZE, iq, bb);
+		profiler.add(BENCH_STAGE_FILTER_BB, start, BENCH_BLOCK_SIZE);
+
+		start = fmice_now_ns();
+		int demodCount = demod.process(bbCount, bb, demodOut);
+		profiler.add(BENCH_STAGE_DEMOD, start, bbCount);
+
+		start = fmice_now_ns();
+		int mpxCount = filterMpx.process(demodCount, demodOut, mpx);
+		profiler.add(BENCH_STAGE_FILTER_MPX, start, demodCount);
+		memcpy(mpxOut, mpx, sizeof(float) * mpxCount);
+
+		//Stereo
+		start = fmice_now_ns();
+		int audCount = stereoDemod.process(mpx, aud, mpxCount);
+		profiler.add(BENCH_STAGE_STEREO_DEMOD, start, mpxCount);
+		if ((int64_t)i * BENCH_BLOCK_SIZE >= (int64_t)BENCH_SETTLE_SECONDS * SAMP_RATE) {
+			for (int j = 0; j < audCount; j++) {
+				audL.push_back(aud[j].l);
+				audR.push_back(aud[j].r);
+			}
+		}
+
+		start = fmice_now_ns();
+		pilotNco.process(mpxCount);
+		profiler.add(BENCH_STAGE_NCO, start, mpxCount);
+
+		start = fmice_now_ns();
+		stereoEncode.process(mpxOut, stereoDemod.lpr, stereoDemod.lmr, pilotNco.get(1), pilotNco.get(2), mpxCount);
+		profiler.add(BENCH_STAGE_STEREO_ENCODE, start, mpxCount);
+
+		//RDS
+		start = fmice_now_ns();
+		rds.push_in(demodOut, demodCount);
+		profiler.add(BENCH_STAGE_RDS_PUSH_IN, start, demodCount);
+
+		start = fmice_now_ns();
+		rds.process(mpxOut, mpxOut, mpxCount, false);
+		profiler.add(BENCH_STAGE_RDS_PROCESS, start, mpxCount);
+
+		//Codecs
+		start = fmice_now_ns();
+		flac.process(mpxOut, mpxCount);
+		profiler.add(BENCH_STAGE_FLAC, start, mpxCount);
+
+		start = fmice_now_ns();
+		mp3.process((float*)aud, audCount);
+		profiler.add(BENCH_STAGE_MP3, start, audCount);
+
+		start = fmice_now_ns();
+		opus.process((float*)aud, audCount);
+		profiler.add(BENCH_STAGE_OPUS, start, audCount);
+	}
+
+	//Report - Each block is BENCH_BLOCK_SIZE device samples, so the real-time factor is against SAMP_RATE for every stage
+	double blockSeconds = (double)BENCH_BLOCK_SIZE / SAMP_RATE;
+	if (json) {
+		printf("{\"samp_rate\":%i,\"demod_samp_rate\":%i,\"block_size\":%i,\"blocks\":%i,\"input\":\"%s\",\"stages\":[",
+			SAMP_RATE, demodRate, BENCH_BLOCK_SIZE, blocks, inputPath != 0 ? "file" : "synthetic");
+	}
+	else {
+		printf("%i blocks of %i samples at %i Hz (%s input)\n", blocks, BENCH_BLOCK_SIZE, SAMP_RATE, inputPath != 0 ? "file" : "synthetic");
+		printf("%-16s %14s %10s %12s %10s %10s\n", "stage", "samples/s", "ns/sample", "x realtime", "p50 us", "p99 us");
+	}
+	uint64_t totalNs = 0;
+	for (int i = 0; i < BENCH_STAGE_COUNT; i++) {
+		const char* name = profiler.get_name(i);
+		uint64_t stageNs = profiler.get_total_ns(i);
+		uint64_t samples = profiler.get_total_samples(i);
+		double elapsed = stageNs / 1e9;
+		double rate = samples / elapsed;
+		double nsPerSample = (double)stageNs / samples;
+		double rtf = (blocks * blockSeconds) / elapsed;
+		double p50 = profiler.get_percentile(i, 0.50) / 1000.0;
+		double p99 = profiler.get_percentile(i, 0.99) / 1000.0;
+		totalNs += stageNs;
+		if (json)
+			printf("%s{\"name\":\"%s\",\"samples\":%llu,\"samples_per_sec\":%.1f,\"ns_per_sample\":%.3f,\"realtime_factor\":%.2f,\"p50_us\":%.1f,\"p99_us\":%.1f}",
+				i == 0 ? "" : ",", name, (unsigned long long)samples, rate, nsPerSample, rtf, p50, p99);
+		else
+			printf("%-16s %14.0f %10.2f %12.2f %10.1f %10.1f\n", name, rate, nsPerSample, rtf, p50, p99);
+	}
+	double totalRtf = (blocks * blockSeconds) / (totalNs / 1e9);
+
+	//Measure the stereo decoder on the synthetic tones - Each is only in one channel, so anything in the other is crosstalk
+	double sepL = 0, sepR = 0, thdL = 0, thdR = 0;
+	if (inputPath == 0 && !audL.empty()) {
+		sepL = 10 * log10(tone_power(audL, BENCH_TONE_L, AUDIO_SAMP_RATE) / tone_power(audR, BENCH_TONE_L, AUDIO_SAMP_RATE));
+		sepR = 10 * log10(tone_power(audR, BENCH_TONE_R, AUDIO_SAMP_RATE) / tone_power(audL, BENCH_TONE_R, AUDIO_SAMP_RATE));
+		thdL = tone_thd(audL, BENCH_TONE_L, AUDIO_SAMP_RATE);
+		thdR = tone_thd(audR, BENCH_TONE_R, AUDIO_SAMP_RATE);
+	}
+	const char* engineName = stereoEngine == FMICE_STEREO_ENGINE_REAL ? "real" : "complex";
+
+	if (json) {
+		printf("],\"total_realtime_factor\":%.2f,\"flac_bytes\":%llu,\"mp3_bytes\":%llu,\"opus_bytes\":%llu", totalRtf, (unsigned long long)flacBytes, (unsigned long long)mp3Bytes, (unsigned long long)opusBytes);
+		printf(",\"stereo_engine\":\"%s\",\"separation_l_db\":%.1f,\"separation_r_db\":%.1f,\"thd_l_pct\":%.4f,\"thd_r_pct\":%.4f}\n", engineName, sepL, sepR, thdL, thdR);
+	}
+	else {
+		printf("%-16s %14s %10s %12.2f\n", "total", "", "", totalRtf);
+		if (inputPath == 0)
+			printf("stereo (%s): separation L %.1f dB, R %.1f dB; THD L %.4f%%, R %.4f%%\n", engineName, sepL, sepR, thdL, thdR);
+	}
+
+	return 0;
+}
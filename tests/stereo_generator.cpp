@@ -6,6 +6,7 @@
 #include <dsp/taps/low_pass.h>
 #include "../stereo_demod.h"
 #include "../stereo_encode.h"
+#include "../nco.h"
 
 #define RADIO_BUFFER_SIZE 100//(65536/16)
 #define INPUT_SAMP_RATE 768000
@@ -19,13 +20,27 @@ unsigned char wavHeader[44] = {
 	0x64, 0x61, 0x74, 0x61, 0x00, 0x60, 0x2D, 0x09
 };
 
-int main() {
+FILE* open_file(const char* path, const char* mode) {
+	FILE* file = fopen(path, mode);
+	if (file == 0)
+		printf("Failed to open file \"%s\".\n", path);
+	return file;
+}
+
+int main(int argc, char* argv[]) {
+	//Check args
+	if (argc != 5) {
+		printf("Usage: %s [input cf32 IQ file] [output MPX WAV file] [output raw WAV file] [output confidence WAV file]\n", argv[0]);
+		return -1;
+	}
+
 	//Open input and output files
-	//FILE* fileInput = fopen("/media/sf_VMShare/kqlx stereo test.bin", "rb");
-	FILE* fileInput = fopen("/media/sf_VMShare/stereo test in.bin", "rb");
-	FILE* fileOutput = fopen("/media/sf_VMShare/stereo remod.wav", "wb");
-	FILE* fileOutputRaw = fopen("/media/sf_VMShare/stereo remod raw.wav", "wb");
-	FILE* fileOutputConf = fopen("/media/sf_VMShare/stereo remod conf.wav", "wb");
+	FILE* fileInput = open_file(argv[1], "rb");
+	FILE* fileOutput = open_file(argv[2], "wb");
+	FILE* fileOutputRaw = open_file(argv[3], "wb");
+	FILE* fileOutputConf = open_file(argv[4], "wb");
+	if (fileInput == 0 || fileOutput == 0 || fileOutputRaw == 0 || fileOutputConf == 0)
+		return -1;
 
 	//Set up and write WAV buffer
 	*((int*)&wavHeader[24]) = SAMP_RATE;
@@ -71,6 +86,7 @@ int main() {
 
 	//Init modulator
 	fmice_stereo_encode encoder(RADIO_BUFFER_SIZE, 0.05f, SAMP_RATE, 17000, 2000);
+	fmice_nco_bank pilot(RADIO_BUFFER_SIZE, 19000, SAMP_RATE, 2);
 
 	//Init confidence demod
 	fmice_stereo_demod decoder2(RADIO_BUFFER_SIZE);
@@ -111,7 +127,8 @@ int main() {
 		decoder.process(demod.out.writeBuf, audBuffer, count);
 
 		//Process stereo mod
-		encoder.process(mpxBuffer, decoder.lpr, decoder.lmr, count);
+		pilot.process(count);
+		encoder.process(mpxBuffer, decoder.lpr, decoder.lmr, pilot.get(1), pilot.get(2), count);
 
 		//Process confidence stereo demod
 		int audioCount = decoder2.process(mpxBuffer, confBuffer, count);
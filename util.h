@@ -0,0 +1,25 @@
+#pragma once
+
+#include <stdint.h>
+#include <time.h>
+
+/// <summary>
+/// Greatest common divisor, used to find the smallest period that rates and frequencies repeat over.
+/// </summary>
+static inline int fmice_gcd(int a, int b) {
+	while (b != 0) {
+		int t = a % b;
+		a = b;
+		b = t;
+	}
+	return a;
+}
+
+/// <summary>
+/// Gets the monotonic clock in nanoseconds, for timing and deadlines.
+/// </summary>
+static inline int64_t fmice_now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((int64_t)ts.tv_sec * 1000000000LL) + ts.tv_nsec;
+}